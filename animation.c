@@ -10,15 +10,32 @@
  *  version 2 as published by the Free Software Foundation.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/timerfd.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "animation.h"
-#include "bmp.h"
+#include "arena.h"
 #include "fb.h"
+#include "loader.h"
 #include "log.h"
+#include "pack.h"
+#include "rle.h"
+#include "scale.h"
+#include "stats.h"
 #include "string_list.h"
 
+/* Unchanged runs shorter than this (in pixels) do not split a dirty span */
+#define DELTA_MERGE_GAP		8
+
 static inline void center2top_left(struct image_info *image, int cx, int cy,
 		int *top_left_x, int *top_left_y)
 {
@@ -26,46 +43,1282 @@ static inline void center2top_left(struct image_info *image, int cx, int cy,
 	*top_left_y = cy - image->height / 2;
 }
 
+static inline int prev_frame(struct animation *a, int fnum)
+{
+	return (fnum) ? fnum - 1 : animation_frame_count(a) - 1;
+}
+
+static long elapsed_ms(const struct timespec *since)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - since->tv_sec) * 1000
+			+ (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static void timespec_add_ns(struct timespec *t, unsigned long long ns)
+{
+	t->tv_sec += ns / 1000000000;
+	t->tv_nsec += ns % 1000000000;
+	if (t->tv_nsec >= 1000000000) {
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000;
+	}
+}
+
+static long long timespec_diff_ns(const struct timespec *a,
+		const struct timespec *b)
+{
+	return (a->tv_sec - b->tv_sec) * 1000000000LL
+			+ (a->tv_nsec - b->tv_nsec);
+}
+
+/* Time at which frame 'tick' of the schedule is due */
+static void animation_deadline(struct animation *a, unsigned long long tick,
+		struct timespec *t)
+{
+	*t = a->epoch;
+	timespec_add_ns(t, tick / a->period_den * a->period
+			+ tick % a->period_den * a->period / a->period_den);
+}
+
+/*
+ * Put a running animation into the schedule of the scene, after those whose
+ * next frames are due before or at the same time
+ */
+static void schedule_insert(struct animation *banner, struct animation *a)
+{
+	struct animation **p = &banner->schedule;
+
+	animation_deadline(a, a->tick, &a->deadline);
+	while (*p && timespec_diff_ns(&(*p)->deadline, &a->deadline) <= 0)
+		p = &(*p)->next_due;
+
+	a->next_due = *p;
+	*p = a;
+}
+
+/*
+ * Wait for the timer to expire at 'wake', and notice meanwhile if there are
+ * events, but leave them to be handled at the end of the frame. Returns -1
+ * if the timer does not work.
+ */
+static int animation_wait_events(struct animation *banner,
+		const struct timespec *wake)
+{
+	struct itimerspec timer = { .it_value = *wake, };
+	struct pollfd fds[2] = {
+		{ .fd = banner->timer_fd, .events = POLLIN, },
+		{ .fd = banner->event_fd, .events = POLLIN, },
+	};
+	uint64_t expired;
+
+	if (timerfd_settime(banner->timer_fd, TFD_TIMER_ABSTIME, &timer, NULL))
+		return -1;
+
+	while (1) {
+		if (poll(fds, (banner->events) ? 1 : 2, -1) < 0) {
+			if (errno != EINTR)
+				return -1;
+			stats_poll(banner);
+			continue;
+		}
+
+		if (!banner->events && fds[1].revents)
+			banner->events = 1;
+		if (fds[0].revents)
+			break;
+	}
+
+	return (read(banner->timer_fd, &expired, sizeof(expired)) < 0
+			&& errno != EAGAIN) ? -1 : 0;
+}
+
+/*
+ * Sleep until the next change of the scene is due, or 'ahead' nanoseconds
+ * before that
+ */
+static void animation_wait(struct animation *banner, long ahead)
+{
+	struct timespec wake;
+
+	if (!banner->schedule || !banner->schedule->period)
+		return;
+
+	wake = banner->schedule->deadline;
+	wake.tv_nsec -= ahead;
+	while (wake.tv_nsec < 0) {
+		wake.tv_sec--;
+		wake.tv_nsec += 1000000000;
+	}
+
+	if (banner->watch_events && !animation_wait_events(banner, &wake))
+		return;
+
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL)
+			== EINTR)
+		stats_poll(banner);
+}
+
+/*
+ * Remember how late the current frame has been presented, measure the frame
+ * rate once a second and the time the last command took to show
+ */
+static void animation_presented(struct animation *banner)
+{
+	struct timespec now, due;
+	long long late, measured;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	banner->fps_frames++;
+	measured = timespec_diff_ns(&now, &banner->fps_since);
+	if (measured >= 1000000000) {
+		banner->fps = banner->fps_frames * 1e9 / measured;
+		banner->fps_frames = 0;
+		banner->fps_since = now;
+	}
+
+	if (banner->command_time.tv_sec || banner->command_time.tv_nsec) {
+		measured = timespec_diff_ns(&now, &banner->command_time) / 1000;
+		banner->command_latency_us = (measured > UINT_MAX)
+				? UINT_MAX : (unsigned int)measured;
+		if (banner->command_latency_us > banner->command_latency_max_us)
+			banner->command_latency_max_us =
+					banner->command_latency_us;
+		banner->command_time.tv_sec = banner->command_time.tv_nsec = 0;
+		LOG(LOG_DEBUG, "Command shown in %u us",
+				banner->command_latency_us);
+	}
+
+	if (!banner->schedule || !banner->schedule->period)
+		return;
+
+	due = banner->schedule->deadline;
+	late = timespec_diff_ns(&now, &due) / 1000;
+
+	banner->lateness_us[banner->presented++ % ANIMATION_TIMING_SAMPLES] =
+			(late > INT_MAX) ? INT_MAX : (late < INT_MIN)
+				? INT_MIN : (int)late;
+}
+
+/*
+ * Bring the page being drawn to frame 'fnum' of a layer. Only the pixels
+ * that differ from the frame on the page are written if it is one of the two
+ * preceding ones. Returns 1 if the page has changed, -1 on error.
+ */
+static int animation_draw(struct animation *a, int fnum)
+{
+	struct screen_info *fb = a->fb;
+	struct image_info *frame = &a->frames[fnum];
+	struct frame_delta *delta = NULL, *older = NULL;
+	struct fb_blit *blit = &a->blits[fnum];
+	const int prev = prev_frame(a, fnum);
+	int *shown = &a->shown[fb->page];
+	int x, y;
+	int rc;
+
+	if (*shown == fnum)
+		return 0;
+
+	center2top_left(frame, a->x, a->y, &x, &y);
+	if (!blit->width && fb_plan_bitmap(fb, x, y, frame, blit))
+		return -1;
+
+	if (*shown == prev)
+		delta = a->deltas[fnum];
+	else if (*shown == prev_frame(a, prev) && a->deltas[prev]) {
+		/* Two frames behind, catch up with both changes */
+		older = a->deltas[prev];
+		delta = a->deltas[fnum];
+	}
+
+	if (a->backdrop) {
+		/* Put back the screen contents where the frame on the page
+		 * has pixels and this one has not, then blend */
+		if (delta) {
+			rc = fb_write_spans(fb, x, y, a->backdrop, delta->spans,
+					delta->count);
+			if (!rc && older)
+				rc = fb_write_spans(fb, x, y, a->backdrop,
+						older->spans, older->count);
+		} else /* Of the size of the frame */
+			rc = fb_blit(fb, blit, a->backdrop);
+
+		if (!rc)
+			rc = fb_blit(fb, blit, frame);
+	} else if (delta) {
+		rc = fb_write_spans(fb, x, y, frame, delta->spans,
+				delta->count);
+		if (!rc && older)
+			rc = fb_write_spans(fb, x, y, frame, older->spans,
+					older->count);
+	} else
+		rc = fb_blit(fb, blit, frame);
+
+	*shown = (rc) ? -1 : fnum;
+
+	return (rc) ? -1 : 1;
+}
+
+/* Whether frames 'i' of layer 'a' and 'j' of layer 'b' are drawn over each
+ * other */
+static int layers_overlap(struct animation *a, int i, struct animation *b,
+		int j)
+{
+	struct image_info *p = &a->frames[i], *q = &b->frames[j];
+	int ax, ay, bx, by;
+
+	center2top_left(p, a->x, a->y, &ax, &ay);
+	center2top_left(q, b->x, b->y, &bx, &by);
+
+	return ax < bx + q->width && bx < ax + p->width
+			&& ay < by + q->height && by < ay + p->height;
+}
+
+/*
+ * Draw the current frames of the animation and of its sprite layers, in
+ * that order, leaving out those that have not been started. Only the
+ * rectangles of the layers that change are drawn, but a layer that overlaps
+ * a changed one is drawn fully again to stay over it.
+ */
+static int animation_draw_layers(struct animation *banner)
+{
+	struct animation *l, *m;
+
+	for (l = banner; l; l = l->next_layer) {
+		const int rc = (l->frame < 0) ? 0 : animation_draw(l, l->frame);
+
+		if (rc < 0)
+			return -1;
+
+		for (m = l->next_layer; rc && m; m = m->next_layer)
+			if (m->frame >= 0 && layers_overlap(l, l->frame,
+					m, m->frame))
+				m->shown[l->fb->page] = -1;
+	}
+
+	return 0;
+}
+
+/* Whether the frames to be shown are all on screen already */
+static int animation_on_screen(struct animation *banner)
+{
+	const int front = fb_front(banner->fb);
+	struct animation *l;
+
+	for (l = banner; l; l = l->next_layer)
+		if (l->frame >= 0 && l->shown[front] != l->frame)
+			return 0;
+
+	return 1;
+}
+
 /**
- * Run the animation either infinitely or until 'frames' frames have been shown
+ * Write the frames that are due to the screen when they are due, together
+ * with the current frames of the other layers. With two pages, the frames
+ * are drawn ahead of time and flipped to at the vertical blank closest to
+ * when they are due.
  */
-int animation_run(struct animation *banner, int frames)
+static int animation_show(struct animation *banner)
 {
-	const int infinitely = frames < 0;
-	int fnum = banner->frame_num;
+	struct screen_info *fb = banner->fb;
+	unsigned long long written = fb->bytes_written;
+	struct animation *l;
 	int rc = 0;
 
-	while (infinitely || frames--) {
-		int x, y;
-		struct image_info *frame = &banner->frames[fnum];
+	banner->frame_bytes = 0;
+
+	if (animation_on_screen(banner)) { /* Nothing to change */
+		if (banner->schedule->period)
+			animation_wait(banner, 0);
+		else
+			usleep(fb->refresh_us); /* Do not spin while holding */
+		return 0;
+	}
+
+	if (fb->pages < 2)
+		animation_wait(banner, 0);
+
+	/* The page may hold the frames already and only have to be shown */
+	rc = animation_draw_layers(banner);
+	banner->frame_bytes = (unsigned int)(fb->bytes_written - written);
+
+	if (!rc && fb->pages > 1) {
+		/* The flip waits for a vertical blank, so wake up half a
+		 * refresh early to catch the one closest to the deadline */
+		animation_wait(banner, (fb->vsync) ? fb->refresh_us * 500L : 0);
+		rc = fb_flip(fb);
+
+		/* If flipping has failed, the frames are copied on screen */
+		if (fb->pages < 2)
+			for (l = banner; l; l = l->next_layer)
+				l->shown[fb->page] = l->shown[!fb->page];
+	}
+
+	if (!rc)
+		animation_presented(banner);
+
+	if (!rc && !banner->frames_shown++)
+		LOG(LOG_INFO, "First frame shown in %ld ms since start",
+				elapsed_ms(&banner->start));
+
+	return rc;
+}
+
+/**
+ * Show the first frame of the animation as soon as it is loaded, before
+ * the sprite layers and the rest of the program are set up. With 'clear',
+ * the page is cleared around the frame only, and the other page is left
+ * for the caller to clear once the frame is on screen.
+ */
+int animation_show_first(struct animation *a, int clear)
+{
+	struct screen_info *fb = a->fb;
+	struct image_info *frame = &a->frames[0];
+	int x, y;
+
+	center2top_left(frame, a->x, a->y, &x, &y);
+	if (fb_plan_bitmap(fb, x, y, frame, &a->blits[0]))
+		return -1;
+	if (clear)
+		fb_clear(fb, fb->page, &a->blits[0]);
+
+	if (animation_draw(a, 0) < 0)
+		return -1;
+	a->frame = 0;
+	if (fb->pages > 1) {
+		if (fb_flip(fb))
+			return -1;
+		if (fb->pages < 2)
+			a->shown[fb->page] = a->shown[!fb->page];
+	}
+
+	a->frames_shown++;
+	LOG(LOG_INFO, "First frame shown in %ld ms since start",
+			elapsed_ms(&a->start));
+
+	return 0;
+}
+
+static void layer_schedule(struct animation *l, const struct timespec *now)
+{
+	struct timespec due;
+
+	animation_deadline(l, l->tick, &due);
+
+	if ((!l->epoch.tv_sec && !l->epoch.tv_nsec)
+			|| timespec_diff_ns(now, &due) > 0) {
+		l->epoch = *now;
+		l->tick = 0;
+	}
+}
+
+/*
+ * Put the running animations into the schedule of the scene by the deadlines
+ * of their next frames. The schedule of each starts over from now if it has
+ * not been started or if the animation has been paused past its current
+ * frame.
+ */
+static void animation_schedule(struct animation *banner)
+{
+	struct timespec now;
+	struct animation *l;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	banner->schedule = NULL;
+	for (l = banner; l; l = l->next_layer) {
+		l->due = 0;
+		if (!l->run)
+			continue;
+
+		layer_schedule(l, &now);
+		schedule_insert(banner, l);
+	}
+}
+
+/**
+ * Called when the current frame of the schedule is over, at time 'now'. If
+ * it is more than a frame period late, either skip the frames whose time has
+ * passed, up to 'max_skip', or move the schedule on, so that the next frame
+ * is shown right away and the following ones at the usual pace. Returns the
+ * number of frames skipped.
+ */
+int animation_next_tick_at(struct animation *banner,
+		const struct timespec *now, int max_skip)
+{
+	struct timespec due;
+	int skipped = 0;
+
+	banner->tick++;
+	if (!banner->period)
+		return 0;
+
+	animation_deadline(banner, banner->tick + 1, &due);
+	if (timespec_diff_ns(now, &due) < 0)
+		return 0;
+
+	if (!banner->drop_frames) {
+		banner->epoch = *now;
+		banner->tick = 0;
+		banner->late++;
+		return 0;
+	}
+
+	while (skipped < max_skip && timespec_diff_ns(now, &due) >= 0) {
+		banner->tick++;
+		skipped++;
+		animation_deadline(banner, banner->tick + 1, &due);
+	}
+
+	banner->dropped += skipped;
+
+	return skipped;
+}
 
-		center2top_left(frame, banner->x, banner->y, &x, &y);
-		rc = fb_write_bitmap(banner->fb, x, y, frame);
+static int animation_next_tick(struct animation *banner, int max_skip)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return animation_next_tick_at(banner, &now, max_skip);
+}
+
+/*
+ * Find out which animations show their next frames in the coming step of the
+ * scene: the first in the schedule, those due at the same time and those
+ * whose time has come meanwhile. They are at the head of the schedule.
+ */
+static void animation_due(struct animation *banner)
+{
+	struct timespec step = banner->schedule->deadline, now;
+	struct animation *l;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	if (timespec_diff_ns(&now, &step) > 0)
+		step = now;
+
+	for (l = banner->schedule; l && timespec_diff_ns(&l->deadline, &step)
+			<= 0; l = l->next_due) {
+		const int ready = animation_frames_ready(l);
+
+		/* Hold on the newest frame until the next one is loaded */
+		if (l->frame_num >= ready)
+			l->frame_num = ready - 1;
+		l->frame = l->frame_num;
+		l->due = 1;
+	}
+}
+
+/*
+ * Move the animations that have shown their frames on to the next ones and
+ * back into the schedule, unless their runs are over. Returns the number of
+ * frames shown; 'ended' is set if a run has come to its end.
+ */
+static int animation_next(struct animation *banner, int *ended)
+{
+	struct animation *l = banner->schedule, *next;
+	int shown = 0;
 
+	/* Taken off first, as they go back in among the rest */
+	while (banner->schedule && banner->schedule->due)
+		banner->schedule = banner->schedule->next_due;
+
+	for (; l && l->due; l = next) {
+		int skip;
+
+		next = l->next_due;
+		if (l->run > 0)
+			l->run--;
+		skip = animation_next_tick(l, (l->run < 0) ? INT_MAX : l->run);
+		if (l->run > 0)
+			l->run -= skip;
+
+		l->frame_num = (l->frame_num + 1 + skip)
+				% animation_frame_count(l);
+		l->due = 0;
+		shown++;
+
+		if (l->run)
+			schedule_insert(banner, l);
+		else
+			*ended = 1;
+	}
+
+	return shown;
+}
+
+/* See if there are events without waiting */
+static void animation_check_events(struct animation *banner)
+{
+	struct pollfd fd = { .fd = banner->event_fd, .events = POLLIN, };
+
+	if (poll(&fd, 1, 0) > 0)
+		banner->events = 1;
+}
+
+/**
+ * Play the animation and its sprite layers that have runs, each at its own
+ * pace, until one of the runs ends. An animation runs infinitely if its
+ * 'run' is negative, or until it has shown or skipped that many frames,
+ * counting them down. The scene sleeps until the earliest of their next
+ * frames is due. When events are watched, stop at the end of a step when
+ * there are some.
+ */
+int animation_play(struct animation *banner)
+{
+	unsigned long long written = banner->fb->bytes_written;
+	int rc = 0, ended = 0;
+	int shown = 0;
+
+	animation_schedule(banner);
+	if (!banner->fps_since.tv_sec && !banner->fps_since.tv_nsec)
+		clock_gettime(CLOCK_MONOTONIC, &banner->fps_since);
+
+	while (banner->schedule && !ended) {
+		animation_due(banner);
+		rc = animation_show(banner);
 		if (rc)
 			break;
+		shown += animation_next(banner, &ended);
 
-		if (++fnum == banner->frame_count)
-			fnum = 0;
+		stats_poll(banner);
 
-		if (banner->interval) {
-			const struct timespec sleep_time = {
-				.tv_sec = banner->interval / 1000,
-				.tv_nsec = (banner->interval % 1000) * 1000000,
-			};
-			nanosleep(&sleep_time, NULL);
+		if (banner->watch_events) {
+			if (!banner->events)
+				animation_check_events(banner);
+			if (banner->events)
+				break;
 		}
 	}
 
-	banner->frame_num = fnum;
+	if (shown) {
+		LOG(LOG_DEBUG, "%d frames shown, %llu bytes written, %llu bytes"
+				" per frame", shown,
+				banner->fb->bytes_written - written,
+				(banner->fb->bytes_written - written) / shown);
+		if (LogDebug)
+			stats_log_timing(banner, LOG_DEBUG);
+	}
 
 	return rc;
 }
 
+/**
+ * Run the animation either infinitely or until 'frames' frames have been
+ * shown or skipped, with its sprite layers running along infinitely
+ */
+int animation_run(struct animation *banner, int frames)
+{
+	struct animation *l;
+	int rc = 0;
+
+	for (l = banner->next_layer; l; l = l->next_layer)
+		l->run = -1;
+	banner->run = (frames < 0) ? -1 : frames;
+
+	while (!rc && banner->run)
+		rc = animation_play(banner);
+
+	return rc;
+}
+
+static int delta_add_span(struct frame_delta *d, int *size, int x, int y,
+		int width)
+{
+	if (d->count == *size) {
+		int new_size = (*size) ? *size * 2 : 16;
+		struct fb_span *s = realloc(d->spans, new_size * sizeof(*s));
+
+		if (!s)
+			return -1;
+		d->spans = s;
+		*size = new_size;
+	}
+
+	d->spans[d->count].x = x;
+	d->spans[d->count].y = y;
+	d->spans[d->count].width = width;
+	d->count++;
+
+	return 0;
+}
+
+/**
+ * Find the horizontal spans in which 'to' differs from 'from'. Returns NULL
+ * if the frames differ in size or palette, if the spans cover most of the
+ * frame anyway, or on memory shortage; the frame is written fully then.
+ */
+static struct frame_delta *delta_create(struct image_info *from,
+		struct image_info *to)
+{
+	const int bytes = to->bpp / 8;
+	const int line_size = to->width * bytes;
+	const size_t from_pitch = fb_bitmap_pitch(from);
+	const size_t to_pitch = fb_bitmap_pitch(to);
+	struct frame_delta *d;
+	int size = 0, dirty = 0;
+	int i, y;
+
+	if (from->width != to->width || from->height != to->height
+			|| from->bpp != to->bpp)
+		return NULL;
+
+	/* Indices are compared, which mean the same only in one palette */
+	if ((from->palette || to->palette) && (!from->palette || !to->palette
+			|| memcmp(from->palette, to->palette,
+				FB_PALETTE_SIZE * sizeof(*to->palette))))
+		return NULL;
+
+	d = calloc(1, sizeof(*d));
+	if (!d)
+		return NULL;
+
+	for (y = 0; y < to->height; ++y) {
+		const unsigned char *a = (unsigned char *)from->pixel_buffer
+				+ y * from_pitch;
+		const unsigned char *b = (unsigned char *)to->pixel_buffer
+				+ y * to_pitch;
+
+		if (!memcmp(a, b, line_size))
+			continue;
+
+		/* Scan bytes, but build the spans out of whole pixels */
+		for (i = 0; i < line_size; ) {
+			int start, end;
+
+			while (i < line_size && a[i] == b[i])
+				++i;
+			if (i == line_size)
+				break;
+
+			/* Extend the span over short unchanged gaps */
+			start = i / bytes;
+			end = start + 1;
+			for (i = end * bytes; i < line_size
+					&& i / bytes - end < DELTA_MERGE_GAP; ++i)
+				if (a[i] != b[i])
+					end = i / bytes + 1;
+			i = end * bytes;
+
+			if (delta_add_span(d, &size, start, y, end - start))
+				goto no_delta;
+			dirty += end - start;
+		}
+	}
+
+	/* Separate span copies would be slower than one full frame copy */
+	if (dirty > (to->width * to->height / 4) * 3)
+		goto no_delta;
+
+	if (d->count && d->count < size) {
+		struct fb_span *s = realloc(d->spans,
+				d->count * sizeof(*s));
+
+		if (s)
+			d->spans = s;
+	}
+
+	return d;
+
+no_delta:
+	free(d->spans);
+	free(d);
+	return NULL;
+}
+
+/* Whether the screen contents go back under a pixel of 'to' over 'from' */
+static inline int delta_restores(int from, int to)
+{
+	return from != RLE_TRANSPARENT && to != RLE_OPAQUE;
+}
+
+/*
+ * Find the horizontal spans which 'from' covers and 'to' does not cover
+ * opaquely. The screen contents are put back there before 'to' is blended
+ * over the page holding 'from'. Returns NULL if they are to be put back
+ * fully.
+ */
+static struct frame_delta *delta_create_uncovered(struct image_info *from,
+		struct image_info *to)
+{
+	const int bytes = to->bpp / 8;
+	const int width = to->width;
+	unsigned char *from_px = malloc(2 * width);
+	unsigned char *to_px = from_px + width;
+	struct frame_delta *d;
+	int size = 0, dirty = 0;
+	int x, y;
+
+	d = (from_px) ? calloc(1, sizeof(*d)) : NULL;
+	if (!d) {
+		free(from_px);
+		return NULL;
+	}
+
+	for (y = 0; y < to->height; ++y) {
+		rle_row_coverage(from->rle, y, width, bytes, from_px);
+		rle_row_coverage(to->rle, y, width, bytes, to_px);
+
+		for (x = 0; x < width; ) {
+			int start, end;
+
+			while (x < width
+					&& !delta_restores(from_px[x], to_px[x]))
+				++x;
+			if (x == width)
+				break;
+
+			/* Extend the span over short gaps */
+			start = x;
+			end = start + 1;
+			for (x = end; x < width && x - end < DELTA_MERGE_GAP;
+					++x)
+				if (delta_restores(from_px[x], to_px[x]))
+					end = x + 1;
+			x = end;
+
+			if (delta_add_span(d, &size, start, y, end - start))
+				goto no_delta;
+			dirty += end - start;
+		}
+	}
+
+	/* Separate span copies would be slower than one full copy */
+	if (dirty <= (to->width * to->height / 4) * 3) {
+		free(from_px);
+		return d;
+	}
+
+no_delta:
+	free(from_px);
+	free(d->spans);
+	free(d);
+	return NULL;
+}
+
+static struct frame_delta *animation_delta(struct animation *a, int from,
+		int to)
+{
+	return (a->blend) ? delta_create_uncovered(&a->frames[from],
+				&a->frames[to])
+			: delta_create(&a->frames[from], &a->frames[to]);
+}
+
+static int animation_init_deltas(struct animation *a)
+{
+	int i, spans = 0, full = 0;
+
+	a->deltas = calloc(a->frame_count, sizeof(*a->deltas));
+	if (!a->deltas) {
+		LOG(LOG_ERR, "Unable to get %zu bytes of memory for animation",
+			a->frame_count * sizeof(*a->deltas));
+		return -1;
+	}
+
+	for (i = 0; i < a->frame_count; ++i) {
+		a->deltas[i] = animation_delta(a, prev_frame(a, i), i);
+		if (a->deltas[i])
+			spans += a->deltas[i]->count;
+		else
+			full++;
+	}
+
+	LOG(LOG_DEBUG, "Frame deltas: %d spans, %d of %d frames written fully",
+			spans, full, a->frame_count);
+
+	return 0;
+}
+
+/**
+ * Replace the pixel buffer of a frame by its run-length encoded form if
+ * that saves memory. Returns the number of bytes the frame takes.
+ */
+static size_t animation_encode_frame(struct image_info *frame)
+{
+	size_t size = (size_t)frame->width * frame->height * (frame->bpp / 8);
+
+	frame->rle = rle_encode(frame->pixel_buffer, frame->width,
+			frame->height, frame->bpp / 8);
+	if (!frame->rle)
+		return size;
+
+	free(frame->pixel_buffer);
+	frame->pixel_buffer = NULL;
+
+	return frame->rle->size + frame->height * sizeof(*frame->rle->rows);
+}
+
+static void animation_encode_frames(struct animation *a)
+{
+	size_t raw = 0, encoded = 0;
+	int i;
+
+	for (i = 0; i < a->frame_count; ++i) {
+		struct image_info *frame = &a->frames[i];
+
+		raw += (size_t)frame->width * frame->height * (frame->bpp / 8);
+		encoded += animation_encode_frame(frame);
+	}
+
+	LOG(LOG_DEBUG, "Run-length encoding: %zu bytes of frames in %zu bytes",
+			raw, encoded);
+}
+
+/* Format frames are loaded in, they are converted for blending later */
+static const struct pixel_format *animation_load_format(struct animation *a)
+{
+	return (a->blend) ? &pixel_format_argb32 : &a->fb->format;
+}
+
+/*
+ * Whether palettised frames stay indexed and frames cut out of sprite sheets
+ * stay views into them: encoding, blending and scaling need the pixels of
+ * each frame by themselves
+ */
+static int animation_indexed(const struct animation *a)
+{
+	return !a->rle && !a->blend && !a->scale;
+}
+
+/*
+ * Keep what is on screen where the frames are shown to blend them over it.
+ * All the frames must be of the size of the first one.
+ */
+static int animation_init_backdrop(struct animation *a)
+{
+	const struct image_info *first = &a->frames[0];
+	struct image_info *b = calloc(1, sizeof(*b));
+	int x, y;
+
+	if (b)
+		b->pixel_buffer = calloc((size_t)first->width * first->height,
+				pixel_bytes(&a->fb->format));
+	if (!b || !b->pixel_buffer) {
+		free(b);
+		ERR_RET(-1, "could not allocate memory");
+	}
+
+	b->width = first->width;
+	b->height = first->height;
+	b->bpp = a->fb->bpp;
+	center2top_left(b, a->x, a->y, &x, &y);
+	a->backdrop = b;
+
+	return fb_read_bitmap(a->fb, x, y, b);
+}
+
+/*
+ * Split a loaded ARGB32 frame into runs of transparent, opaque and
+ * translucent pixels to be put over the backdrop
+ */
+static int animation_blend_frame(struct animation *a, struct image_info *frame)
+{
+	struct rle_image *rle;
+
+	if (frame->width != a->backdrop->width
+			|| frame->height != a->backdrop->height) {
+		LOG(LOG_ERR, "Frames to be blended must all be %dx%d",
+				a->backdrop->width, a->backdrop->height);
+		return -1;
+	}
+
+	rle = rle_encode_alpha(frame->pixel_buffer, frame->width,
+			frame->height, &a->fb->format,
+			(a->keyed) ? &a->color_key : NULL);
+	if (!rle)
+		ERR_RET(-1, "could not allocate memory");
+
+	free(frame->pixel_buffer);
+	frame->pixel_buffer = NULL;
+	frame->rle = rle;
+	frame->bpp = a->fb->bpp;
+	frame->under = a->backdrop;
+
+	return 0;
+}
+
+static int animation_blend_frames(struct animation *a)
+{
+	int i;
+
+	for (i = 0; i < animation_frames_ready(a); ++i)
+		if (animation_blend_frame(a, &a->frames[i]))
+			return -1;
+
+	return 0;
+}
+
+static int animation_alloc(struct animation *a, int frame_count)
+{
+	a->frame_num = 0;
+	a->shown[0] = a->shown[1] = -1;
+	a->frame = -1;
+	a->frame_count = frame_count;
+	a->frames = malloc(frame_count * sizeof(struct image_info));
+	if (a->frames == NULL) {
+		LOG(LOG_ERR, "Unable to get %zu bytes of memory for animation",
+			frame_count * sizeof(struct image_info));
+		return -1;
+	}
+
+	return 0;
+}
+
+static const char **filename_array(struct string_list *filenames, int count)
+{
+	const char **names = malloc(count * sizeof(*names));
+	int i;
+
+	if (!names)
+		ERR_RET(NULL, "could not allocate memory");
+
+	for (i = 0; i < count; ++i, filenames = filenames->next)
+		names[i] = filenames->s;
+
+	return names;
+}
+
+/* A frame from each file */
+static int animation_load_frames(const char **names, int count,
+		const struct pixel_format *format, struct animation *a)
+{
+	struct frame_loader *l;
+
+	if (animation_alloc(a, count))
+		return -1;
+
+	/* Run-length encoding and blending replace the loaded pixels */
+	if (!a->rle && !a->blend)
+		a->arena = arena_create(names, count, format, a->scale,
+				animation_indexed(a), a->arena_flags);
+
+	l = loader_start(names, count, 0, a->frames, format, a->scale,
+			animation_indexed(a), a->arena);
+
+	return (l && !loader_finish(l)) ? 0 : -1;
+}
+
+/*
+ * Columns, rows and cell size of a sprite sheet. Pixels right of the last
+ * column and under the last row are left out. Returns the number of cells.
+ */
+static int sheet_grid(const struct frame_sheet *sheet,
+		const struct image_info *image, int *columns, int *rows,
+		int *w, int *h)
+{
+	if (sheet->columns) {
+		*columns = sheet->columns;
+		*rows = sheet->rows;
+		*w = image->width / *columns;
+		*h = image->height / *rows;
+	} else {
+		*w = sheet->cell_width;
+		*h = sheet->cell_height;
+		*columns = image->width / *w;
+		*rows = image->height / *h;
+	}
+
+	return (*w && *h && *columns && *rows) ? *columns * *rows : 0;
+}
+
+/*
+ * Cut the frames out of a loaded sprite sheet, row by row. They are views
+ * into the sheet if 'view', copies of its pixels otherwise. Returns the
+ * number of frames, -1 on memory shortage.
+ */
+static int sheet_cut(const struct frame_sheet *sheet,
+		const struct image_info *image, struct image_info *frames,
+		int view)
+{
+	const size_t pitch = fb_bitmap_pitch(image);
+	const int bytes = image->bpp / 8;
+	int columns, rows, w, h, c, r, y;
+
+	sheet_grid(sheet, image, &columns, &rows, &w, &h);
+
+	for (r = 0; r < rows; ++r)
+		for (c = 0; c < columns; ++c) {
+			struct image_info *f = &frames[r * columns + c];
+			const unsigned char *cell =
+					(unsigned char *)image->pixel_buffer
+					+ (size_t)r * h * pitch
+					+ (size_t)c * w * bytes;
+			const size_t line = (size_t)w * bytes;
+
+			memset(f, 0, sizeof(*f));
+			f->width = w;
+			f->height = h;
+			f->is_bmp = image->is_bmp;
+			f->bpp = image->bpp;
+			f->palette = image->palette;
+
+			if (view) {
+				f->pixel_buffer = (void *)cell;
+				f->stride = (int)pitch;
+				continue;
+			}
+
+			f->pixel_buffer = malloc(line * h);
+			if (!f->pixel_buffer)
+				ERR_RET(-1, "could not allocate memory");
+			for (y = 0; y < h; ++y)
+				memcpy((unsigned char *)f->pixel_buffer
+						+ y * line, cell + y * pitch,
+						line);
+		}
+
+	return columns * rows;
+}
+
+/*
+ * Frames cut out of sprite sheets. Each sheet is read once and its frames
+ * are views into it, unless they are to be changed one by one; then they are
+ * copied out and the sheet is dropped. Frames to be scaled are cut out of
+ * ARGB32 sheets and scaled each.
+ */
+static int animation_load_sheets(const char **names, int count,
+		const struct pixel_format *format, struct animation *a)
+{
+	const int view = animation_indexed(a);
+	struct image_info *sheets = calloc(count, sizeof(*sheets));
+	struct frame_loader *l;
+	int i, n, frames = 0, failed;
+	int columns, rows, w, h;
+
+	if (!sheets)
+		ERR_RET(-1, "could not allocate memory");
+
+	/* The arena holds the sheets the frames are views into */
+	if (view)
+		a->arena = arena_create(names, count, format, NULL, 1,
+				a->arena_flags);
+
+	l = loader_start(names, count, 0, sheets, (a->scale)
+			? &pixel_format_argb32 : format, NULL, view, a->arena);
+	failed = (l) ? loader_finish(l) : count;
+
+	for (i = 0; !failed && i < count; ++i) {
+		n = sheet_grid(a->sheet, &sheets[i], &columns, &rows, &w, &h);
+		if (!n) {
+			LOG(LOG_ERR, "%s is too small for a frame",
+					names[i]);
+			failed = 1;
+		}
+		frames += n;
+	}
+
+	if (!failed)
+		failed = animation_alloc(a, frames);
+
+	for (i = 0, frames = 0; !failed && i < count; ++i) {
+		n = sheet_cut(a->sheet, &sheets[i], a->frames + frames, view);
+		failed = n < 0;
+		frames += n;
+		if (!view)
+			free(sheets[i].pixel_buffer);
+	}
+	free(sheets);
+
+	for (i = 0; !failed && a->scale && i < frames; ++i)
+		failed = scale_image(&a->frames[i], a->scale, format, NULL);
+	if (failed)
+		return -1;
+
+	LOG(LOG_DEBUG, "%d frames cut out of %d sprite sheets%s", frames,
+			count, (view) ? "" : ", copied");
+
+	return 0;
+}
+
+/**
+ * Read the frames from bitmap files converting them into the given format,
+ * a frame from each file or all the frames of sprite sheets
+ */
+int animation_load(struct string_list *filenames, int filenames_count,
+		const struct pixel_format *format, struct animation *a)
+{
+	const char **names;
+	int failed;
+
+	names = filename_array(filenames, filenames_count);
+	if (!names)
+		return -1;
+
+	failed = (a->sheet) ? animation_load_sheets(names, filenames_count,
+				format, a)
+			: animation_load_frames(names, filenames_count,
+				format, a);
+	free(names);
+	if (failed)
+		return -1;
+
+	a->frames_ready = a->frame_count;
+
+	/* Frames to be blended get their deltas once they are converted */
+	return (a->blend) ? 0 : animation_init_deltas(a);
+}
+
+struct animation_loader {
+	pthread_t thread;
+	const char **filenames;
+};
+
+/*
+ * Frames are published to animation_run() in order, and only when nothing
+ * is going to change in them any more: the delta of a frame is computed
+ * when it is loaded, but run-length encoding of the preceding frame can
+ * happen only then. The first frame is on screen by the time and is not
+ * encoded.
+ */
+static void *animation_loader_thread(void *arg)
+{
+	struct animation *a = arg;
+	const int frame_count = a->frame_count;
+	struct frame_loader *l;
+	int i;
+
+	l = loader_start(a->loader->filenames, frame_count, 1, a->frames,
+			animation_load_format(a), a->scale, animation_indexed(a),
+			a->arena);
+
+	for (i = 1; i < frame_count; ++i) {
+		if (!l || loader_wait(l, i) || (a->blend
+				&& animation_blend_frame(a, &a->frames[i]))) {
+			LOG(LOG_ERR, "Only %d frames of %d are shown", i,
+					frame_count);
+			__atomic_store_n(&a->frame_count, i, __ATOMIC_RELEASE);
+			break;
+		}
+
+		a->deltas[i] = animation_delta(a, i - 1, i);
+		if (a->rle && !a->blend && i > 1)
+			animation_encode_frame(&a->frames[i - 1]);
+		__atomic_store_n(&a->frames_ready, i, __ATOMIC_RELEASE);
+	}
+
+	/* Now the wrap from the last frame to the first one is known */
+	a->deltas[0] = animation_delta(a, i - 1, 0);
+	if (a->rle && !a->blend && i > 1)
+		animation_encode_frame(&a->frames[i - 1]);
+	__atomic_store_n(&a->frames_ready, i, __ATOMIC_RELEASE);
+
+	if (l)
+		loader_finish(l);
+
+	LOG(LOG_INFO, "%d frames loaded in %ld ms since start", i,
+			elapsed_ms(&a->start));
+
+	return NULL;
+}
+
+/**
+ * Load the rest of the frames in the background while the first one is
+ * shown. Must be called after fork().
+ */
+int animation_start_loader(struct animation *a)
+{
+	sigset_t all, old;
+	int rc;
+
+	if (!a->loader)
+		return 0;
+
+	/* Signals are for the main thread, where they interrupt waiting */
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	rc = pthread_create(&a->loader->thread, NULL, animation_loader_thread,
+			a);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+	if (rc)
+		ERR_RET(-1, "could not start loading frames");
+	pthread_detach(a->loader->thread);
+
+	return 0;
+}
+
+/**
+ * Draw an image in the middle of the screen, on all of its pages, to stay
+ * under the animation. The image is scaled like the frames if 'scale' is
+ * not NULL, and is not kept.
+ */
+int animation_draw_background(struct screen_info *fb, const char *filename,
+		const struct scale_target *scale)
+{
+	struct image_info image;
+	void *page = fb->fb;
+	int i, x, y;
+	int rc = 0;
+
+	if (loader_read(filename, &image, &fb->format, scale, 0, NULL))
+		return -1;
+
+	center2top_left(&image, fb->width / 2, fb->height / 2, &x, &y);
+	for (i = 0; !rc && i < fb->pages; ++i) {
+		fb->fb = (unsigned char *)fb->map + i * fb->fb_size;
+		rc = fb_write_bitmap(fb, x, y, &image);
+	}
+	fb->fb = page;
+
+	free(image.pixel_buffer);
+
+	return rc;
+}
+
+/*
+ * Load only the first frame, the rest are loaded by animation_start_loader()
+ */
+static int animation_load_first(struct string_list *filenames,
+		int filenames_count, struct animation *a)
+{
+	struct pixel_room room = { NULL, 0 };
+	int i;
+
+	if (animation_alloc(a, filenames_count))
+		return -1;
+
+	a->deltas = calloc(filenames_count, sizeof(*a->deltas));
+	a->loader = malloc(sizeof(*a->loader));
+	if (!a->deltas || !a->loader) {
+		LOG(LOG_ERR, "Unable to get memory for animation");
+		return -1;
+	}
+
+	a->loader->filenames = filename_array(filenames, filenames_count);
+	if (!a->loader->filenames)
+		return -1;
+
+	/* The rest are read after fork(), which changes to the root directory */
+	for (i = 1; i < filenames_count; ++i) {
+		char *path = realpath(a->loader->filenames[i], NULL);
+
+		if (!path)
+			ERR_RET(-1, "could not find %s", a->loader->filenames[i]);
+		a->loader->filenames[i] = path;
+	}
+
+	if (!a->rle && !a->blend)
+		a->arena = arena_create(a->loader->filenames, filenames_count,
+				animation_load_format(a), a->scale,
+				animation_indexed(a), a->arena_flags);
+
+	if (a->arena)
+		arena_room(a->arena, 0, &room);
+	if (loader_read(a->loader->filenames[0], &a->frames[0],
+			animation_load_format(a), a->scale,
+			animation_indexed(a), &room))
+		return -1;
+	a->frames_ready = 1;
+
+	return 0;
+}
+
 int animation_init(struct string_list *filenames, int filenames_count,
 		struct screen_info *fb, struct animation *a)
 {
-    int i;
     int screen_w, screen_h;
 
     if (!fb->fb_size) {
@@ -75,26 +1328,54 @@ int animation_init(struct string_list *filenames, int filenames_count,
     }
 
     a->fb = fb;
-    a->frame_num = 0;
-    a->frame_count = filenames_count;
-    a->frames = malloc(filenames_count * sizeof(struct image_info));
-    if (a->frames == NULL) {
-        LOG(LOG_ERR, "Unable to get %zu bytes of memory for animation",
-            filenames_count * sizeof(struct image_info));
-        return -1;
+
+    screen_w = fb->width;
+    screen_h = fb->height;
+    if (!a->placed) {
+        a->x = screen_w / 2;
+        a->y = screen_h / 2;
     }
 
-    for (i = 0; i < filenames_count; ++i, filenames = filenames->next)
-        if (bmp_read(filenames->s, &a->frames[i]))
+    /* A pack holds ready frames, use them in place */
+    if (filenames_count == 1 && pack_probe(filenames->s)) {
+        if (a->blend) {
+            LOG(LOG_ERR, "Frames of a pack cannot be blended");
+            return -1;
+        }
+        if (a->scale)
+            LOG(LOG_WARNING, "Frames of a pack are shown in their size");
+        a->frame_num = 0;
+        a->shown[0] = a->shown[1] = -1;
+        a->frame = -1;
+        if (pack_map(filenames->s, &fb->format, a))
+            return -1;
+        a->frames_ready = a->frame_count;
+    } else if (a->background && filenames_count > 1 && !a->sheet) {
+        if (animation_load_first(filenames, filenames_count, a))
             return -1;
 
-    screen_w = fb->width;
-    screen_h = fb->height;
-    a->x = screen_w / 2;
-    a->y = screen_h / 2;
+        if (a->blend && (animation_init_backdrop(a)
+                || animation_blend_frames(a)))
+            return -1;
+    } else {
+        if (animation_load(filenames, filenames_count,
+                animation_load_format(a), a))
+            return -1;
 
-    return 0;
-}
+        if (a->blend) {
+            if (animation_init_backdrop(a) || animation_blend_frames(a)
+                    || animation_init_deltas(a))
+                return -1;
+        } else if (a->rle)
+            animation_encode_frames(a);
 
+        LOG(LOG_INFO, "%d frames loaded in %ld ms since start",
+                a->frame_count, elapsed_ms(&a->start));
+    }
 
+    a->blits = calloc(a->frame_count, sizeof(*a->blits));
+    if (!a->blits)
+        ERR_RET(-1, "could not allocate memory");
 
+    return 0;
+}
@@ -13,23 +13,121 @@
 #ifndef _ANIMATION_H
 #define _ANIMATION_H
 
+#include <stdint.h>
+#include <time.h>
+
 struct screen_info;
 struct string_list;
 struct commands_data;
+struct fb_span;
+struct fb_blit;
+struct pixel_format;
+struct animation_loader;
+struct scale_target;
+struct frame_arena;
+
+/* Frames whose presentation time is kept for timing statistics */
+#define ANIMATION_TIMING_SAMPLES	256
+
+/*
+ * How frames are laid out in a sprite sheet, row by row: a grid of the given
+ * number of columns and rows, or of cells of the given size
+ */
+struct frame_sheet {
+	int columns; /* 0 if the cells are given by their size */
+	int rows;
+	int cell_width;
+	int cell_height;
+};
+
+/* Pixels that differ between a frame and the one shown before it */
+struct frame_delta {
+	int count;
+	struct fb_span *spans;
+};
 
 struct animation {
 	struct screen_info *fb;
     int x; /* Center of frames */
     int y; /* Center of frames */
+    int placed; /* x and y are given, frames are not centered on screen */
     struct image_info *frames;
     int frame_num;
     int frame_count;
-    unsigned int interval;
+    unsigned long long period; /* Frames are period / period_den ns apart */
+    unsigned long long period_den;
+    int drop_frames; /* Skip frames that are due to keep the pace */
     struct commands_data *commands;
+    struct frame_delta **deltas; /* Per frame, NULL to write it fully */
+    struct fb_blit *blits; /* Per frame, planned when it is first written */
+    int shown[2]; /* Frame on each framebuffer page, -1 if unknown */
+    unsigned int frame_bytes; /* Bytes written for the last frame */
+    int rle; /* Keep frames run-length encoded */
+    int blend; /* Put frames over the screen contents by their alpha */
+    int keyed; /* Pixels of color_key are transparent as well */
+    uint32_t color_key; /* RGB */
+    struct image_info *backdrop; /* Screen contents under the frames */
+    const struct scale_target *scale; /* Resample frames, NULL if not */
+    const struct frame_sheet *sheet; /* Files are sprite sheets, NULL if
+                                        each holds a frame */
+    int background; /* Load all but the first frame in background */
+    struct frame_arena *arena; /* Frames are kept in, NULL if not */
+    int arena_flags; /* ARENA_* */
+    int frames_ready; /* Frames loaded so far, grows while loading */
+    struct animation_loader *loader;
+    struct timespec start; /* Start of the program, for load statistics */
+    unsigned int frames_shown;
+    struct timespec epoch; /* Start of the schedule of frames */
+    unsigned long long tick; /* Frame of the schedule being shown */
+    unsigned int dropped; /* Frames skipped to keep up with the schedule */
+    unsigned int late; /* Times the schedule has been moved on */
+    unsigned int presented;
+    int lateness_us[ANIMATION_TIMING_SAMPLES]; /* Of recent frames */
+    struct timespec fps_since; /* Start of the frame rate measurement */
+    unsigned int fps_frames; /* Frames presented since fps_since */
+    double fps; /* Frame rate over the last measurement */
+    int watch_events; /* Wait for event_fd together with frames */
+    int event_fd; /* Readable when commands arrive */
+    int timer_fd; /* timerfd for the frame deadlines */
+    int events; /* event_fd has become readable */
+    struct timespec command_time; /* Arrival of a command not on screen */
+    unsigned int command_latency_us; /* Until the last command showed */
+    unsigned int command_latency_max_us;
+    struct animation *next_layer; /* Sprite layer drawn over this one */
+    int run; /* Frames left to show, -1 for no limit, 0 while paused */
+    struct timespec deadline; /* Of the next frame, while running */
+    struct animation *next_due; /* Running after this one in the schedule */
+    struct animation *schedule; /* Of the first layer: the running ones by
+                                   their deadlines */
+    int due; /* The next frame is shown in this step */
+    int frame; /* Frame on screen after this step, -1 before the first */
 };
 
+/*
+ * While frames are being loaded in the background the number of loaded
+ * frames grows, and the frame count may shrink if some fail to load.
+ */
+static inline int animation_frames_ready(struct animation *a)
+{
+	return __atomic_load_n(&a->frames_ready, __ATOMIC_ACQUIRE);
+}
+
+static inline int animation_frame_count(struct animation *a)
+{
+	return __atomic_load_n(&a->frame_count, __ATOMIC_ACQUIRE);
+}
+
+int animation_load(struct string_list *filenames, int filenames_count,
+		const struct pixel_format *format, struct animation *a);
 int animation_init(struct string_list *filenames, int filenames_count,
 		struct screen_info *fb, struct animation *a);
+int animation_start_loader(struct animation *a);
+int animation_show_first(struct animation *a, int clear);
+int animation_draw_background(struct screen_info *fb, const char *filename,
+		const struct scale_target *scale);
+int animation_play(struct animation *banner);
+int animation_next_tick_at(struct animation *banner,
+		const struct timespec *now, int max_skip);
 int animation_run(struct animation *banner, int frames);
 
 #endif /* _ANIMATION_H */
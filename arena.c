@@ -0,0 +1,138 @@
+/*
+ *  A single block of memory for the frames of an animation
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bmp.h"
+#include "fb.h"
+#include "log.h"
+#include "pixel.h"
+#include "scale.h"
+
+/* Transparent huge pages are used for 2MB extents aligned to 2MB */
+#define ARENA_HUGE_PAGE	(2UL << 20)
+
+/*
+ * Map anonymous memory, aligned for huge pages if asked to, and fault all
+ * of it in now rather than when frames are first shown
+ */
+static unsigned char *arena_map(size_t size, int flags)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	const size_t align = (flags & ARENA_HUGE) ? ARENA_HUGE_PAGE : page;
+	unsigned char *map, *p;
+	size_t head, o;
+
+	map = mmap(NULL, size + align - page, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	/* Give back what is around the aligned part */
+	head = -(uintptr_t)map & (align - 1);
+	if (head)
+		munmap(map, head);
+	if (align - page - head)
+		munmap(map + head + size, align - page - head);
+	p = map + head;
+
+#ifdef MADV_HUGEPAGE
+	if ((flags & ARENA_HUGE) && madvise(p, size, MADV_HUGEPAGE))
+		LOG(LOG_WARNING, "No huge pages for frames: %s",
+				strerror(errno));
+#endif
+
+	for (o = 0; o < size; o += page)
+		p[o] = 0;
+
+	return p;
+}
+
+/**
+ * Make room for the frames in the given files, of the size they will have
+ * in 'format' once they are scaled to 'scale' if it is not NULL, or as a
+ * byte per pixel if they are palettised and kept 'indexed'. The sizes are
+ * read from the headers of the files; a frame whose size cannot be found
+ * out gets no room and is kept where it is loaded.
+ */
+struct frame_arena *arena_create(const char **filenames, int count,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed, int flags)
+{
+	const int bytes = pixel_bytes(format);
+	struct frame_arena *arena = calloc(1, sizeof(*arena));
+	size_t size = 0;
+	int i, w, h, palettised;
+
+	if (arena)
+		arena->slots = malloc((count + 1) * sizeof(*arena->slots));
+	if (!arena || !arena->slots) {
+		free(arena);
+		ERR_RET(NULL, "could not allocate memory");
+	}
+
+	for (i = 0; i < count; ++i) {
+		arena->slots[i] = size;
+		if (bmp_probe(filenames[i], &w, &h, &palettised))
+			continue;
+		if (scale)
+			scale_image_size(scale, w, h, &w, &h);
+		size += ((size_t)w * h * ((indexed && palettised) ? 1 : bytes)
+				+ ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	}
+	arena->slots[count] = size;
+	arena->count = count;
+	arena->size = size;
+	arena->flags = flags;
+
+	arena->map = (size) ? arena_map(size, flags) : NULL;
+	if (!arena->map) {
+		if (size)
+			ERR("could not allocate memory for frames");
+		free(arena->slots);
+		free(arena);
+		return NULL;
+	}
+
+	LOG(LOG_DEBUG, "%zu bytes of memory for %d frames%s%s", size, count,
+			(flags & ARENA_LOCK) ? ", locked" : "",
+			(flags & ARENA_HUGE) ? ", in huge pages" : "");
+
+	return arena;
+}
+
+/**
+ * Lock the frames in memory if the arena is made for it. A child does not
+ * inherit the locks of its parent, so this is done after fork().
+ */
+void arena_lock(struct frame_arena *arena)
+{
+	if ((arena->flags & ARENA_LOCK) && mlock(arena->map, arena->size))
+		LOG(LOG_WARNING, "Unable to lock frames in memory: %s",
+				strerror(errno));
+}
+
+/**
+ * The slot of a frame, for it to be decoded into. A frame that turns out
+ * not to fit there is kept where the decoder puts it instead.
+ */
+void arena_room(struct frame_arena *arena, int frame,
+		struct pixel_room *room)
+{
+	room->buffer = arena->map + arena->slots[frame];
+	room->size = arena->slots[frame + 1] - arena->slots[frame];
+}
@@ -0,0 +1,43 @@
+/*
+ *  A single block of memory for the frames of an animation
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+#include <stddef.h>
+
+struct pixel_format;
+struct pixel_room;
+struct scale_target;
+
+#define ARENA_LOCK	1 /* Locked in memory, never paged out */
+#define ARENA_HUGE	2 /* Backed by transparent huge pages if possible */
+
+/* Frames are decoded into slots laid out one after another in their order */
+#define ARENA_ALIGN	64 /* A cache line */
+
+struct frame_arena {
+	unsigned char *map;
+	size_t size;
+	int count;
+	size_t *slots; /* Offset of each frame, and the end after the last */
+	int flags; /* ARENA_* */
+};
+
+struct frame_arena *arena_create(const char **filenames, int count,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed, int flags);
+void arena_lock(struct frame_arena *arena);
+void arena_room(struct frame_arena *arena, int frame,
+		struct pixel_room *room);
+
+#endif /* _ARENA_H */
@@ -0,0 +1,1131 @@
+/*
+ *  Benchmarks of the decoding and drawing paths
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+/*
+ * Results are printed one per line as "name<TAB>value<TAB>unit", with '#'
+ * starting comments, so that runs of different builds can be compared by a
+ * script. Checks of the results come out the same way, with the number of
+ * mismatches as the value, and make the program exit with 1.
+ */
+
+#include <ctype.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "animation.h"
+#include "bmp.h"
+#include "commands.h"
+#include "fb.h"
+#include "log.h"
+#include "pixel.h"
+#include "scale.h"
+#include "string_list.h"
+
+int Interactive = 1; /* Log to stderr */
+int LogDebug = 0;
+
+#define BENCH_WIDTH	1920
+#define BENCH_HEIGHT	1080
+#define BENCH_MIN_NS	200000000ULL /* Each case is repeated this long */
+#define BENCH_COMMANDS	200000
+
+/* Line widths checked against the reference decoder: 1 to CHECK_WIDTHS */
+#define CHECK_WIDTHS	67
+
+static char Dir[] = "/tmp/bannerd-bench.XXXXXX";
+static int Failed; /* Mismatches found by the checks */
+static volatile unsigned long Sink; /* Results of baselines, kept */
+
+/* Bitmap formats the parsers of bmp.c recognise */
+static const struct bench_format {
+	const char *name;
+	int bpp;
+	int bitfields; /* BI_BITFIELDS with the masks, or BI_RGB */
+	uint32_t red, green, blue, alpha;
+} Formats[] = {
+	{ "argb4444", 16, 1, 0x0F00, 0x00F0, 0x000F, 0xF000 },
+	{ "rgb4444", 16, 1, 0x0F00, 0x00F0, 0x000F, 0 },
+	{ "rgb565", 16, 1, 0xF800, 0x07E0, 0x001F, 0 },
+	{ "argb1555", 16, 1, 0x7C00, 0x03E0, 0x001F, 0x8000 },
+	{ "xrgb1555", 16, 0, 0x7C00, 0x03E0, 0x001F, 0 },
+	{ "rgb888", 24, 0, 0xFF0000, 0x00FF00, 0x0000FF, 0 },
+	{ "argb8888", 32, 0, 0xFF0000, 0x00FF00, 0x0000FF, 0xFF000000 },
+	{ "rgba8888", 32, 1, 0xFF000000, 0xFF0000, 0xFF00, 0xFF },
+	{ "rgbx8888", 32, 1, 0xFF000000, 0xFF0000, 0xFF00, 0 },
+};
+
+#define FORMAT_COUNT	(int)(sizeof(Formats) / sizeof(Formats[0]))
+
+/* Instruction sets of the BMP line parsers */
+static const char *const Isas[] = { "scalar", "SSE2", "SSSE3", "AVX2", "NEON" };
+
+#define ISA_COUNT	(int)(sizeof(Isas) / sizeof(Isas[0]))
+
+static unsigned long long now_ns(void)
+{
+	struct timespec t;
+
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static uint32_t random32(uint32_t *state)
+{
+	uint32_t x = *state;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static void report(const char *name, const char *variant, double value,
+		const char *unit)
+{
+	printf("%s.%s\t%.2f\t%s\n", name, variant, value, unit);
+}
+
+/*
+ * Shortest time of a call of fn(arg), in nanoseconds, of the ones made in
+ * BENCH_MIN_NS. setup(arg), if given, is called before each one and is not
+ * timed.
+ */
+static double bench_time(void (*setup)(void *), void (*fn)(void *),
+		void *arg)
+{
+	const unsigned long long until = now_ns() + BENCH_MIN_NS;
+	unsigned long long best = ULLONG_MAX;
+	int runs = 0;
+
+	do {
+		unsigned long long t;
+
+		if (setup)
+			setup(arg);
+		t = now_ns();
+		fn(arg);
+		t = now_ns() - t;
+		if (t < best)
+			best = t;
+	} while (++runs < 3 || now_ns() < until);
+
+	return (double)best;
+}
+
+static unsigned char *put16(unsigned char *p, uint32_t v)
+{
+	p[0] = v;
+	p[1] = v >> 8;
+	return p + 2;
+}
+
+static unsigned char *put32(unsigned char *p, uint32_t v)
+{
+	return put16(put16(p, v), v >> 16);
+}
+
+/* A channel of 'bits' scaled to 8 bits the way the line parsers do it */
+static uint32_t expand(uint32_t v, uint32_t mask, uint32_t absent)
+{
+	int bits, shift;
+
+	if (!mask)
+		return absent;
+
+	shift = __builtin_ctz(mask);
+	bits = __builtin_popcount(mask);
+	v = (v & mask) >> shift;
+
+	if (bits == 1)
+		return (v) ? 0xFF : 0;
+	return (bits >= 8) ? v >> (bits - 8) : v << (8 - bits);
+}
+
+static uint32_t reference_argb(const struct bench_format *f, uint32_t v)
+{
+	return expand(v, f->alpha, 0xFF) << 24 | expand(v, f->red, 0) << 16
+			| expand(v, f->green, 0) << 8 | expand(v, f->blue, 0);
+}
+
+/*
+ * Write a bottom-up bitmap of random pixels and put what it should decode
+ * to into 'expected', if it is not NULL
+ */
+static int write_bmp(const char *path, const struct bench_format *f,
+		int width, int height, uint32_t seed, uint32_t *expected)
+{
+	const int header_size = (f->bitfields) ? 56 : 40;
+	const int bytes = f->bpp / 8;
+	const size_t stride = ((size_t)width * bytes + 3) & ~(size_t)3;
+	const size_t size = 14 + header_size + stride * height;
+	unsigned char *bmp = calloc(1, size), *p;
+	FILE *file;
+	int x, y, rc = -1;
+
+	if (!bmp)
+		return -1;
+
+	p = bmp;
+	*p++ = 'B';
+	*p++ = 'M';
+	p = put32(p, size);
+	p = put32(p, 0);
+	p = put32(p, 14 + header_size);
+	p = put32(p, header_size);
+	p = put32(p, width);
+	p = put32(p, height);
+	p = put16(p, 1);
+	p = put16(p, f->bpp);
+	p = put32(p, (f->bitfields) ? 3 : 0);
+	p = put32(p, stride * height);
+	p += 16; /* Resolution and colours */
+	if (f->bitfields) {
+		p = put32(p, f->red);
+		p = put32(p, f->green);
+		p = put32(p, f->blue);
+		p = put32(p, f->alpha);
+	}
+
+	for (y = height - 1; y >= 0; --y, p += stride)
+		for (x = 0; x < width; ++x) {
+			uint32_t v = random32(&seed);
+
+			if (bytes < 4)
+				v &= (1U << f->bpp) - 1;
+			memcpy(p + x * bytes, &v, bytes);
+			if (expected)
+				expected[y * width + x] = reference_argb(f, v);
+		}
+
+	file = fopen(path, "wb");
+	if (file) {
+		rc = (fwrite(bmp, size, 1, file) == 1) ? 0 : -1;
+		if (fclose(file))
+			rc = -1;
+	}
+	free(bmp);
+
+	return rc;
+}
+
+/*
+ * Decode lines of every width up to CHECK_WIDTHS, which take all the paths
+ * through the vector parsers and their scalar tails, and compare them with
+ * the reference
+ */
+static void check_bmp_read(const char *isa, const struct bench_format *f)
+{
+	uint32_t expected[CHECK_WIDTHS * 3];
+	char path[sizeof(Dir) + 16];
+	int width, i, bad = 0;
+
+	snprintf(path, sizeof(path), "%s/check.bmp", Dir);
+
+	for (width = 1; width <= CHECK_WIDTHS; ++width) {
+		struct image_info image;
+
+		uint32_t *pixels;
+
+		if (write_bmp(path, f, width, 3, width, expected)
+				|| bmp_read(path, &image,
+					&pixel_format_argb32)) {
+			bad += width * 3;
+			continue;
+		}
+
+		pixels = image.pixel_buffer;
+		for (i = 0; i < width * 3; ++i)
+			bad += pixels[i] != expected[i];
+		free(pixels);
+	}
+
+	unlink(path);
+	printf("check.bmp_read.%s.%s\t%d\tmismatches\n", isa, f->name, bad);
+	Failed += bad;
+}
+
+struct read_case {
+	const char *path;
+	const struct pixel_format *format;
+};
+
+static void read_bitmap(void *arg)
+{
+	struct read_case *c = arg;
+	struct image_info image;
+
+	if (bmp_read(c->path, &image, c->format))
+		exit(1);
+	free(image.pixel_buffer);
+}
+
+static void bench_bmp_read(const struct bench_format *f)
+{
+	char path[sizeof(Dir) + 16];
+	struct read_case c = { path, &pixel_format_argb32 };
+	double ns;
+
+	snprintf(path, sizeof(path), "%s/%s.bmp", Dir, f->name);
+	if (write_bmp(path, f, BENCH_WIDTH, BENCH_HEIGHT, 1, NULL)) {
+		ERR("could not write %s", path);
+		exit(1);
+	}
+
+	ns = bench_time(NULL, read_bitmap, &c);
+	report("bmp_read", f->name, 1e3 * BENCH_WIDTH * BENCH_HEIGHT / ns,
+			"Mpx/s");
+	unlink(path);
+}
+
+/* Deflate streams of fixed codes for the PNG cases, see RFC 1951 */
+static const struct deflate_code {
+	uint16_t base;
+	uint8_t extra;
+} Lengths[29] = {
+	{ 3, 0 }, { 4, 0 }, { 5, 0 }, { 6, 0 }, { 7, 0 }, { 8, 0 }, { 9, 0 },
+	{ 10, 0 }, { 11, 1 }, { 13, 1 }, { 15, 1 }, { 17, 1 }, { 19, 2 },
+	{ 23, 2 }, { 27, 2 }, { 31, 2 }, { 35, 3 }, { 43, 3 }, { 51, 3 },
+	{ 59, 3 }, { 67, 4 }, { 83, 4 }, { 99, 4 }, { 115, 4 }, { 131, 5 },
+	{ 163, 5 }, { 195, 5 }, { 227, 5 }, { 258, 0 },
+}, Distances[30] = {
+	{ 1, 0 }, { 2, 0 }, { 3, 0 }, { 4, 0 }, { 5, 1 }, { 7, 1 }, { 9, 2 },
+	{ 13, 2 }, { 17, 3 }, { 25, 3 }, { 33, 4 }, { 49, 4 }, { 65, 5 },
+	{ 97, 5 }, { 129, 6 }, { 193, 6 }, { 257, 7 }, { 385, 7 }, { 513, 8 },
+	{ 769, 8 }, { 1025, 9 }, { 1537, 9 }, { 2049, 10 }, { 3073, 10 },
+	{ 4097, 11 }, { 6145, 11 }, { 8193, 12 }, { 12289, 12 },
+	{ 16385, 13 }, { 24577, 13 },
+};
+
+#define DEFLATE_WINDOW	32768
+#define DEFLATE_HASH	(1 << 15)
+
+struct bit_writer {
+	unsigned char *p;
+	uint32_t bits;
+	int count;
+};
+
+/* Bits go least significant first */
+static void put_bits(struct bit_writer *w, uint32_t v, int n)
+{
+	w->bits |= v << w->count;
+	for (w->count += n; w->count >= 8; w->count -= 8) {
+		*w->p++ = (unsigned char)w->bits;
+		w->bits >>= 8;
+	}
+}
+
+/* Huffman codes go most significant bit first */
+static void put_code(struct bit_writer *w, uint32_t code, int n)
+{
+	uint32_t v = 0;
+	int i;
+
+	for (i = 0; i < n; ++i)
+		v |= (code >> i & 1) << (n - 1 - i);
+	put_bits(w, v, n);
+}
+
+static void put_symbol(struct bit_writer *w, int v)
+{
+	if (v < 144)
+		put_code(w, 0x30 + v, 8);
+	else if (v < 256)
+		put_code(w, 0x190 + v - 144, 9);
+	else if (v < 280)
+		put_code(w, v - 256, 7);
+	else
+		put_code(w, 0xC0 + v - 280, 8);
+}
+
+static void put_match(struct bit_writer *w, int length, int distance)
+{
+	int i;
+
+	for (i = 28; Lengths[i].base > length; --i)
+		;
+	put_symbol(w, 257 + i);
+	put_bits(w, length - Lengths[i].base, Lengths[i].extra);
+
+	for (i = 29; Distances[i].base > distance; --i)
+		;
+	put_code(w, i, 5);
+	put_bits(w, distance - Distances[i].base, Distances[i].extra);
+}
+
+/*
+ * A zlib stream of one block of fixed codes, matches found greedily by a
+ * hash of 3 bytes. 'out' must have room for 'size' * 9 / 8 + 16 bytes.
+ */
+static size_t deflate_fixed(unsigned char *out, const unsigned char *in,
+		size_t size)
+{
+	struct bit_writer w = { out, 0, 0 };
+	uint32_t a = 1, b = 0;
+	long *head = malloc(DEFLATE_HASH * sizeof(*head));
+	size_t i;
+
+	if (!head)
+		exit(1);
+	for (i = 0; i < DEFLATE_HASH; ++i)
+		head[i] = -1;
+
+	*w.p++ = 0x78;
+	*w.p++ = 0x01;
+	put_bits(&w, 1, 1); /* Final */
+	put_bits(&w, 1, 2); /* Fixed codes */
+
+	for (i = 0; i < size; ) {
+		size_t length = 0;
+		long from = -1;
+
+		if (i + 3 <= size) {
+			const uint32_t h = ((uint32_t)in[i] << 16
+					| in[i + 1] << 8 | in[i + 2])
+					* 2654435761U >> 17;
+
+			from = head[h];
+			head[h] = (long)i;
+			if (from >= 0 && i - from <= DEFLATE_WINDOW)
+				while (length < 258 && i + length < size
+						&& in[from + length]
+							== in[i + length])
+					++length;
+		}
+
+		if (length >= 3) {
+			put_match(&w, (int)length, (int)(i - from));
+			i += length;
+		} else
+			put_symbol(&w, in[i++]);
+	}
+	put_symbol(&w, 256);
+	put_bits(&w, 0, -w.count & 7);
+
+	for (i = 0; i < size; ++i) {
+		a = (a + in[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	put_bits(&w, b >> 8, 8);
+	put_bits(&w, b & 0xFF, 8);
+	put_bits(&w, a >> 8, 8);
+	put_bits(&w, a & 0xFF, 8);
+	free(head);
+
+	return w.p - out;
+}
+
+static unsigned char *put_be32(unsigned char *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static int paeth(int a, int b, int c)
+{
+	const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+	return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+/*
+ * Write ARGB32 pixels as an RGB (3 channels) or RGBA (4) PNG image with
+ * rows filtered by 'filter', or by each filter in turn if it is negative.
+ * CRCs are left zero as png.c does not check them.
+ */
+static int write_png(const char *path, int channels, int width, int height,
+		const uint32_t *pixels, int filter, size_t *written)
+{
+	const size_t row = (size_t)width * channels;
+	const size_t raw_size = (row + 1) * height;
+	unsigned char *plain = malloc(row * height);
+	unsigned char *raw = malloc(raw_size);
+	unsigned char *png = malloc(raw_size * 9 / 8 + 128), *p = png;
+	size_t i, size;
+	FILE *file;
+	int y, rc = -1;
+
+	if (!plain || !raw || !png)
+		exit(1);
+
+	for (i = 0; i < (size_t)width * height; ++i) {
+		const uint32_t v = pixels[i];
+
+		p = plain + i * channels;
+		p[0] = v >> 16;
+		p[1] = v >> 8;
+		p[2] = v;
+		if (channels == 4)
+			p[3] = v >> 24;
+	}
+
+	for (y = 0; y < height; ++y) {
+		const unsigned char *r = plain + y * row;
+		const unsigned char *up = (y) ? r - row : NULL;
+		unsigned char *out = raw + y * (row + 1);
+		const int f = (filter < 0) ? y % 5 : filter;
+
+		*out++ = f;
+		for (i = 0; i < row; ++i) {
+			const int a = (i >= (size_t)channels) ? r[i - channels]
+					: 0;
+			const int b = (up) ? up[i] : 0;
+			const int c = (up && i >= (size_t)channels)
+					? up[i - channels] : 0;
+			const int predicted[5] = { 0, a, b, (a + b) / 2,
+					paeth(a, b, c) };
+
+			out[i] = r[i] - predicted[f];
+		}
+	}
+
+	p = png;
+	memcpy(p, "\x89PNG\r\n\x1A\n", 8);
+	p = put_be32(p + 8, 13);
+	memcpy(p, "IHDR", 4);
+	p = put_be32(p + 4, width);
+	p = put_be32(p, height);
+	*p++ = 8;
+	*p++ = (channels == 4) ? 6 : 2;
+	*p++ = 0;
+	*p++ = 0;
+	*p++ = 0;
+	p = put_be32(p, 0);
+
+	size = deflate_fixed(p + 8, raw, raw_size);
+	p = put_be32(p, size);
+	memcpy(p, "IDAT", 4);
+	p = put_be32(p + 4 + size, 0);
+	p = put_be32(p, 0);
+	memcpy(p, "IEND", 4);
+	p = put_be32(p + 4, 0);
+
+	file = fopen(path, "wb");
+	if (file) {
+		rc = (fwrite(png, p - png, 1, file) == 1) ? 0 : -1;
+		if (fclose(file))
+			rc = -1;
+	}
+	if (written)
+		*written = p - png;
+	free(plain);
+	free(raw);
+	free(png);
+
+	return rc;
+}
+
+/*
+ * Decode RGB and RGBA images of every width up to CHECK_WIDTHS with rows
+ * of all the filters, which take the vector and the scalar unfiltering
+ */
+static void check_png_read(int channels)
+{
+	uint32_t expected[CHECK_WIDTHS * 10];
+	char path[sizeof(Dir) + 16];
+	uint32_t seed = 1;
+	int width, i, bad = 0;
+
+	snprintf(path, sizeof(path), "%s/check.png", Dir);
+
+	for (width = 1; width <= CHECK_WIDTHS; ++width) {
+		struct image_info image;
+		uint32_t *pixels;
+
+		/* Runs of a pixel and noise, for both matches and literals */
+		for (i = 0; i < width * 10; ++i) {
+			expected[i] = (i % 7 < 3) ? 0xFF336699
+					: random32(&seed);
+			if (channels == 3)
+				expected[i] |= 0xFF000000;
+		}
+
+		if (write_png(path, channels, width, 10, expected, -1, NULL)
+				|| bmp_read(path, &image,
+					&pixel_format_argb32)) {
+			bad += width * 10;
+			continue;
+		}
+
+		pixels = image.pixel_buffer;
+		for (i = 0; i < width * 10; ++i)
+			bad += pixels[i] != expected[i];
+		free(pixels);
+	}
+
+	unlink(path);
+	printf("check.png_read.%s\t%d\tmismatches\n",
+			(channels == 4) ? "rgba" : "rgb", bad);
+	Failed += bad;
+}
+
+/*
+ * Frames skipped by a 25fps schedule when a frame is over at given times,
+ * with and without a limit, and the schedule moved on instead when frames
+ * are not dropped
+ */
+static void check_frame_skip(void)
+{
+	static const struct {
+		long now_ms; /* Since the start of the schedule */
+		int drop_frames;
+		int max_skip;
+		int skipped;
+		unsigned long long tick; /* After the frames are skipped */
+	} cases[] = {
+		{ 30, 1, INT_MAX, 0, 1 }, /* Frame 1 is due at 40 */
+		{ 79, 1, INT_MAX, 0, 1 },
+		{ 80, 1, INT_MAX, 1, 2 }, /* Frame 1 is over when shown */
+		{ 85, 1, 0, 0, 1 },
+		{ 205, 1, INT_MAX, 4, 5 },
+		{ 205, 1, 2, 2, 3 },
+		{ 205, 0, INT_MAX, 0, 0 }, /* Moved on to start now */
+	};
+	int i, bad = 0;
+
+	for (i = 0; i < (int)(sizeof(cases) / sizeof(cases[0])); ++i) {
+		struct animation a = {
+			.period = 40000000,
+			.period_den = 1,
+			.drop_frames = cases[i].drop_frames,
+			.epoch = { 100, 0 },
+		};
+		struct timespec now = { 100, cases[i].now_ms * 1000000 };
+
+		bad += animation_next_tick_at(&a, &now, cases[i].max_skip)
+				!= cases[i].skipped || a.tick != cases[i].tick
+				|| a.dropped != (unsigned int)cases[i].skipped;
+	}
+
+	printf("check.frame_skip\t%d\tmismatches\n", bad);
+	Failed += bad;
+}
+
+/*
+ * Decoding of a frame of smooth gradients with some noise, and its size
+ * against the bitmap it would be otherwise
+ */
+static void bench_png_read(const char *name, int channels, int filter)
+{
+	const size_t pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	char path[sizeof(Dir) + 32];
+	struct read_case c = { path, &pixel_format_argb32 };
+	uint32_t *frame = malloc(pixels * 4);
+	uint32_t seed = 1;
+	size_t size, i;
+
+	if (!frame)
+		exit(1);
+	for (i = 0; i < pixels; ++i) {
+		const uint32_t x = i % BENCH_WIDTH, y = i / BENCH_WIDTH;
+		uint32_t v = (x * 255 / BENCH_WIDTH) << 16
+				| (y * 255 / BENCH_HEIGHT) << 8
+				| ((x + y) / 12 & 0xFF);
+
+		if (!(random32(&seed) & 7))
+			v ^= random32(&seed) & 0x070707;
+		frame[i] = v | ((channels == 4) ? (x / 8 & 0xFF) << 24
+				: 0xFF000000);
+	}
+
+	snprintf(path, sizeof(path), "%s/%s.png", Dir, name);
+	if (write_png(path, channels, BENCH_WIDTH, BENCH_HEIGHT, frame,
+			filter, &size)) {
+		ERR("could not write %s", path);
+		exit(1);
+	}
+	free(frame);
+
+	report("png_read", name, 1e3 * pixels / bench_time(NULL, read_bitmap,
+			&c), "Mpx/s");
+	report("png_size", name, 100.0 * size / (pixels * channels),
+			"% of bmp");
+	unlink(path);
+}
+
+struct blit_case {
+	struct screen_info *sd;
+	struct image_info *bitmap;
+	int x, y;
+	const struct fb_blit *plan;
+};
+
+/* The write as it used to be, a memcpy() per row of what is on screen */
+static void copy_lines(void *arg)
+{
+	struct blit_case *c = arg;
+	const struct fb_blit *plan = c->plan;
+	const size_t pitch = fb_bitmap_pitch(c->bitmap);
+	unsigned char *line = (unsigned char *)c->sd->fb + plan->offset;
+	const unsigned char *pixels = (unsigned char *)c->bitmap->pixel_buffer
+			+ plan->row * pitch + plan->from * 4;
+	int i;
+
+	for (i = 0; i < plan->height; ++i, line += c->sd->stride,
+			pixels += pitch)
+		memcpy(line, pixels, plan->width * 4);
+}
+
+static void write_bitmap(void *arg)
+{
+	struct blit_case *c = arg;
+
+	fb_write_bitmap(c->sd, c->x, c->y, c->bitmap);
+}
+
+/* A screen of BENCH_WIDTH x BENCH_HEIGHT ARGB32 pixels in memory */
+static void *memory_screen(struct screen_info *sd)
+{
+	const struct fb_surface surface = {
+		BENCH_WIDTH, BENCH_HEIGHT, 0, pixel_format_argb32,
+	};
+
+	memset(sd, 0, sizeof(*sd));
+	if (fb_init(sd, NULL, &surface, 0, 0))
+		return NULL;
+
+	return sd->fb;
+}
+
+static void bench_write_bitmap(void)
+{
+	static const struct {
+		const char *name;
+		int full; /* Of the size of the screen */
+		int x, y; /* Of the top left corner, in 1/4 of the screen */
+	} cases[] = {
+		{ "full", 1, 0, 0 },
+		{ "unclipped", 0, 1, 1 },
+		{ "left_clipped", 0, -1, 1 },
+		{ "right_clipped", 0, 3, 1 },
+		{ "top_clipped", 0, 1, -1 },
+		{ "bottom_clipped", 0, 1, 3 },
+	};
+	struct screen_info sd;
+	struct image_info bitmaps[2] = {
+		{ .width = BENCH_WIDTH, .height = BENCH_HEIGHT, .bpp = 32 },
+		{ .width = BENCH_WIDTH / 2, .height = BENCH_HEIGHT / 2,
+			.bpp = 32 },
+	};
+	unsigned int i;
+
+	if (!memory_screen(&sd))
+		exit(1);
+	for (i = 0; i < 2; ++i) {
+		bitmaps[i].pixel_buffer = malloc((size_t)bitmaps[i].width
+				* bitmaps[i].height * 4);
+		if (!bitmaps[i].pixel_buffer)
+			exit(1);
+		memset(bitmaps[i].pixel_buffer, 0x5A, (size_t)bitmaps[i].width
+				* bitmaps[i].height * 4);
+	}
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct fb_blit plan;
+		struct blit_case c = {
+			&sd, &bitmaps[!cases[i].full],
+			cases[i].x * BENCH_WIDTH / 4,
+			cases[i].y * BENCH_HEIGHT / 4, &plan,
+		};
+		double ns;
+
+		/* Only what is on screen is written */
+		if (fb_plan_bitmap(&sd, c.x, c.y, c.bitmap, &plan))
+			exit(1);
+		ns = bench_time(NULL, copy_lines, &c);
+		report("memcpy_lines", cases[i].name,
+				4.0 * plan.width * plan.height / ns, "GB/s");
+		ns = bench_time(NULL, write_bitmap, &c);
+		report("fb_write_bitmap", cases[i].name,
+				4.0 * plan.width * plan.height / ns, "GB/s");
+	}
+
+	for (i = 0; i < 2; ++i)
+		free(bitmaps[i].pixel_buffer);
+	fb_close(&sd, 0);
+}
+
+struct clear_case {
+	struct screen_info *sd;
+	const struct fb_blit *except;
+};
+
+/* The clear as it used to be, a line at a time through the cache */
+static void fill_lines(void *arg)
+{
+	struct clear_case *c = arg;
+	const uint32_t black = pixel_pack(&c->sd->format, 0xFF000000);
+	unsigned char *line = c->sd->fb;
+	int i;
+
+	for (i = 0; i < c->sd->height; ++i, line += c->sd->stride)
+		pixel_fill(&c->sd->format, line, black, c->sd->width);
+}
+
+static void clear_page(void *arg)
+{
+	struct clear_case *c = arg;
+
+	fb_clear(c->sd, c->sd->page, c->except);
+}
+
+static void bench_clear(void)
+{
+	struct screen_info sd;
+	struct image_info frame = {
+		.width = 1280, .height = 720, .bpp = 32,
+	};
+	struct fb_blit plan;
+	struct clear_case c = { &sd, NULL };
+
+	if (!memory_screen(&sd))
+		exit(1);
+
+	report("pixel_fill", "page", bench_time(NULL, fill_lines, &c) / 1e6,
+			"ms");
+	report("fb_clear", "page", bench_time(NULL, clear_page, &c) / 1e6,
+			"ms");
+
+	/* Fast start leaves out the first frame, 720p in the middle */
+	if (fb_plan_bitmap(&sd, (BENCH_WIDTH - frame.width) / 2,
+			(BENCH_HEIGHT - frame.height) / 2, &frame, &plan))
+		exit(1);
+	c.except = &plan;
+	report("fb_clear", "around_720p", bench_time(NULL, clear_page, &c)
+			/ 1e6, "ms");
+
+	fb_close(&sd, 0);
+}
+
+struct blend_case {
+	const struct pixel_format *format;
+	unsigned char *out;
+	uint32_t *src;
+};
+
+static void blend_lines(void *arg)
+{
+	struct blend_case *c = arg;
+	const size_t line = (size_t)BENCH_WIDTH * pixel_bytes(c->format);
+	int y;
+
+	for (y = 0; y < BENCH_HEIGHT; ++y)
+		pixel_blend_line(c->format, c->out + y * line,
+				c->src + y * BENCH_WIDTH, c->out + y * line,
+				BENCH_WIDTH);
+}
+
+static void bench_blend(void)
+{
+	const char *names[] = { "argb32", "rgb565", "rgb888" };
+	const size_t pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	struct blend_case c;
+	uint32_t seed = 1;
+	unsigned int i;
+	size_t j;
+
+	c.src = malloc(pixels * 4);
+	c.out = calloc(pixels, 4);
+	if (!c.src || !c.out)
+		exit(1);
+
+	/* Premultiplied pixels of any alpha */
+	for (j = 0; j < pixels; ++j) {
+		uint32_t v = random32(&seed), a = v >> 24;
+
+		c.src[j] = a << 24 | (((v >> 16 & 0xFF) * a / 255) << 16)
+				| (((v >> 8 & 0xFF) * a / 255) << 8)
+				| ((v & 0xFF) * a / 255);
+	}
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		c.format = pixel_format_by_name(names[i]);
+		report("pixel_blend_line", names[i], 1e3 * pixels
+				/ bench_time(NULL, blend_lines, &c), "Mpx/s");
+	}
+
+	free(c.src);
+	free(c.out);
+}
+
+struct lookup_case {
+	const struct pixel_format *format;
+	unsigned char *out;
+	const unsigned char *in;
+	uint32_t palette[FB_PALETTE_SIZE];
+};
+
+static void lookup_lines(void *arg)
+{
+	struct lookup_case *c = arg;
+	const size_t line = (size_t)BENCH_WIDTH * pixel_bytes(c->format);
+	int y;
+
+	for (y = 0; y < BENCH_HEIGHT; ++y)
+		pixel_lookup_line(c->format, c->out + y * line,
+				c->in + y * BENCH_WIDTH, c->palette,
+				BENCH_WIDTH);
+}
+
+/* Expansion of indexed frames as fb_blit() does it */
+static void bench_lookup(void)
+{
+	const char *names[] = { "argb32", "rgb565", "rgb888" };
+	const size_t pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	struct lookup_case c;
+	unsigned char *in = malloc(pixels);
+	uint32_t seed = 1;
+	unsigned int i;
+	size_t j;
+
+	c.out = calloc(pixels, 4);
+	if (!in || !c.out)
+		exit(1);
+	for (j = 0; j < pixels; ++j)
+		in[j] = (unsigned char)random32(&seed);
+	c.in = in;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); ++i) {
+		c.format = pixel_format_by_name(names[i]);
+		for (j = 0; j < FB_PALETTE_SIZE; ++j)
+			c.palette[j] = pixel_pack(c.format, random32(&seed));
+		report("pixel_lookup_line", names[i], 1e3 * pixels
+				/ bench_time(NULL, lookup_lines, &c), "Mpx/s");
+	}
+
+	free(in);
+	free(c.out);
+}
+
+struct scale_case {
+	struct image_info image;
+	const uint32_t *source;
+	struct scale_target target;
+};
+
+static void scale_setup(void *arg)
+{
+	struct scale_case *c = arg;
+	const size_t size = (size_t)BENCH_WIDTH * BENCH_HEIGHT * 4;
+
+	free(c->image.pixel_buffer);
+	c->image.width = BENCH_WIDTH;
+	c->image.height = BENCH_HEIGHT;
+	c->image.bpp = 32;
+	c->image.pixel_buffer = malloc(size);
+	if (!c->image.pixel_buffer)
+		exit(1);
+	memcpy(c->image.pixel_buffer, c->source, size);
+}
+
+static void scale(void *arg)
+{
+	struct scale_case *c = arg;
+
+	if (scale_image(&c->image, &c->target, &pixel_format_argb32, NULL))
+		exit(1);
+}
+
+static void bench_scale(void)
+{
+	static const struct {
+		const char *name;
+		struct scale_target target;
+	} cases[] = {
+		{ "fit_1280x720", { SCALE_FIT, 1280, 720 } },
+		{ "fill_800x480", { SCALE_FILL, 800, 480 } },
+		{ "fit_3840x2160", { SCALE_FIT, 3840, 2160 } },
+	};
+	const size_t pixels = (size_t)BENCH_WIDTH * BENCH_HEIGHT;
+	uint32_t *source = malloc(pixels * 4);
+	uint32_t seed = 1;
+	unsigned int i;
+	size_t j;
+
+	if (!source)
+		exit(1);
+	for (j = 0; j < pixels; ++j)
+		source[j] = random32(&seed) | 0xFF000000;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+		struct scale_case c = { .source = source,
+			.target = cases[i].target };
+
+		report("scale_image", cases[i].name,
+				bench_time(scale_setup, scale, &c) / 1e6, "ms");
+		free(c.image.pixel_buffer);
+	}
+
+	free(source);
+}
+
+/*
+ * The command tokenizer as it used to be: a symbol at a time from fgetc(),
+ * categorised and copied into a token buffer, then converted. The commands
+ * are only counted, not carried out, so this is what the tokenizing alone
+ * used to cost. Returns the number of commands in the file.
+ */
+static int fgetc_commands(const char *path)
+{
+	char buffer[255];
+	FILE *file = fopen(path, "r");
+	int type = -1, i = 0, commands = 0;
+	int symbol;
+
+	if (!file)
+		exit(1);
+
+	while ((symbol = fgetc(file)) != EOF) {
+		const int delimiter = strchr(";\r\n", symbol) != NULL;
+
+		if (isblank(symbol) || delimiter) {
+			if (type != -1) {
+				buffer[i] = '\0';
+				if (type == 'i')
+					Sink += strtoul(buffer, NULL, 0);
+				else
+					Sink += !strcmp(buffer, "exit")
+							+ !strcmp(buffer, "run")
+							+ !strcmp(buffer, "skip");
+			}
+			commands += delimiter;
+			type = -1;
+			i = 0;
+			continue;
+		}
+
+		if (i == sizeof(buffer) - 1)
+			continue;
+
+		if (isalpha(symbol))
+			symbol = tolower(symbol);
+		buffer[i++] = symbol;
+		/* Numbers, with a unit after them, or words */
+		if (type == -1)
+			type = (isdigit(symbol)) ? 'i' : 's';
+		else if (type == 'i' && !isdigit(symbol))
+			type = (symbol == 'f' || symbol == '%') ? 'u' : 's';
+		else if (type == 'u')
+			type = 's';
+	}
+
+	fclose(file);
+
+	return commands;
+}
+
+/*
+ * Commands read from a file by the command loop of an animation of two
+ * small frames, as fast as it parses them
+ */
+static void bench_commands(void)
+{
+	const struct bench_format *f = &Formats[6]; /* argb8888 */
+	char path[sizeof(Dir) + 16], frames[2][sizeof(Dir) + 16];
+	struct string_list *names = NULL, *tail = NULL;
+	struct animation a = { .period_den = 1, };
+	struct screen_info sd;
+	unsigned long long t;
+	FILE *file;
+	int i;
+
+	if (!memory_screen(&sd))
+		exit(1);
+
+	for (i = 0; i < 2; ++i) {
+		snprintf(frames[i], sizeof(frames[i]), "%s/frame%d.bmp", Dir,
+				i);
+		if (write_bmp(frames[i], f, 64, 64, i + 1, NULL))
+			exit(1);
+		tail = string_list_add(&names, tail, frames[i]);
+		if (!tail)
+			exit(1);
+	}
+
+	snprintf(path, sizeof(path), "%s/commands", Dir);
+	file = fopen(path, "w");
+	if (!file)
+		exit(1);
+	for (i = 0; i < BENCH_COMMANDS / 2; ++i)
+		fputs("skip 1f\nskip 3\n", file);
+	fputs("exit\n", file);
+	if (fclose(file))
+		exit(1);
+
+	clock_gettime(CLOCK_MONOTONIC, &a.start);
+	if (animation_init(names, 2, &sd, &a))
+		exit(1);
+	string_list_destroy(names);
+
+	t = now_ns();
+	i = fgetc_commands(path);
+	t = now_ns() - t;
+
+	report("commands_fgetc", "skip", 1e9 * i / t, "commands/s");
+
+	t = now_ns();
+	if (commands_fifo(path, &a))
+		exit(1);
+	t = now_ns() - t;
+
+	report("commands", "skip", 1e9 * BENCH_COMMANDS / t, "commands/s");
+
+	unlink(path);
+	unlink(frames[0]);
+	unlink(frames[1]);
+}
+
+int main(void)
+{
+	int i, j;
+
+	if (!mkdtemp(Dir))
+		ERR_RET(1, "could not create a directory for bitmaps");
+
+#if !defined(__OPTIMIZE__)
+	printf("# not optimised, build with CFLAGS=-O2 to compare\n");
+#endif
+	printf("# %dx%d frames\n", BENCH_WIDTH, BENCH_HEIGHT);
+
+	/* Every set of line parsers the CPU can run, the scalar ones first */
+	for (i = 0; i < ISA_COUNT; ++i)
+		if (!bmp_line_parsers(Isas[i]))
+			for (j = 0; j < FORMAT_COUNT; ++j)
+				check_bmp_read(Isas[i], &Formats[j]);
+	bmp_line_parsers(NULL);
+	check_png_read(3);
+	check_png_read(4);
+	check_frame_skip();
+	for (i = 0; i < FORMAT_COUNT; ++i)
+		bench_bmp_read(&Formats[i]);
+	bench_png_read("rgb_sub", 3, 1);
+	bench_png_read("rgba_paeth", 4, 4);
+	bench_png_read("rgba_up", 4, 2);
+	bench_write_bitmap();
+	bench_clear();
+	bench_blend();
+	bench_lookup();
+	bench_scale();
+	bench_commands();
+
+	rmdir(Dir);
+
+	return (Failed) ? 1 : 0;
+}
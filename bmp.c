@@ -12,16 +12,29 @@
 
 #include <errno.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <unistd.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BMP_X86_SIMD
+#elif defined(__ARM_NEON) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#include <arm_neon.h>
+#define BMP_NEON_SIMD
+#endif
+
 #include "bmp.h"
 #include "fb.h"
 #include "log.h"
+#include "pixel.h"
+#include "png.h"
 
 #ifndef _BSD_SOURCE
 #define _BSD_SOURCE
@@ -29,8 +42,12 @@
 #include <endian.h>
 
 #define BI_RGB          0 /* Bitmap compresion: none */
+#define BI_RLE8         1 /* Bitmap compresion: 8bpp run-length encoding */
+#define BI_RLE4         2 /* Bitmap compresion: 4bpp run-length encoding */
 #define BI_BITFIELDS    3 /* Bitmap compresion: bitfields */
 
+#define BMP_MAX_SIZE    0xFFFF /* Largest width and height, as in a pack */
+
 #ifndef ARRAY_SIZE
 #define ARRAY_SIZE(a) (sizeof(a) / sizeof(a[0]))
 #endif /* ARRAY_SIZE */
@@ -209,7 +226,7 @@ static void *_ParseLineRGB888(uint32_t *out, void *line, int width)
         *out++ = htole32(w);
     }
 
-    return (unsigned char *)in + pads;
+    return (unsigned char *)line + width * 3 + pads;
 }
 
 static void *_ParseLineRGBA8888(uint32_t *out, void *line, int width)
@@ -252,30 +269,440 @@ static void *_ParseLineRGBX8888(uint32_t *out, void *line, int width)
     return in;
 }
 
+/*
+ * Vectorised parsers. Each converts as many pixels as fits in whole vectors
+ * with the same arithmetic as the scalar parser of its format, and leaves the
+ * rest of the line to the scalar parser. Loads never go past the pixels of
+ * the line.
+ */
+
+#define LINE_ARGB4444   0
+#define LINE_RGB4444    1
+#define LINE_RGB565     2
+#define LINE_ARGB1555   3
+#define LINE_XRGB1555   4
+#define LINE_RGB888     5
+#define LINE_ARGB8888   6
+#define LINE_RGBA8888   7
+#define LINE_RGBX8888   8
+#define LINE_FORMATS    9
+
+static const LINE_PARSER _scalar_line_parsers[LINE_FORMATS] = {
+    [LINE_ARGB4444] = &_ParseLineARGB4444,
+    [LINE_RGB4444]  = &_ParseLineRGB4444,
+    [LINE_RGB565]   = &_ParseLineRGB565,
+    [LINE_ARGB1555] = &_ParseLineARGB1555,
+    [LINE_XRGB1555] = &_ParseLineXRGB1555,
+    [LINE_RGB888]   = &_ParseLineRGB888,
+    [LINE_ARGB8888] = &_ParseLineARGB8888,
+    [LINE_RGBA8888] = &_ParseLineRGBA8888,
+    [LINE_RGBX8888] = &_ParseLineRGBX8888,
+};
+
+/* Instruction sets with parsers, each adding to those before it */
+static const char *const _line_parser_isas[] = {
+    "scalar",
+#if defined(BMP_X86_SIMD)
+    "SSE2", "SSSE3", "AVX2",
+#elif defined(BMP_NEON_SIMD)
+    "NEON",
+#endif
+};
+
+/* The parsers in use, selected once for the CPU we are running on */
+static LINE_PARSER _line_parsers[LINE_FORMATS];
+static const char *_line_parsers_isa;
+static pthread_once_t _line_parsers_once = PTHREAD_ONCE_INIT;
+
+/* Expressions on 32-bit lanes holding one 16-bit pixel each, written with
+ * the vector operations V_* defined for each instruction set below */
+#define CONV_ARGB4444(v) \
+    V_OR(V_OR(V_SHL(V_AND(v, V_K(0x000F)), 4), \
+              V_SHL(V_AND(v, V_K(0x00F0)), 8)), \
+         V_OR(V_SHL(V_AND(v, V_K(0x0F00)), 12), \
+              V_SHL(V_AND(v, V_K(0xF000)), 16)))
+#define CONV_RGB4444(v) \
+    V_OR(V_OR(V_SHL(V_AND(v, V_K(0x000F)), 4), \
+              V_SHL(V_AND(v, V_K(0x00F0)), 8)), \
+         V_OR(V_SHL(V_AND(v, V_K(0x0F00)), 12), V_K(0xFF000000)))
+#define CONV_RGB565(v) \
+    V_OR(V_OR(V_SHL(V_AND(v, V_K(0x001F)), 3), \
+              V_SHL(V_AND(v, V_K(0x07E0)), 5)), \
+         V_OR(V_SHL(V_AND(v, V_K(0xF800)), 8), V_K(0xFF000000)))
+/* The alpha bit is moved to the sign and spread over the top byte */
+#define CONV_ARGB1555(v) \
+    V_OR(V_OR(V_SHL(V_AND(v, V_K(0x001F)), 3), \
+              V_SHL(V_AND(v, V_K(0x03E0)), 6)), \
+         V_OR(V_SHL(V_AND(v, V_K(0x7C00)), 9), \
+              V_AND(V_SAR(V_SHL(v, 16), 7), V_K(0xFF000000))))
+#define CONV_XRGB1555(v) \
+    V_OR(V_OR(V_SHL(V_AND(v, V_K(0x001F)), 3), \
+              V_SHL(V_AND(v, V_K(0x03E0)), 6)), \
+         V_OR(V_SHL(V_AND(v, V_K(0x7C00)), 9), V_K(0xFF000000)))
+
+/* Expressions on 32-bit lanes holding one 32-bit pixel each */
+#define CONV_RGBA8888(v) \
+    V_OR(V_SHR(v, 8), V_SHL(v, 24))
+#define CONV_RGBX8888(v) \
+    V_OR(V_SHR(v, 8), V_K(0xFF000000))
+
+#if defined(BMP_X86_SIMD) && defined(__SSE2__)
+
+#define V_AND(a, b) _mm_and_si128(a, b)
+#define V_OR(a, b)  _mm_or_si128(a, b)
+#define V_SHL(a, n) _mm_slli_epi32(a, n)
+#define V_SHR(a, n) _mm_srli_epi32(a, n)
+#define V_SAR(a, n) _mm_srai_epi32(a, n)
+#define V_K(c)      _mm_set1_epi32((int)(c))
+
+#define SSE2_PARSER16(fmt) \
+static void *_ParseLine##fmt##_SSE2(uint32_t *out, void *line, int width) \
+{ \
+    const uint16_t *in = (const uint16_t *)line; \
+    const __m128i zero = _mm_setzero_si128(); \
+    int j; \
+ \
+    for (j = 0; j + 8 <= width; j += 8) { \
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + j)); \
+        __m128i lo = _mm_unpacklo_epi16(v, zero); \
+        __m128i hi = _mm_unpackhi_epi16(v, zero); \
+ \
+        _mm_storeu_si128((__m128i *)(out + j), CONV_##fmt(lo)); \
+        _mm_storeu_si128((__m128i *)(out + j + 4), CONV_##fmt(hi)); \
+    } \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+#define SSE2_PARSER32(fmt) \
+static void *_ParseLine##fmt##_SSE2(uint32_t *out, void *line, int width) \
+{ \
+    const uint32_t *in = (const uint32_t *)line; \
+    int j; \
+ \
+    for (j = 0; j + 4 <= width; j += 4) { \
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + j)); \
+ \
+        _mm_storeu_si128((__m128i *)(out + j), CONV_##fmt(v)); \
+    } \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+SSE2_PARSER16(ARGB4444)
+SSE2_PARSER16(RGB4444)
+SSE2_PARSER16(RGB565)
+SSE2_PARSER16(ARGB1555)
+SSE2_PARSER16(XRGB1555)
+SSE2_PARSER32(RGBA8888)
+SSE2_PARSER32(RGBX8888)
+
+#undef V_AND
+#undef V_OR
+#undef V_SHL
+#undef V_SHR
+#undef V_SAR
+#undef V_K
+
+#endif /* BMP_X86_SIMD && __SSE2__ */
+
+#if defined(BMP_X86_SIMD)
+
+__attribute__((target("ssse3")))
+static void *_ParseLineRGB888_SSSE3(uint32_t *out, void *line, int width)
+{
+    const unsigned char *in = (const unsigned char *)line;
+    const __m128i spread = _mm_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                         6, 7, 8, -1, 9, 10, 11, -1);
+    const __m128i alpha = _mm_set1_epi32((int)0xFF000000);
+    int j;
+
+    /* 4 pixels at a time, but 16 bytes are loaded */
+    for (j = 0; j + 6 <= width; j += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(in + j * 3));
+
+        v = _mm_or_si128(_mm_shuffle_epi8(v, spread), alpha);
+        _mm_storeu_si128((__m128i *)(out + j), v);
+    }
+
+    /* An even number of pixels was taken, the rest is parsed the same way
+     * the whole line would be */
+    _ParseLineRGB888(out + j, (void *)(in + j * 3), width - j);
+
+    return (unsigned char *)line + width * 3 + ((4 - (width * 3) % 4) & 0x3);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+#define V_AND(a, b) _mm256_and_si256(a, b)
+#define V_OR(a, b)  _mm256_or_si256(a, b)
+#define V_SHL(a, n) _mm256_slli_epi32(a, n)
+#define V_SHR(a, n) _mm256_srli_epi32(a, n)
+#define V_SAR(a, n) _mm256_srai_epi32(a, n)
+#define V_K(c)      _mm256_set1_epi32((int)(c))
+
+#define AVX2_PARSER16(fmt) \
+AVX2 static void *_ParseLine##fmt##_AVX2(uint32_t *out, void *line, \
+                                         int width) \
+{ \
+    const uint16_t *in = (const uint16_t *)line; \
+    int j; \
+ \
+    for (j = 0; j + 8 <= width; j += 8) { \
+        __m256i v = _mm256_cvtepu16_epi32( \
+                _mm_loadu_si128((const __m128i *)(in + j))); \
+ \
+        _mm256_storeu_si256((__m256i *)(out + j), CONV_##fmt(v)); \
+    } \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+#define AVX2_PARSER32(fmt) \
+AVX2 static void *_ParseLine##fmt##_AVX2(uint32_t *out, void *line, \
+                                         int width) \
+{ \
+    const uint32_t *in = (const uint32_t *)line; \
+    int j; \
+ \
+    for (j = 0; j + 8 <= width; j += 8) { \
+        __m256i v = _mm256_loadu_si256((const __m256i *)(in + j)); \
+ \
+        _mm256_storeu_si256((__m256i *)(out + j), CONV_##fmt(v)); \
+    } \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+AVX2_PARSER16(ARGB4444)
+AVX2_PARSER16(RGB4444)
+AVX2_PARSER16(RGB565)
+AVX2_PARSER16(ARGB1555)
+AVX2_PARSER16(XRGB1555)
+AVX2_PARSER32(RGBA8888)
+AVX2_PARSER32(RGBX8888)
+
+#undef V_AND
+#undef V_OR
+#undef V_SHL
+#undef V_SHR
+#undef V_SAR
+#undef V_K
+
+AVX2 static void *_ParseLineRGB888_AVX2(uint32_t *out, void *line, int width)
+{
+    const unsigned char *in = (const unsigned char *)line;
+    const __m256i spread = _mm256_setr_epi8(0, 1, 2, -1, 3, 4, 5, -1,
+                                            6, 7, 8, -1, 9, 10, 11, -1,
+                                            0, 1, 2, -1, 3, 4, 5, -1,
+                                            6, 7, 8, -1, 9, 10, 11, -1);
+    const __m256i alpha = _mm256_set1_epi32((int)0xFF000000);
+    int j;
+
+    /* 8 pixels at a time from two loads of 16 bytes, 12 bytes apart */
+    for (j = 0; j + 10 <= width; j += 8) {
+        const unsigned char *p = in + j * 3;
+        __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(
+                _mm_loadu_si128((const __m128i *)p)),
+                _mm_loadu_si128((const __m128i *)(p + 12)), 1);
+
+        v = _mm256_or_si256(_mm256_shuffle_epi8(v, spread), alpha);
+        _mm256_storeu_si256((__m256i *)(out + j), v);
+    }
+
+    _ParseLineRGB888_SSSE3(out + j, (void *)(in + j * 3), width - j);
+
+    return (unsigned char *)line + width * 3 + ((4 - (width * 3) % 4) & 0x3);
+}
+
+#endif /* BMP_X86_SIMD */
+
+#if defined(BMP_NEON_SIMD)
+
+#define V_AND(a, b) vandq_u32(a, b)
+#define V_OR(a, b)  vorrq_u32(a, b)
+#define V_SHL(a, n) vshlq_n_u32(a, n)
+#define V_SHR(a, n) vshrq_n_u32(a, n)
+#define V_SAR(a, n) \
+    vreinterpretq_u32_s32(vshrq_n_s32(vreinterpretq_s32_u32(a), n))
+#define V_K(c)      vdupq_n_u32(c)
+
+#define NEON_PARSER16(fmt) \
+static void *_ParseLine##fmt##_NEON(uint32_t *out, void *line, int width) \
+{ \
+    const uint16_t *in = (const uint16_t *)line; \
+    int j; \
+ \
+    for (j = 0; j + 8 <= width; j += 8) { \
+        uint16x8_t v = vld1q_u16(in + j); \
+        uint32x4_t lo = vmovl_u16(vget_low_u16(v)); \
+        uint32x4_t hi = vmovl_u16(vget_high_u16(v)); \
+ \
+        vst1q_u32(out + j, CONV_##fmt(lo)); \
+        vst1q_u32(out + j + 4, CONV_##fmt(hi)); \
+    } \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+#define NEON_PARSER32(fmt) \
+static void *_ParseLine##fmt##_NEON(uint32_t *out, void *line, int width) \
+{ \
+    const uint32_t *in = (const uint32_t *)line; \
+    int j; \
+ \
+    for (j = 0; j + 4 <= width; j += 4) \
+        vst1q_u32(out + j, CONV_##fmt(vld1q_u32(in + j))); \
+ \
+    return _ParseLine##fmt(out + j, (void *)(in + j), width - j); \
+}
+
+NEON_PARSER16(ARGB4444)
+NEON_PARSER16(RGB4444)
+NEON_PARSER16(RGB565)
+NEON_PARSER16(ARGB1555)
+NEON_PARSER16(XRGB1555)
+NEON_PARSER32(RGBA8888)
+NEON_PARSER32(RGBX8888)
+
+static void *_ParseLineRGB888_NEON(uint32_t *out, void *line, int width)
+{
+    const unsigned char *in = (const unsigned char *)line;
+    int j;
+
+    for (j = 0; j + 8 <= width; j += 8) {
+        uint8x8x3_t v = vld3_u8(in + j * 3);
+        uint8x8x4_t w;
+
+        w.val[0] = v.val[0];
+        w.val[1] = v.val[1];
+        w.val[2] = v.val[2];
+        w.val[3] = vdup_n_u8(0xFF);
+        vst4_u8((uint8_t *)(out + j), w);
+    }
+
+    _ParseLineRGB888(out + j, (void *)(in + j * 3), width - j);
+
+    return (unsigned char *)line + width * 3 + ((4 - (width * 3) % 4) & 0x3);
+}
+
+#endif /* BMP_NEON_SIMD */
+
+/*
+ * Put in the parsers of the instruction sets in _line_parser_isas up to
+ * 'level' that the program is built with and the CPU has
+ */
+static void _SetLineParsers(unsigned int level)
+{
+    memcpy(_line_parsers, _scalar_line_parsers, sizeof(_line_parsers));
+    _line_parsers_isa = _line_parser_isas[0];
+
+#if defined(BMP_X86_SIMD)
+    __builtin_cpu_init();
+
+#if defined(__SSE2__)
+    if (level >= 1) {
+        _line_parsers[LINE_ARGB4444] = &_ParseLineARGB4444_SSE2;
+        _line_parsers[LINE_RGB4444] = &_ParseLineRGB4444_SSE2;
+        _line_parsers[LINE_RGB565] = &_ParseLineRGB565_SSE2;
+        _line_parsers[LINE_ARGB1555] = &_ParseLineARGB1555_SSE2;
+        _line_parsers[LINE_XRGB1555] = &_ParseLineXRGB1555_SSE2;
+        _line_parsers[LINE_RGBA8888] = &_ParseLineRGBA8888_SSE2;
+        _line_parsers[LINE_RGBX8888] = &_ParseLineRGBX8888_SSE2;
+        _line_parsers_isa = "SSE2";
+    }
+#endif /* __SSE2__ */
+
+    if (level >= 2 && __builtin_cpu_supports("ssse3")) {
+        _line_parsers[LINE_RGB888] = &_ParseLineRGB888_SSSE3;
+        _line_parsers_isa = "SSSE3";
+    }
+
+    if (level >= 3 && __builtin_cpu_supports("avx2")) {
+        _line_parsers[LINE_ARGB4444] = &_ParseLineARGB4444_AVX2;
+        _line_parsers[LINE_RGB4444] = &_ParseLineRGB4444_AVX2;
+        _line_parsers[LINE_RGB565] = &_ParseLineRGB565_AVX2;
+        _line_parsers[LINE_ARGB1555] = &_ParseLineARGB1555_AVX2;
+        _line_parsers[LINE_XRGB1555] = &_ParseLineXRGB1555_AVX2;
+        _line_parsers[LINE_RGB888] = &_ParseLineRGB888_AVX2;
+        _line_parsers[LINE_RGBA8888] = &_ParseLineRGBA8888_AVX2;
+        _line_parsers[LINE_RGBX8888] = &_ParseLineRGBX8888_AVX2;
+        _line_parsers_isa = "AVX2";
+    }
+#elif defined(BMP_NEON_SIMD)
+    if (level >= 1) {
+        _line_parsers[LINE_ARGB4444] = &_ParseLineARGB4444_NEON;
+        _line_parsers[LINE_RGB4444] = &_ParseLineRGB4444_NEON;
+        _line_parsers[LINE_RGB565] = &_ParseLineRGB565_NEON;
+        _line_parsers[LINE_ARGB1555] = &_ParseLineARGB1555_NEON;
+        _line_parsers[LINE_XRGB1555] = &_ParseLineXRGB1555_NEON;
+        _line_parsers[LINE_RGB888] = &_ParseLineRGB888_NEON;
+        _line_parsers[LINE_RGBA8888] = &_ParseLineRGBA8888_NEON;
+        _line_parsers[LINE_RGBX8888] = &_ParseLineRGBX8888_NEON;
+        _line_parsers_isa = "NEON";
+    }
+#endif
+}
+
+static void _SelectLineParsers(void)
+{
+    _SetLineParsers(ARRAY_SIZE(_line_parser_isas) - 1);
+    LOG(LOG_DEBUG, "Using %s line parsers", _line_parsers_isa);
+}
+
+/**
+ * Parse lines with the parsers of instruction set 'isa' ("scalar", "SSE2",
+ * "SSSE3", "AVX2" or "NEON") and those it adds to, e.g. to check them
+ * against each other, or with the best ones again if 'isa' is NULL. Returns
+ * -1 if the program is built without them or the CPU does not have them.
+ */
+int bmp_line_parsers(const char *isa)
+{
+    unsigned int i = ARRAY_SIZE(_line_parser_isas) - 1;
+
+    pthread_once(&_line_parsers_once, &_SelectLineParsers);
+
+    if (isa)
+        for (i = 0; strcmp(isa, _line_parser_isas[i]); ++i)
+            if (i + 1 == ARRAY_SIZE(_line_parser_isas))
+                return -1;
+
+    _SetLineParsers(i);
+
+    return (isa && strcmp(isa, _line_parsers_isa)) ? -1 : 0;
+}
+
+/* Bits per pixel of the lines a LINE_* parser takes */
+static unsigned int _LineBpp(int line)
+{
+    return (line >= LINE_ARGB8888) ? 32 : (line == LINE_RGB888) ? 24 : 16;
+}
+
 static LINE_PARSER _GetLineParser(DIB_HEADER *dh)
 {
     static const struct _parser_pattern {
-        LINE_PARSER parser;
+        int line; /* LINE_* format of the lines */
         uint32_t red;
         uint32_t green;
         uint32_t blue;
         uint32_t transp;
         uint32_t bpp; /* This field is used if the bitmap has no masks */
     } _mask_parsers[] = {
-      {&_ParseLineARGB4444, 0x0F00,    0x00F0,    0x000F,    0xF000,     0},
-      {&_ParseLineRGB4444,  0x0F00,    0x00F0,    0x000F,    0x0000,     0},
-      {&_ParseLineRGB565,   0xF800,    0x07E0,    0x001F,    0x0000,     0},
-      {&_ParseLineARGB1555, 0x7C00,    0x03E0,    0x001F,    0x8000,     0},
-      {&_ParseLineXRGB1555, 0x7C00,    0x03E0,    0x001F,    0x0000,    16},
-      {&_ParseLineRGB888,   0x00FF,    0xFF00,    0xFF0000,  0x0000,    24},
-      {&_ParseLineARGB8888, 0x00FF0000,0x0000FF00,0x000000FF,0xFF000000, 32},
-      {&_ParseLineRGBA8888, 0xFF000000,0x00FF0000,0x0000FF00,0x000000FF, 0},
-      {&_ParseLineRGBX8888, 0xFF000000,0x00FF0000,0x0000FF00,0x00000000, 0},
+      {LINE_ARGB4444,       0x0F00,    0x00F0,    0x000F,    0xF000,     0},
+      {LINE_RGB4444,        0x0F00,    0x00F0,    0x000F,    0x0000,     0},
+      {LINE_RGB565,         0xF800,    0x07E0,    0x001F,    0x0000,     0},
+      {LINE_ARGB1555,       0x7C00,    0x03E0,    0x001F,    0x8000,     0},
+      {LINE_XRGB1555,       0x7C00,    0x03E0,    0x001F,    0x0000,    16},
+      {LINE_RGB888,         0x00FF,    0xFF00,    0xFF0000,  0x0000,    24},
+      {LINE_ARGB8888,       0x00FF0000,0x0000FF00,0x000000FF,0xFF000000, 32},
+      {LINE_RGBA8888,       0xFF000000,0x00FF0000,0x0000FF00,0x000000FF, 0},
+      {LINE_RGBX8888,       0xFF000000,0x00FF0000,0x0000FF00,0x00000000, 0},
     };
 
+    pthread_once(&_line_parsers_once, &_SelectLineParsers);
+
     /* Handle COREHEADERs first. Only 16bpp 4.4.4.x.x are supported */
     if (dh->core.header_size == sizeof(dh->core) && dh->info.bpp == 16)
-        return &_ParseLineARGB4444;
+        return _line_parsers[LINE_ARGB4444];
 
     /* Handle INFOHEADERs */
     if (dh->info.header_size >= sizeof(dh->info)) {
@@ -287,7 +714,7 @@ static LINE_PARSER _GetLineParser(DIB_HEADER *dh)
                 if (dh->info.bpp == _mask_parsers[i].bpp) {
                     LOG(LOG_DEBUG, "Default parser for %hubpp: %u",
                             dh->info.bpp, i);
-                    return _mask_parsers[i].parser;
+                    return _line_parsers[_mask_parsers[i].line];
                 }
         }
 
@@ -307,9 +734,10 @@ static LINE_PARSER _GetLineParser(DIB_HEADER *dh)
                 if (h->red_mask == p->red
                         && h->green_mask == p->green
                         && h->blue_mask == p->blue
-                        && h->alpha_mask == p->transp) {
+                        && h->alpha_mask == p->transp
+                        && h->info.bpp == _LineBpp(p->line)) {
                     LOG(LOG_DEBUG, "%s(): found parser %d", __func__, i);
-                    return p->parser;
+                    return _line_parsers[p->line];
                 }
             }
         }
@@ -318,23 +746,20 @@ static LINE_PARSER _GetLineParser(DIB_HEADER *dh)
     return NULL;
 }
 
-static int _ParseBitmap(unsigned char *from, struct image_info *image,
-                        uint32_t in_size, DIB_HEADER *dh)
+static int _ParseBitmap(const unsigned char *from, struct image_info *image,
+                        size_t in_stride, DIB_HEADER *dh,
+                        const struct pixel_format *format,
+                        const struct pixel_room *room)
 {
-    uint32_t *out;
-    int width = (dh->info.height < 0) ? image->width : -image->width;
+    unsigned char *out;
+    const size_t line_size = (size_t)image->width * pixel_bytes(format);
+    const ptrdiff_t out_stride = (dh->info.height < 0)
+            ? (ptrdiff_t)line_size : -(ptrdiff_t)line_size;
     int i;
     LINE_PARSER parser;
-    unsigned char *bitmap_start = from;
-
-    image->pixel_buffer = malloc(image->width * image->height * sizeof(*out));
-
-    if (!image->pixel_buffer)
-        return -1;
-
-    out = (dh->info.height < 0)
-            ? image->pixel_buffer
-            : image->pixel_buffer + (image->height - 1) * abs(width);
+    uint32_t *line = NULL;
+    uint32_t *in_line = NULL;
+    int rc = -1;
 
     parser = _GetLineParser(dh);
     if (parser == NULL) {
@@ -342,15 +767,83 @@ static int _ParseBitmap(unsigned char *from, struct image_info *image,
         return -1;
     }
 
-    for (i = 0; i < image->height; ++i, out += width) {
-        from = parser(out, from, abs(width));
+    /* Lines are parsed into ARGB32 and then converted, unless it is the
+     * target format already */
+    if (!pixel_format_equal(format, &pixel_format_argb32)) {
+        line = malloc(image->width * sizeof(*line));
+        if (!line)
+            goto out;
+    }
+
+    /* Parsers read whole pixels, so lines that are not aligned in the file
+     * are copied out first */
+    if ((uintptr_t)from % sizeof(uint32_t)) {
+        in_line = malloc(in_stride);
+        if (!in_line)
+            goto out;
+    }
 
-        /* A quick and dirty test for incomplete bitmaps in the file */
-        /* We have already read outside from */
-        if (in_size < from - bitmap_start) {
-            LOG(LOG_ERR, "Corrupt BMP, not enough pixels in the file");
-            return -1;
-        }
+    image->bpp = format->bpp;
+    image->stride = 0;
+    image->palette = NULL;
+    image->rle = NULL;
+    image->under = NULL;
+    image->pixel_buffer = pixel_room_alloc(room, line_size * image->height);
+
+    if (!image->pixel_buffer)
+        goto out;
+
+    out = (dh->info.height < 0)
+            ? (unsigned char *)image->pixel_buffer
+            : (unsigned char *)image->pixel_buffer
+                + (image->height - 1) * line_size;
+
+    /* The headers have been checked to hold image->height lines of
+     * in_stride bytes in the file */
+    for (i = 0; i < image->height; ++i, out += out_stride,
+            from += in_stride) {
+        void *in = (void *)from;
+
+        if (in_line)
+            in = memcpy(in_line, from, in_stride);
+
+        if (line) {
+            parser(line, in, image->width);
+            pixel_pack_line(format, out, line, image->width);
+        } else
+            parser((uint32_t *)out, in, image->width);
+    }
+
+    rc = 0;
+
+out:
+    free(in_line);
+    free(line);
+    return rc;
+}
+
+static int _IsRle(const DIB_HEADER *dh)
+{
+    return dh->info.header_size >= sizeof(dh->info)
+            && (dh->info.compression == BI_RLE8
+                || dh->info.compression == BI_RLE4);
+}
+
+/*
+ * Run-length encoded bitmaps must be bottom-up and of the bpp their
+ * encoding is for, bitfields are only for 16 and 32bpp
+ */
+static int _CompressionSupported(const struct bitmapinfoheader *ih)
+{
+    switch (ih->compression) {
+    case BI_RGB:
+        return 1;
+    case BI_RLE8:
+        return ih->bpp == 8 && ih->height > 0;
+    case BI_RLE4:
+        return ih->bpp == 4 && ih->height > 0;
+    case BI_BITFIELDS:
+        return ih->bpp == 16 || ih->bpp == 32;
     }
 
     return 0;
@@ -372,122 +865,462 @@ static void _DumpInfoheader(struct bitmapinfoheader * ih)
 }
 #endif /* 1 */
 
-static int _ParseHeaders(const char *filename, int fd,
-                     struct bmpfile_header *bh, DIB_HEADER *dh)
+/**
+ * Check the headers against the size of the file and find out the size of
+ * the image and the stride of its lines in the file
+ */
+static int _ParseHeaders(const char *filename, size_t file_size,
+                         const unsigned char *file, DIB_HEADER *dh,
+                         struct image_info *image,
+                         const unsigned char **bits, size_t *stride)
 {
-    struct stat fst;
-
-    if (stat(filename, &fst))
-        ERR_RET(-1, "Could not stat %s", filename);
+    struct bmpfile_header bh;
+    unsigned int bpp;
+    uint64_t bitmap_size;
 
     /* TODO: convert all the values in headers to host endianness for
      * portability. */
 
-    if (bh->magic_bytes[0] != 'B' || bh->magic_bytes[1] != 'M'
-            || bh->filesz != (uint32_t)fst.st_size
-            || (uint32_t)fst.st_size <= bh->bmp_offset) {
+    if (file_size < sizeof(bh) + sizeof(dh->core)) {
+        LOG(LOG_ERR, "Incorrect bitmap format in %s", filename);
+        return -1;
+    }
+
+    memcpy(&bh, file, sizeof(bh));
+    if (bh.magic_bytes[0] != 'B' || bh.magic_bytes[1] != 'M'
+            || bh.filesz != file_size
+            || file_size <= bh.bmp_offset) {
         LOG(LOG_ERR, "Incorrect bitmap format in %s", filename);
         return -1;
     }
 
-    if (read(fd, dh, sizeof(DIB_HEADER)) != sizeof(DIB_HEADER))
-        ERR_RET(-1, "Could not read the DIB header from %s", filename);
+    /* The DIB header may be shorter than the largest one we know */
+    memset(dh, 0, sizeof(*dh));
+    memcpy(dh, file + sizeof(bh), (file_size - sizeof(bh) < sizeof(*dh))
+            ? file_size - sizeof(bh) : sizeof(*dh));
 
-    if (dh->info.header_size < sizeof(dh->info)
-            && dh->core.header_size != sizeof(dh->core)) {
+    if ((dh->info.header_size < sizeof(dh->info)
+                && dh->core.header_size != sizeof(dh->core))
+            || dh->info.header_size > file_size - sizeof(bh)) {
         LOG(LOG_ERR, "Unsupported BMP format");
         return -1;
     }
 
     /* At least BITMAPINFOHEADER bytes */
     if (dh->info.header_size >= sizeof(dh->info)) {
-        uint32_t bitmap_size;
-
-        bitmap_size = (abs(dh->info.height) * abs(dh->info.width)
-                * dh->info.bpp + 7) / 8;
-
         if (dh->info.nplanes != 1
-                || (dh->info.compression != BI_RGB
-                    && dh->info.compression != BI_BITFIELDS)
-                || dh->info.ncolors
-                || fst.st_size - bh->bmp_offset < dh->info.bmp_size
-                || dh->info.bmp_size < bitmap_size) {
+                || !_CompressionSupported(&dh->info)
+                || (dh->info.ncolors && dh->info.bpp > 8)
+                || !dh->info.width || !dh->info.height
+                || dh->info.width == INT32_MIN
+                || dh->info.height == INT32_MIN) {
             LOG(LOG_ERR, "Unsupported BMP format");
             _DumpInfoheader(&dh->info);
             return -1;
         }
+
+        image->width = abs(dh->info.width);
+        image->height = abs(dh->info.height);
+        bpp = dh->info.bpp;
     } else { /* BITMAPCOREHEADER */
-        uint32_t bitmap_size;
+        image->width = dh->core.width;
+        image->height = dh->core.height;
+        bpp = dh->core.bpp;
+    }
 
-        bitmap_size = (dh->core.width * dh->core.height
-                       * dh->core.bpp + 7) / 8;
-        if (fst.st_size - bh->bmp_offset < bitmap_size) {
-            LOG(LOG_ERR, "Unsupported BMP format");
-            return -1;
-        }
+    /* Palettised pixels must not span bytes */
+    if (bpp <= 8 && bpp != 1 && bpp != 2 && bpp != 4 && bpp != 8) {
+        LOG(LOG_ERR, "Unsupported BMP format");
+        return -1;
+    }
+
+    if (image->width > BMP_MAX_SIZE || image->height > BMP_MAX_SIZE) {
+        LOG(LOG_ERR, "Bitmap %s is too large: %dx%d", filename,
+                image->width, image->height);
+        return -1;
+    }
+
+    *bits = file + bh.bmp_offset;
+
+    /* Runs are checked as they are decoded */
+    if (_IsRle(dh)) {
+        *stride = 0;
+        return 0;
+    }
+
+    /* Lines are padded to 4 bytes */
+    *stride = (((uint64_t)image->width * bpp + 31) / 32) * 4;
+    bitmap_size = (uint64_t)*stride * image->height;
+    if (!bitmap_size || file_size - bh.bmp_offset < bitmap_size) {
+        LOG(LOG_ERR, "Corrupt BMP, not enough pixels in %s", filename);
+        return -1;
     }
 
     return 0;
 }
 
-int bmp_read(const char *filename, struct image_info *bitmap)
+static int _IsPalettised(const DIB_HEADER *dh)
 {
-    int fd;
-    struct bmpfile_header bmp_header;
-    DIB_HEADER dib_header;
-    unsigned char *bmp_buffer;
-    size_t bitmap_size;
-    int r;
-
-    if ((fd = open(filename, O_RDONLY)) < 0)
-        ERR_RET(-1, "Could not open file %s", filename);
+    return (dh->info.header_size >= sizeof(dh->info))
+            ? dh->info.bpp <= 8 : dh->core.bpp <= 8;
+}
 
-    if (read(fd, &bmp_header, sizeof(bmp_header)) != sizeof(bmp_header)) {
-        ERR("Could not read header from file %s", filename);
-        close(fd);
+/*
+ * Read the colour table that follows the DIB header into ARGB32 colours.
+ * Colours the table leaves out are opaque black.
+ */
+static int _ParsePalette(const char *filename, const unsigned char *file,
+                         const unsigned char *bits, const DIB_HEADER *dh,
+                         uint32_t *palette)
+{
+    const int core = dh->info.header_size < sizeof(dh->info);
+    const unsigned int bpp = (core) ? dh->core.bpp : dh->info.bpp;
+    const size_t entry = (core) ? 3 : 4; /* RGBTRIPLE or RGBQUAD */
+    const unsigned char *p = file + sizeof(struct bmpfile_header)
+            + dh->info.header_size;
+    unsigned int count = (core || !dh->info.ncolors)
+            ? 1U << bpp : dh->info.ncolors;
+    unsigned int i;
+
+    if (count > 1U << bpp)
+        count = 1U << bpp;
+
+    if (bits < p || (size_t)(bits - p) < count * entry) {
+        LOG(LOG_ERR, "Corrupt BMP, no room for %u colours in %s", count,
+                filename);
         return -1;
     }
 
-    if (_ParseHeaders(filename, fd, &bmp_header, &dib_header)) {
-        close(fd);
-        return -1;
+    for (i = 0; i < FB_PALETTE_SIZE; ++i, p += entry)
+        palette[i] = 0xFF000000 | ((i < count)
+                ? (uint32_t)p[2] << 16 | p[1] << 8 | p[0] : 0);
+
+    return 0;
+}
+
+/*
+ * Split a line of 1, 2, 4 or 8bpp into a byte per pixel. Those are the only
+ * depths _ParseHeaders() lets through, other ones would have pixels spanning
+ * bytes.
+ */
+static void _UnpackIndices(unsigned char *out, const unsigned char *in,
+                           int width, unsigned int bpp)
+{
+    const unsigned int mask = (1U << bpp) - 1;
+    int x;
+
+    if (bpp == 8) {
+        memcpy(out, in, width);
+        return;
     }
 
-    if (dib_header.core.header_size == sizeof(dib_header.core)) {
-        bitmap->width = dib_header.core.width;
-        bitmap->height = dib_header.core.height;
-        bitmap_size = ((dib_header.core.width * dib_header.core.bpp + 31)
-                       / 32) * 4;
-        bitmap_size *= dib_header.core.height;
-    } else {
-        bitmap->width = abs(dib_header.info.width);
-        bitmap->height = abs(dib_header.info.height);
-        bitmap_size = dib_header.info.bmp_size;
+    for (x = 0; x < width; ++x) {
+        const unsigned int bit = x * bpp;
+
+        out[x] = in[bit >> 3] >> (8 - bpp - (bit & 7)) & mask;
     }
+}
+
+/*
+ * Decode a BI_RLE8 or BI_RLE4 bitmap into 'out', top row first. Pixels the
+ * runs skip are left 0, and runs past the edges are cut. A bitmap whose
+ * data ends without the end marker is taken as it is.
+ */
+static int _DecodeRle(unsigned char *out, const unsigned char *in,
+                      const unsigned char *end, int width, int height,
+                      int rle4)
+{
+    int x = 0, y = height - 1; /* Rows go bottom up */
+    int i;
+
+    while (end - in >= 2 && y >= 0) {
+        const int count = in[0], value = in[1];
+        unsigned char *row = out + (size_t)y * width;
+
+        in += 2;
+
+        /* Runs and moves past the right edge stop at it */
+        if (x > width)
+            x = width;
+
+        if (count) { /* A run of a pixel, or of two alternating in RLE4 */
+            for (i = 0; i < count && x + i < width; ++i)
+                row[x + i] = (!rle4) ? value
+                        : (i & 1) ? value & 0x0F : value >> 4;
+            x += count;
+            continue;
+        }
 
-    bmp_buffer = malloc(bitmap_size);
-    if (!(bmp_buffer)) {
-        LOG(LOG_ERR, "Could not allocate %zu bytes of memory for the bitmap",
-                bitmap_size);
-        close(fd);
+        switch (value) {
+        case 0: /* End of line */
+            x = 0;
+            --y;
+            break;
+
+        case 1: /* End of bitmap */
+            return 0;
+
+        case 2: /* Move right and up */
+            if (end - in < 2)
+                return -1;
+            x += in[0];
+            y -= in[1];
+            in += 2;
+            break;
+
+        default: { /* Pixels as they are, padded to 16 bits */
+            const int bytes = (rle4) ? (value + 1) / 2 : value;
+
+            if (end - in < bytes)
+                return -1;
+            for (i = 0; i < value && x + i < width; ++i)
+                row[x + i] = (!rle4) ? in[i]
+                        : (i & 1) ? in[i / 2] & 0x0F : in[i / 2] >> 4;
+            x += value;
+            in += (end - in > bytes) ? (bytes + 1) & ~1 : bytes;
+        }
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Decode a palettised bitmap into a byte per pixel. If 'indexed', the
+ * pixel buffer keeps them with the palette converted into 'format' for
+ * fb_blit() to look the pixels up, otherwise it gets the pixels themselves.
+ */
+static int _ParseIndexed(const char *filename, const unsigned char *file,
+                         size_t file_size, const unsigned char *bits,
+                         size_t in_stride, DIB_HEADER *dh,
+                         struct image_info *image,
+                         const struct pixel_format *format, int indexed,
+                         const struct pixel_room *room)
+{
+    const size_t size = (size_t)image->width * image->height;
+    const int bytes = pixel_bytes(format);
+    uint32_t argb[FB_PALETTE_SIZE];
+    unsigned char *indices, *out = NULL;
+    uint32_t *palette;
+    int i;
+
+    if (_ParsePalette(filename, file, bits, dh, argb))
         return -1;
+
+    /* Kept indices are the pixels, the others are only on the way */
+    indices = (indexed) ? pixel_room_alloc(room, size) : malloc(size);
+    palette = malloc(FB_PALETTE_SIZE * sizeof(*palette));
+    if (!indices || !palette)
+        goto no_memory;
+    memset(indices, 0, size);
+
+    if (_IsRle(dh)) {
+        if (_DecodeRle(indices, bits, file + file_size, image->width,
+                       image->height, dh->info.compression == BI_RLE4)) {
+            LOG(LOG_ERR, "Corrupt BMP, runs are cut short in %s", filename);
+            goto fail;
+        }
+    } else {
+        const unsigned int bpp = (dh->info.header_size >= sizeof(dh->info))
+                ? dh->info.bpp : dh->core.bpp;
+        const int top_down = dh->info.header_size >= sizeof(dh->info)
+                && dh->info.height < 0;
+
+        for (i = 0; i < image->height; ++i)
+            _UnpackIndices(indices + (size_t)((top_down) ? i
+                                : image->height - 1 - i) * image->width,
+                           bits + i * in_stride, image->width, bpp);
+    }
+
+    for (i = 0; i < FB_PALETTE_SIZE; ++i)
+        palette[i] = pixel_pack(format, argb[i]);
+
+    image->stride = 0;
+    image->rle = NULL;
+    image->under = NULL;
+
+    if (indexed) {
+        image->bpp = 8;
+        image->pixel_buffer = indices;
+        image->palette = palette;
+        return 0;
     }
 
-    r = lseek(fd, bmp_header.bmp_offset, SEEK_SET) == (off_t)-1
-            || read(fd, bmp_buffer, bitmap_size) != (ssize_t)bitmap_size;
+    out = pixel_room_alloc(room, size * bytes);
+    if (!out)
+        goto no_memory;
+    for (i = 0; i < image->height; ++i)
+        pixel_lookup_line(format, out + (size_t)i * image->width * bytes,
+                          indices + (size_t)i * image->width, palette,
+                          image->width);
+    free(indices);
+    free(palette);
+
+    image->bpp = format->bpp;
+    image->pixel_buffer = out;
+    image->palette = NULL;
+    return 0;
+
+no_memory:
+    ERR("could not allocate memory");
+fail:
+    pixel_room_free(room, indices);
+    free(palette);
+    return -1;
+}
+
+/*
+ * Map an image file into memory, NULL if it cannot be an image or if it
+ * cannot be mapped
+ */
+static unsigned char *_MapFile(const char *filename, int *fd, size_t *size)
+{
+    struct stat st;
+    unsigned char *file;
+
+    if ((*fd = open(filename, O_RDONLY)) < 0)
+        ERR_RET(NULL, "Could not open file %s", filename);
+
+    if (fstat(*fd, &st)) {
+        ERR("Could not stat %s", filename);
+        close(*fd);
+        return NULL;
+    }
+
+    if (!S_ISREG(st.st_mode) || !st.st_size || st.st_size > UINT32_MAX) {
+        LOG(LOG_ERR, "Incorrect bitmap format in %s", filename);
+        close(*fd);
+        return NULL;
+    }
+
+    file = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, *fd, 0);
+    if (file == MAP_FAILED) {
+        ERR("Could not map %s", filename);
+        close(*fd);
+        return NULL;
+    }
+
+    *size = st.st_size;
+    return file;
+}
+
+/**
+ * Find out the size of a bitmap from its headers, without decoding it, and
+ * whether bmp_read_indexed() keeps its pixels indexed
+ */
+int bmp_probe(const char *filename, int *width, int *height, int *indexed)
+{
+    int fd;
+    size_t size;
+    DIB_HEADER dib_header;
+    struct image_info bitmap;
+    unsigned char *file;
+    const unsigned char *bits;
+    size_t stride;
+    int r;
+
+    file = _MapFile(filename, &fd, &size);
+    if (!file)
+        return -1;
+
+    *indexed = 0;
+    if (png_check(file, size))
+        r = png_size(filename, file, size, &bitmap.width, &bitmap.height);
+    else {
+        r = _ParseHeaders(filename, size, file, &dib_header, &bitmap, &bits,
+                          &stride);
+        *indexed = !r && _IsPalettised(&dib_header);
+    }
+    munmap(file, size);
     close(fd);
 
     if (r)
-        ERR_RET(-1, "Could not read bitmap %s", filename);
+        return -1;
+
+    *width = bitmap.width;
+    *height = bitmap.height;
+    return 0;
+}
+
+static int _Read(const char *filename, struct image_info *bitmap,
+                 const struct pixel_format *format, int indexed,
+                 const struct pixel_room *room)
+{
+    int fd;
+    size_t size;
+    DIB_HEADER dib_header;
+    unsigned char *file;
+    const unsigned char *bits;
+    size_t stride, data = 0;
+    int png, r;
+
+    /* Lines are parsed right from the page cache */
+    file = _MapFile(filename, &fd, &size);
+    if (!file)
+        return -1;
+    madvise(file, size, MADV_SEQUENTIAL);
+
+    /* PNG images are told by their signature, whatever the file is named */
+    png = png_check(file, size);
+    if (png)
+        r = png_decode(filename, file, size, bitmap, format, room);
+    else if (!(r = _ParseHeaders(filename, size, file, &dib_header, bitmap,
+                                  &bits, &stride))) {
+        if (_IsPalettised(&dib_header))
+            r = _ParseIndexed(filename, file, size, bits, stride,
+                              &dib_header, bitmap, format, indexed, room);
+        else
+            r = _ParseBitmap(bits, bitmap, stride, &dib_header, format,
+                             room);
+
+        /* Encoded bitmaps take the rest of the file */
+        data = (stride) ? stride * bitmap->height
+                : (size_t)(file + size - bits);
+    }
 
-    r = _ParseBitmap(bmp_buffer, bitmap, bitmap_size, &dib_header);
-    free(bmp_buffer);
+    /* The file is not going to be read again */
+    munmap(file, size);
+    posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    close(fd);
 
 #if 1
-    if (!r)
+    if (!r && png)
+        LOG(LOG_DEBUG, "Decoded PNG %s: %dx%d, %zu bytes in file",
+                filename, bitmap->width, bitmap->height, size);
+    else if (!r)
         LOG(LOG_DEBUG, "Parsed bitmap %s: %dx%d, bitmap size in BMP %zu bytes",
-        		filename, bitmap->width, bitmap->height, bitmap_size);
+        		filename, bitmap->width, bitmap->height, data);
 #endif /* 0 */
 
     return (r) ? -1 : 0;
 }
+
+/**
+ * Read a bitmap, converting its pixels into the given format
+ */
+int bmp_read(const char *filename, struct image_info *bitmap,
+             const struct pixel_format *format)
+{
+    return _Read(filename, bitmap, format, 0, NULL);
+}
+
+/**
+ * Read a bitmap like bmp_read(), but keep a palettised one as a byte per
+ * pixel indexing its palette, which is converted into the given format
+ */
+int bmp_read_indexed(const char *filename, struct image_info *bitmap,
+                     const struct pixel_format *format)
+{
+    return _Read(filename, bitmap, format, 1, NULL);
+}
+
+/**
+ * Read a bitmap like bmp_read(), or bmp_read_indexed() if 'indexed', into
+ * 'room' if its pixels fit there
+ */
+int bmp_read_into(const char *filename, struct image_info *bitmap,
+                  const struct pixel_format *format, int indexed,
+                  const struct pixel_room *room)
+{
+    return _Read(filename, bitmap, format, indexed, room);
+}
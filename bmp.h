@@ -16,7 +16,17 @@
 
 
 struct image_info;
+struct pixel_format;
+struct pixel_room;
 
-int bmp_read(const char *filename, struct image_info *bitmap);
+int bmp_probe(const char *filename, int *width, int *height, int *indexed);
+int bmp_read(const char *filename, struct image_info *bitmap,
+        const struct pixel_format *format);
+int bmp_read_indexed(const char *filename, struct image_info *bitmap,
+        const struct pixel_format *format);
+int bmp_read_into(const char *filename, struct image_info *bitmap,
+        const struct pixel_format *format, int indexed,
+        const struct pixel_room *room);
+int bmp_line_parsers(const char *isa);
 
 #endif /* BMP_H */
@@ -11,12 +11,20 @@
  */
 
 #include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "animation.h"
 #include "log.h"
+#include "stats.h"
 
 #define TTYPE_NOTOKEN		0
 #define TTYPE_INT		0x1000
@@ -26,78 +34,132 @@
 
 #define TOKEN_WHITESPACE	(TTYPE_NOTOKEN	| 0)
 #define TOKEN_CMD_DELIMITER	(TTYPE_NOTOKEN	| 1)
+#define TOKEN_TOO_LONG		(TTYPE_NOTOKEN	| 2)
 
 #define TOKEN_PERCENT		(TTYPE_INT	| 2)
 #define TOKEN_FLOAT		(TTYPE_FLOAT	| 3)
 #define TOKEN_INTEGER		(TTYPE_INT	| 4)
 #define TOKEN_CHARACTER		(TTYPE_STRING	| 5)
 #define TOKEN_FRAME		(TTYPE_INT	| 6)
+#define TOKEN_TARGET		(TTYPE_INT	| 7)
 
 #define TOKEN_EXIT		(TTYPE_STRING	| 10)
 #define TOKEN_RUN		(TTYPE_STRING	| 11)
 #define TOKEN_SKIP		(TTYPE_STRING	| 12)
+#define TOKEN_STATS		(TTYPE_STRING	| 13)
 
-#define TOKEN_BUFFER_SIZE	255
+/* Longer tokens are not recognized, it is neither a command nor a number */
+#define TOKEN_MAX_LENGTH	32
+
+/* Bytes of input read at once and held until they make up commands */
+#define COMMANDS_INPUT_SIZE	4096
+/* Commands waiting for a run with a limit to end */
+#define COMMANDS_QUEUE_SIZE	16
+/* Animations told apart while holding commands back, the rest share a bit */
+#define COMMANDS_TARGET_BITS	64
+
+union token_value {
+	float factor;
+	int number;
+};
+
+/* Tokens are parsed in place, 'text' points into the input */
+struct token {
+	union token_value value;
+	const char *text;
+};
+
+struct command {
+	int type; /* TOKEN_RUN or TOKEN_SKIP */
+	int target; /* Animation of the scene, -1 for all */
+	int arg_type; /* Of the parameter, TOKEN_CMD_DELIMITER without one */
+	union token_value arg;
+	struct timespec received;
+};
 
 struct commands_data {
-	FILE *command_fifo;
+	struct animation *banner;
+	int fifo_fd;
+	int fifo_writer; /* Keeps the pipe from reporting end of input */
+	int timer_fd;
 	char *fifo_name;
-	char *token_buffer;
 	int token_cmd_delimiter;
+	int discarding; /* Input is skipped up to the next delimiter */
+	char input[COMMANDS_INPUT_SIZE + 1]; /* Room to end the last token */
+	int input_start; /* First byte not parsed yet */
+	int input_end;
+	struct timespec received; /* When the input was last read */
+	struct command queue[COMMANDS_QUEUE_SIZE];
+	int queue_head;
+	int queue_len;
 };
 
-static inline int get_symbol(struct commands_data *parser)
+static inline int is_cmd_delimiter(char symbol)
 {
-	FILE *command_fifo = parser->command_fifo;
-	int symbol;
-
-	if (!command_fifo) {
-		command_fifo = fopen(parser->fifo_name, "r");
-		if (command_fifo == NULL)
-			ERR_RET(-1, "Could not open command pipe");
-		parser->command_fifo = command_fifo;
-	}
-
-	while ((symbol = fgetc(command_fifo)) == EOF) {
-		LOG(LOG_DEBUG, "the other end closed pipe, reopening");
-		fclose(command_fifo);
-		command_fifo = fopen(parser->fifo_name, "r");
-		if (command_fifo == NULL)
-			ERR_RET(1, "Could not open command pipe");
-		parser->command_fifo = command_fifo;
-	}
-
-	return symbol;
+	return symbol == ';' || symbol == '\r' || symbol == '\n';
 }
 
-static inline int token_check_fit(int type, int buffer_size)
+/**
+ * Read what has arrived from the pipe without waiting. Returns -1 on error.
+ */
+static int commands_read(struct commands_data *parser)
 {
-	int req_size;
+	ssize_t r;
 
-	switch (type & TTYPE_MASK) {
-	case TTYPE_INT:
-		req_size = sizeof(int);
-		break;
-
-	case TTYPE_FLOAT:
-		req_size = sizeof(float);
-		break;
+	if (parser->input_start) {
+		memmove(parser->input, parser->input + parser->input_start,
+				parser->input_end - parser->input_start);
+		parser->input_end -= parser->input_start;
+		parser->input_start = 0;
+	}
 
-	case TTYPE_STRING:
-		req_size = 2; /* At least one symbol and one '\0' */
-		break;
+	while (parser->input_end < COMMANDS_INPUT_SIZE) {
+		r = read(parser->fifo_fd, parser->input + parser->input_end,
+				COMMANDS_INPUT_SIZE - parser->input_end);
+		if (r > 0) {
+			parser->input_end += r;
+			clock_gettime(CLOCK_MONOTONIC, &parser->received);
+			continue;
+		}
 
-	default:
-		req_size = 0;
+		if (r < 0 && errno == EINTR)
+			continue;
+		if (r < 0 && errno != EAGAIN)
+			ERR_RET(-1, "could not read command pipe");
 		break;
 	}
 
-	if (buffer_size < req_size) {
-		LOG(LOG_DEBUG, "internal error: buffer passed to get_token()"
-				" if not enough to hold it (required size %d"
-				" but only %d available)",
-				req_size, buffer_size);
-		return -1;
+	return 0;
+}
+
+/*
+ * Skip empty commands and tell whether a complete one is in the input
+ */
+static int commands_complete(struct commands_data *parser)
+{
+	const char *input = parser->input;
+	int i;
+
+	/* The rest of a command that has been too long */
+	while (parser->discarding && parser->input_start < parser->input_end)
+		if (is_cmd_delimiter(input[parser->input_start++]))
+			parser->discarding = 0;
+
+	while (parser->input_start < parser->input_end
+			&& (isblank(input[parser->input_start])
+			|| is_cmd_delimiter(input[parser->input_start])))
+		parser->input_start++;
+
+	for (i = parser->input_start; i < parser->input_end; ++i)
+		if (is_cmd_delimiter(input[i]))
+			return 1;
+
+	if (!parser->input_start
+			&& parser->input_end == COMMANDS_INPUT_SIZE) {
+		LOG(LOG_ERR, "command longer than %d bytes, discarded",
+				COMMANDS_INPUT_SIZE);
+		parser->input_start = parser->input_end;
+		parser->discarding = 1;
 	}
 
 	return 0;
@@ -148,22 +210,17 @@ static inline int token_categorize(int type, char symbol)
 	return type;
 }
 
-static inline int token_convert(char *buffer, int type, void *token, int tsize)
+static inline int token_convert(char *text, int type, struct token *token)
 {
-	float fv;
-
-	/* We already checked that it fits (except for
-	 * string) */
 	switch (type) {
 	case TOKEN_INTEGER:
 	case TOKEN_PERCENT:
 	case TOKEN_FRAME:
-		*(int *)token = strtoul(buffer, NULL, 0);
+		token->value.number = strtoul(text, NULL, 0);
 		break;
 
 	case TOKEN_FLOAT:
-		sscanf(buffer, "%f", &fv);
-		*(float *)token = fv;
+		token->value.factor = strtof(text, NULL);
 		break;
 
 	default:
@@ -173,26 +230,40 @@ static inline int token_convert(char *buffer, int type, void *token, int tsize)
 			break;
 		}
 
-		/* The string is properly null-terminated */
-		strncpy(token, buffer, tsize);
-
-		if (!strcmp(buffer, "exit"))
+		if (!strcmp(text, "exit"))
 			type = TOKEN_EXIT;
-		else if (!strcmp(buffer, "run"))
+		else if (!strcmp(text, "run"))
 			type = TOKEN_RUN;
-		else if (!strcmp(buffer, "skip"))
+		else if (!strcmp(text, "skip"))
 			type = TOKEN_SKIP;
+		else if (!strcmp(text, "stats"))
+			type = TOKEN_STATS;
+		else if (text[0] == '@' && isdigit(text[1])) {
+			char *end;
+			unsigned long n = strtoul(text + 1, &end, 10);
+
+			/* Out of range it is not a target but a bad command */
+			if (!*end && n <= INT_MAX) {
+				token->value.number = (int)n;
+				type = TOKEN_TARGET;
+			}
+		}
 	}
 
 	return type;
 }
 
-static int get_token(struct commands_data *parser, void *token, int token_size)
+/*
+ * Get the next token of a complete command in the input. The token is
+ * lowercased and terminated in place, over the blank or the delimiter that
+ * ends it; a delimiter is reported as a token of its own on the next call.
+ */
+static int get_token(struct commands_data *parser, struct token *token)
 {
-	static char _cmd_delimiters[] = ";\r\n";
-	int i;
+	char *p = parser->input + parser->input_start;
+	char *const end = parser->input + parser->input_end;
+	char *start;
 	int type = -1;
-	char *buffer = parser->token_buffer;
 
 	/* Command delimiter was consumed but unreported earlier */
 	if (parser->token_cmd_delimiter) {
@@ -200,53 +271,33 @@ static int get_token(struct commands_data *parser, void *token, int token_size)
 		return TOKEN_CMD_DELIMITER;
 	}
 
-	/* Get symbols until one of the delimiters or the size limit is reached.
-	 * Categorize if not already done so, and act depending on token category
-	 * (parse either a word, an integer, a float or whatnot).
-	 */
-	for (i = 0; i < TOKEN_BUFFER_SIZE - 1; ) {
-		char symbol;
-		int r = get_symbol(parser);
-		int is_delimiter = 0;
-
-		if (r == -1)
-			break;
-		symbol = (char)r;
-
-		if (isblank(symbol)) {
-			if (type == -1) /* Ignore whitespaces before token */
-				continue;
-		} else {
-			is_delimiter = strchr(_cmd_delimiters, symbol) != NULL;
-			if (type == -1 && is_delimiter)
-				continue; /* Ignore delimiters before token */
-		}
+	while (p < end && isblank(*p)) /* Ignore whitespaces before token */
+		p++;
 
-		if (isblank(symbol) || is_delimiter) {
-			/* The token is ready */
-			buffer[i] = '\0';
-
-			if (is_delimiter) /* Report delimiter separately */
-				parser->token_cmd_delimiter = 1;
+	if (p < end && is_cmd_delimiter(*p)) { /* No more tokens */
+		parser->input_start = p + 1 - parser->input;
+		return TOKEN_CMD_DELIMITER;
+	}
 
-			/* Convert the string into token, based on category */
-			type = token_convert(buffer, type, token, token_size);
-			break;
-		}
+	for (start = p; p < end && !isblank(*p) && !is_cmd_delimiter(*p); ++p) {
+		if (isalpha(*p))
+			*p = tolower(*p);
+		type = token_categorize(type, *p);
+	}
 
-		if (isalpha(symbol))
-			symbol = tolower(symbol);
-		buffer[i] = symbol;
-		type = token_categorize(type, symbol);
-		if (token_check_fit(type, token_size)) {
-			type = -1;
-			break;
-		}
+	if (p < end && is_cmd_delimiter(*p)) /* Report delimiter separately */
+		parser->token_cmd_delimiter = 1;
+	*p = '\0';
+	parser->input_start = ((p < end) ? p + 1 : p) - parser->input;
+	token->text = start;
 
-		i++;
-	}
+	if (type == -1)
+		return -1; /* Out of input, not a complete command */
+	if (p - start > TOKEN_MAX_LENGTH)
+		return TOKEN_TOO_LONG;
 
-	return type;
+	/* Convert the string into token, based on category */
+	return token_convert(start, type, token);
 }
 
 static inline const char *spell_token_type(int type)
@@ -256,16 +307,21 @@ static inline const char *spell_token_type(int type)
 		return "whitespace";
 	case TOKEN_CMD_DELIMITER:
 		return "command delimiter";
+	case TOKEN_TOO_LONG:
+		return "too long character sequence";
 	case TOKEN_PERCENT:
 	case TOKEN_FLOAT:
 	case TOKEN_INTEGER:
 	case TOKEN_FRAME:
 		return "number";
+	case TOKEN_TARGET:
+		return "animation";
 	case TOKEN_CHARACTER:
 		return "character";
 	case TOKEN_EXIT:
 	case TOKEN_RUN:
 	case TOKEN_SKIP:
+	case TOKEN_STATS:
 		return "command";
 	case TTYPE_STRING:
 		return "arbitrary character sequence";
@@ -279,140 +335,394 @@ static inline const char *spell_token_type(int type)
  * duration is: integer% OR float OR {integer}f
  * The latter form ({integer}f) is the pause frame number
  */
-static inline int parse_run_skip(int skip, struct animation *banner,
-		int *need_exit)
+static inline int parse_run_skip(struct commands_data *parser,
+		struct command *cmd)
 {
+	const char *cmd_name = (cmd->type == TOKEN_SKIP) ? "skip" : "run";
+	struct token token;
 	int token_type;
-	union {
-		float factor;
-		int number;
-	} token;
-	int frames = -1;
-	const char *cmd_name = (skip) ? "skip" : "run";
 
-	token_type = get_token(banner->commands, &token,
-			sizeof(token));
+	cmd->arg_type = get_token(parser, &token);
+	cmd->arg = token.value;
 
-	switch (token_type) {
+	switch (cmd->arg_type) {
 	case TOKEN_PERCENT:
-		frames = (banner->frame_count * token.number) / 100;
-		break;
-
 	case TOKEN_INTEGER:
-		frames = banner->frame_count * token.number;
-		break;
-
 	case TOKEN_FLOAT:
-		frames = (int)(banner->frame_count * token.factor);
-		break;
-
 	case TOKEN_FRAME:
-		token.number %= banner->frame_count;
-		if (token.number < banner->frame_num)
-			token.number += banner->frame_count;
-		frames = token.number - banner->frame_num;
-		break;
-
 	case TOKEN_CMD_DELIMITER:
 		break;
 
 	default:
 		LOG(LOG_ERR, "incorrect parameter to \'%s\': %s (%x)",
-				cmd_name, spell_token_type(token_type),
-				token_type);
-		*need_exit = 1;
+				cmd_name, spell_token_type(cmd->arg_type),
+				cmd->arg_type);
 		return -1;
 	}
 
-	if (token_type != TOKEN_CMD_DELIMITER) {
-		token_type = get_token(banner->commands, &token,
-				sizeof(token));
+	if (cmd->arg_type != TOKEN_CMD_DELIMITER) {
+		token_type = get_token(parser, &token);
 		if (token_type != TOKEN_CMD_DELIMITER) {
 			LOG(LOG_ERR, "unexpected remainder of \'%s\': %s",
 				cmd_name, spell_token_type(token_type));
-			*need_exit = 1;
 			return -1;
 		}
 	}
 
-	if (skip && frames == -1) {
+	if (cmd->type == TOKEN_SKIP && cmd->arg_type == TOKEN_CMD_DELIMITER) {
 		LOG(LOG_ERR, "\'skip\' must be told how much frames to skip");
-		*need_exit = 1;
 		return -1;
 	}
 
-	LOG(LOG_DEBUG, "%s requested for %d frames", cmd_name, frames);
-	if (!skip)
-		return animation_run(banner, frames);
-	else {
-		banner->frame_num = (banner->frame_num + frames)
-				% banner->frame_count;
-		return 0;
+	cmd->received = parser->received;
+
+	return 0;
+}
+
+/* Frames of animation 'a' a run or skip command is for, -1 for no limit */
+static int command_frames(struct animation *a, const struct command *cmd)
+{
+	const int count = animation_frame_count(a);
+	int frame;
+
+	switch (cmd->arg_type) {
+	case TOKEN_PERCENT:
+		return (count * cmd->arg.number) / 100;
+
+	case TOKEN_INTEGER:
+		return count * cmd->arg.number;
+
+	case TOKEN_FLOAT:
+		return (int)(count * cmd->arg.factor);
+
+	case TOKEN_FRAME:
+		frame = cmd->arg.number % count;
+		if (frame < a->frame_num)
+			frame += count;
+		return frame - a->frame_num;
+
+	default:
+		return -1;
+	}
+}
+
+/*
+ * Command syntax: stats
+ * The statistics are logged
+ */
+static inline int parse_stats(struct commands_data *parser,
+		struct animation *banner)
+{
+	struct token token;
+	int token_type = get_token(parser, &token);
+
+	if (token_type != TOKEN_CMD_DELIMITER) {
+		LOG(LOG_ERR, "unexpected remainder of \'stats\': %s",
+				spell_token_type(token_type));
+		return -1;
 	}
+
+	stats_dump(banner);
+
+	return 0;
 }
 
-static int parse_loop(struct animation *banner)
+/* Animation 'n' of the scene: the first one, then its sprite layers */
+static struct animation *scene_animation(struct animation *banner, int n)
 {
-	char command[255];
-	char rc = 0;
-	int need_exit = 0;
+	while (banner && n--)
+		banner = banner->next_layer;
 
-	while (!need_exit) {
-		int token_type = get_token(banner->commands,  &command[0],
-				sizeof(command));
+	return banner;
+}
+
+/*
+ * Command syntax: @n {run OR skip} [duration]
+ * The command is for animation n of the scene only
+ */
+static inline int parse_target(struct commands_data *parser,
+		struct animation *banner, struct command *cmd,
+		struct token *token)
+{
+	int token_type;
+
+	cmd->target = token->value.number;
+	if (!scene_animation(banner, cmd->target)) {
+		LOG(LOG_ERR, "no animation @%d", cmd->target);
+		return -1;
+	}
+
+	token_type = get_token(parser, token);
+	if (token_type != TOKEN_RUN && token_type != TOKEN_SKIP) {
+		LOG(LOG_ERR, "'run' or 'skip' expected after @%d: %s",
+				cmd->target, spell_token_type(token_type));
+		return -1;
+	}
+
+	return token_type;
+}
+
+/*
+ * Parse the complete commands that have arrived. 'exit' and 'stats' are
+ * carried out right away, 'run' and 'skip' are queued. Returns 1 on 'exit'
+ * and -1 on a syntax error.
+ */
+static int parse_input(struct commands_data *parser, struct animation *banner)
+{
+	struct token command;
+
+	while (parser->queue_len < COMMANDS_QUEUE_SIZE
+			&& commands_complete(parser)) {
+		struct command *cmd = &parser->queue[(parser->queue_head
+				+ parser->queue_len) % COMMANDS_QUEUE_SIZE];
+		int token_type = get_token(parser, &command);
+
+		cmd->target = -1;
+		if (token_type == TOKEN_TARGET) {
+			token_type = parse_target(parser, banner, cmd,
+					&command);
+			if (token_type < 0)
+				return -1;
+		}
 
 		switch (token_type) {
 		case TOKEN_EXIT:
 			LOG(LOG_DEBUG, "exit requested");
-			need_exit = 1;
-			break;
+			return 1;
 
 		case TOKEN_RUN:
-			rc = parse_run_skip(0, banner, &need_exit);
+		case TOKEN_SKIP:
+			cmd->type = token_type;
+			if (parse_run_skip(parser, cmd))
+				return -1;
+			parser->queue_len++;
 			break;
 
-		case TOKEN_SKIP:
-			rc = parse_run_skip(1, banner, &need_exit);
+		case TOKEN_STATS:
+			if (parse_stats(parser, banner))
+				return -1;
 			break;
 
 		default:
 			if (token_type == TTYPE_STRING)
 				LOG(LOG_ERR, "unrecognized command \'%s\'",
-						command);
+						command.text);
 			else
 				LOG(LOG_ERR, "unrecognized token or error"
 						" while getting it");
-			rc = 1;
-			need_exit = 1;
-			break;
+			return -1;
 		}
 	}
 
-	return rc;
+	return 0;
+}
+
+/* Animations a command is for, as bits for holding back the ones after it */
+static unsigned long long command_targets(const struct command *cmd)
+{
+	if (cmd->target < 0)
+		return ~0ULL;
+
+	return 1ULL << ((cmd->target < COMMANDS_TARGET_BITS)
+			? cmd->target : COMMANDS_TARGET_BITS - 1);
+}
+
+/* Whether one of the animations is in the middle of a run with a limit */
+static int commands_busy(struct animation *banner, unsigned long long targets)
+{
+	struct animation *a;
+	int i;
+
+	for (a = banner, i = 0; a; a = a->next_layer, ++i)
+		if (a->run > 0 && (targets >> ((i < COMMANDS_TARGET_BITS)
+				? i : COMMANDS_TARGET_BITS - 1) & 1))
+			return 1;
+
+	return 0;
+}
+
+/* Carry out a run or skip command for each animation it is for */
+static void command_execute(struct animation *banner,
+		const struct command *cmd)
+{
+	struct animation *a;
+	int i, n;
+
+	for (a = banner, i = 0; a; a = a->next_layer, ++i) {
+		if (cmd->target >= 0 && cmd->target != i)
+			continue;
+
+		n = command_frames(a, cmd);
+		if (cmd->type == TOKEN_RUN) {
+			LOG(LOG_DEBUG, "run requested for %d frames of @%d",
+					n, i);
+			a->run = n;
+		} else {
+			LOG(LOG_DEBUG, "skip requested for %d frames of @%d",
+					n, i);
+			a->frame_num = (a->frame_num + n)
+					% animation_frame_count(a);
+		}
+	}
+
+	/* Measure how soon the command shows on screen */
+	banner->command_time = cmd->received;
+}
+
+/*
+ * Carry out the queued commands whose animations are not in the middle of a
+ * run with a limit, in order for each of them: a command waits for those
+ * before it that are for one of its animations. Returns the number of
+ * commands carried out.
+ */
+static int commands_execute(struct commands_data *parser)
+{
+	unsigned long long held = 0; /* Animations with commands waiting */
+	int i = 0, j, done = 0;
+
+	while (i < parser->queue_len) {
+		struct command *cmd = &parser->queue[(parser->queue_head + i)
+				% COMMANDS_QUEUE_SIZE];
+		const unsigned long long targets = command_targets(cmd);
+
+		if ((held & targets) || commands_busy(parser->banner,
+				targets)) {
+			held |= targets;
+			i++;
+			continue;
+		}
+
+		command_execute(parser->banner, cmd);
+		done++;
+
+		/* Close the gap, the order of the rest stays */
+		for (j = i; j < parser->queue_len - 1; ++j)
+			parser->queue[(parser->queue_head + j)
+					% COMMANDS_QUEUE_SIZE] =
+				parser->queue[(parser->queue_head + j + 1)
+					% COMMANDS_QUEUE_SIZE];
+		parser->queue_len--;
+	}
+
+	return done;
+}
+
+/* Whether one of the animations has a run to play */
+static int commands_running(struct animation *banner)
+{
+	struct animation *a;
+
+	for (a = banner; a; a = a->next_layer)
+		if (a->run)
+			return 1;
+
+	return 0;
+}
+
+/* Wait for commands while the animation is paused */
+static int commands_wait(struct commands_data *parser)
+{
+	struct pollfd fd = { .fd = parser->fifo_fd, .events = POLLIN };
+
+	while (poll(&fd, 1, -1) < 0) {
+		if (errno != EINTR)
+			ERR_RET(-1, "could not wait for commands");
+		stats_poll(parser->banner);
+	}
+
+	return 0;
+}
+
+/*
+ * Playback and commands share one loop. While frames are played, the
+ * animations wait for them to be due together with the command pipe, and
+ * stop at the end of a step when a command arrives. A command is for all
+ * the animations of the scene, or for one given as @n, 0 being the first
+ * and its sprite layers following. A run without a limit is replaced by a
+ * new 'run' there, or goes on from another frame after 'skip'; a run with a
+ * limit goes on to its end before the next command for that animation is
+ * carried out, unless that is 'exit' or 'stats'. The others are not held
+ * up by it.
+ */
+static int parse_loop(struct commands_data *parser, struct animation *banner)
+{
+	int rc = 0;
+
+	while (1) {
+		rc = parse_input(parser, banner);
+		if (rc)
+			break;
+
+		if (commands_execute(parser))
+			continue;
+
+		if (commands_running(banner)) {
+			banner->events = 0;
+			rc = animation_play(banner);
+			if (rc)
+				break;
+		} else if (commands_wait(parser))
+			return -1;
+
+		/* The input is read only when it has been parsed */
+		if (commands_read(parser))
+			return -1;
+	}
+
+	return (rc > 0) ? 0 : rc;
+}
+
+static int commands_open(struct commands_data *parser)
+{
+	/* Opening for reading without waiting for a writer succeeds, then
+	 * the pipe is kept open for writing too, so that writers coming and
+	 * going do not end the input */
+	parser->fifo_fd = open(parser->fifo_name, O_RDONLY | O_NONBLOCK);
+	if (parser->fifo_fd < 0)
+		ERR_RET(-1, "Could not open command pipe");
+
+	parser->fifo_writer = open(parser->fifo_name, O_WRONLY | O_NONBLOCK);
+	if (parser->fifo_writer < 0)
+		ERR_RET(-1, "Could not open command pipe");
+
+	parser->timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+	if (parser->timer_fd < 0)
+		ERR_RET(-1, "could not create a timer");
+
+	return 0;
 }
 
 int commands_fifo(char *name, struct animation *banner)
 {
-	int rc;
-	struct commands_data *parser = malloc(sizeof(struct commands_data));
+	int rc = -1;
+	struct commands_data *parser = calloc(1, sizeof(struct commands_data));
 
 	if (!parser)
 		ERR_RET(-1, "could not allocate memory");
 
+	parser->banner = banner;
 	parser->fifo_name = name;
-	parser->command_fifo = 0;
-	parser->token_buffer = malloc(TOKEN_BUFFER_SIZE);
-	parser->token_cmd_delimiter = 0;
+	parser->fifo_fd = parser->fifo_writer = parser->timer_fd = -1;
 	banner->commands = parser;
 
-	LOG(LOG_INFO, "Waiting for commands from \'%s\'", name);
-	rc = parse_loop(banner);
+	if (!commands_open(parser)) {
+		banner->event_fd = parser->fifo_fd;
+		banner->timer_fd = parser->timer_fd;
+		banner->watch_events = 1;
+
+		LOG(LOG_INFO, "Waiting for commands from \'%s\'", name);
+		rc = parse_loop(parser, banner);
 
-	if (parser->command_fifo)
-		fclose(parser->command_fifo);
-	free(parser->token_buffer);
+		banner->watch_events = 0;
+	}
+
+	if (parser->timer_fd >= 0)
+		close(parser->timer_fd);
+	if (parser->fifo_writer >= 0)
+		close(parser->fifo_writer);
+	if (parser->fifo_fd >= 0)
+		close(parser->fifo_fd);
 	free(parser);
 
 	return rc;
 }
-
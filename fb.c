@@ -14,29 +14,123 @@
 #include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <time.h>
 #include <unistd.h>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #include <linux/fb.h>
 #include <linux/omapfb.h>
 
 #include "fb.h"
 #include "log.h"
+#include "rle.h"
 
 static struct fb_var_screeninfo old_fb_mode;
+static struct fb_var_screeninfo fb_mode;
+
+static void fb_get_format(struct fb_var_screeninfo *var_info,
+        struct pixel_format *f)
+{
+    f->bpp = var_info->bits_per_pixel;
+    f->red.offset = var_info->red.offset;
+    f->red.length = var_info->red.length;
+    f->green.offset = var_info->green.offset;
+    f->green.length = var_info->green.length;
+    f->blue.offset = var_info->blue.offset;
+    f->blue.length = var_info->blue.length;
+    f->transp.offset = var_info->transp.offset;
+    f->transp.length = var_info->transp.length;
+}
+
+/* Assume 60 Hz if the driver does not tell the timings */
+#define FB_DEFAULT_REFRESH_US 16667
+
+static unsigned int fb_refresh_us(const struct fb_var_screeninfo *v)
+{
+    unsigned long long pixels = (unsigned long long)
+            (v->left_margin + v->xres + v->right_margin + v->hsync_len)
+            * (v->upper_margin + v->yres + v->lower_margin + v->vsync_len);
+
+    /* pixclock is in picoseconds */
+    if (!v->pixclock || !pixels)
+        return FB_DEFAULT_REFRESH_US;
+
+    return (unsigned int)(pixels * v->pixclock / 1000000);
+}
+
+/*
+ * Make room for a second page below the visible one if the driver allows,
+ * keeping the pixel format. Returns the number of pages available.
+ */
+static int fb_setup_pages(struct screen_info *sd,
+        struct fb_var_screeninfo *var_info,
+        struct fb_fix_screeninfo *fix_info)
+{
+    struct fb_var_screeninfo v = *var_info;
+    struct pixel_format format;
+
+    if (var_info->yres_virtual < 2 * var_info->yres) {
+        v.yres_virtual = 2 * v.yres;
+        v.activate = FB_ACTIVATE_NOW;
+
+        if (ioctl(sd->fd, FBIOPUT_VSCREENINFO, &v)
+                || ioctl(sd->fd, FBIOGET_VSCREENINFO, &v)
+                || ioctl(sd->fd, FBIOGET_FSCREENINFO, fix_info))
+            return 1;
+
+        fb_get_format(&v, &format);
+        if (!pixel_format_equal(&format, &sd->format)
+                || v.xres != var_info->xres || v.yres != var_info->yres) {
+            /* Take the mode back, whatever the driver has done to it */
+            v = *var_info;
+            v.activate = FB_ACTIVATE_NOW;
+            ioctl(sd->fd, FBIOPUT_VSCREENINFO, &v);
+            ioctl(sd->fd, FBIOGET_VSCREENINFO, var_info);
+            ioctl(sd->fd, FBIOGET_FSCREENINFO, fix_info);
+            return 1;
+        }
+        *var_info = v;
+    }
+
+    if (var_info->yres_virtual < 2 * var_info->yres || !fix_info->ypanstep
+            || var_info->yres % fix_info->ypanstep
+            || fix_info->smem_len
+                < 2ULL * fix_info->line_length * var_info->yres)
+        return 1;
+
+    /* Show the first page, it is also a check that panning works */
+    v = *var_info;
+    v.xoffset = 0;
+    v.yoffset = 0;
+    if (ioctl(sd->fd, FBIOPAN_DISPLAY, &v))
+        return 1;
+    *var_info = v;
+
+    return 2;
+}
 
-int fb_init(struct screen_info *sd)
+/*
+ * Open the framebuffer device and switch it to ARGB32 mode unless
+ * 'keep_format' is set and its current pixel format is one bannerd can
+ * render to
+ */
+static int fb_dev_open(struct screen_info *sd, const char *device,
+        const struct fb_surface *surface, int keep_format)
 {
     struct fb_var_screeninfo var_info;
     struct fb_fix_screeninfo fix_info;
     const struct fb_bitfield color = { .length = 8, .offset = 0, .msb_right = 0 };
-    int i;
-    uint32_t *fb;
 
-    sd->fd = open("/dev/fb0", O_RDWR);
+    (void)surface;
+    sd->fd = open((device) ? device : FB_DEFAULT_DEVICE, O_RDWR);
 
     if (sd->fd < 0)
         ERR_RET(-1, "Unable to open framebuffer");
@@ -54,75 +148,316 @@ int fb_init(struct screen_info *sd)
     		var_info.transp.offset);
     memcpy(&old_fb_mode, &var_info, sizeof(old_fb_mode));
 
-    // ARGB32
-    var_info.bits_per_pixel = 32;
-    var_info.red = color;
-    var_info.red.offset = 16;
-    var_info.green = color;
-    var_info.green.offset = 8;
-    var_info.blue = color;
-    var_info.blue.offset = 0;
-    var_info.transp = color;
-    var_info.transp.offset = 24;
-
-    var_info.activate = FB_ACTIVATE_NOW;
+    fb_get_format(&var_info, &sd->format);
+    if (keep_format && !pixel_format_supported(&sd->format)) {
+        LOG(LOG_WARNING, "Unsupported %d bpp framebuffer format, switching"
+                " to ARGB32", var_info.bits_per_pixel);
+        keep_format = 0;
+    }
 
-    if (ioctl(sd->fd, FBIOPUT_VSCREENINFO, &var_info))
-        ERR_RET(-1, "Unable to set screen information");
+    /* Setting ARGB32 again would cost a modeset for nothing */
+    if (!keep_format && pixel_format_equal(&sd->format, &pixel_format_argb32))
+        LOG(LOG_DEBUG, "Frame buffer is in ARGB32 mode already");
+    else if (!keep_format) {
+        // ARGB32
+        var_info.bits_per_pixel = 32;
+        var_info.red = color;
+        var_info.red.offset = 16;
+        var_info.green = color;
+        var_info.green.offset = 8;
+        var_info.blue = color;
+        var_info.blue.offset = 0;
+        var_info.transp = color;
+        var_info.transp.offset = 24;
+
+        var_info.activate = FB_ACTIVATE_NOW;
+
+        if (ioctl(sd->fd, FBIOPUT_VSCREENINFO, &var_info))
+            ERR_RET(-1, "Unable to set screen information");
+
+        if (ioctl(sd->fd, FBIOGET_VSCREENINFO, &var_info)
+                || ioctl(sd->fd, FBIOGET_FSCREENINFO, &fix_info))
+            ERR_RET(-1, "Unable to get screen information");
+
+        /* The driver may have adjusted the mode to what it can display */
+        fb_get_format(&var_info, &sd->format);
+        if (!pixel_format_supported(&sd->format)) {
+            LOG(LOG_ERR, "Unsupported framebuffer format: %d bpp",
+                    var_info.bits_per_pixel);
+            return -1;
+        }
+    }
 
-    if (ioctl(sd->fd, FBIOGET_VSCREENINFO, &var_info)
-            || ioctl(sd->fd, FBIOGET_FSCREENINFO, &fix_info))
-        ERR_RET(-1, "Unable to get screen information");
+    sd->pages = fb_setup_pages(sd, &var_info, &fix_info);
+    sd->vsync = 1;
+    sd->refresh_us = fb_refresh_us(&var_info);
+    memcpy(&fb_mode, &var_info, sizeof(fb_mode));
 
     sd->width = var_info.xres;
     sd->height = var_info.yres;
     sd->bpp = var_info.bits_per_pixel;
     sd->stride = fix_info.line_length;
     sd->fb_size = fix_info.line_length * var_info.yres;
-    sd->fb = mmap(NULL, sd->fb_size, PROT_READ | PROT_WRITE, MAP_SHARED, sd->fd, 0);
+    sd->map_size = (size_t)sd->fb_size * sd->pages;
+    sd->map = mmap(NULL, sd->map_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+            sd->fd, 0);
 
-    if (sd->fb == MAP_FAILED) {
+    if (sd->map == MAP_FAILED) {
         ERR("Unable to map the framebuffer into memory");
-        sd->fb = NULL;
+        sd->map = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void fb_dev_close(struct screen_info *sd, int restore_mode)
+{
+    int r;
+
+    /* Try to restore the old mode */
+    if (restore_mode) {
+    	errno = 0;
+    	r = ioctl(sd->fd, FBIOPUT_VSCREENINFO, &old_fb_mode);
+    	LOG(LOG_DEBUG, "restore ioctl() returned %d, "
+    			"errno = %d (%s)", r, errno, strerror(errno));
+    }
+}
+
+static int fb_dev_pan(struct screen_info *sd)
+{
+    uint32_t crtc = 0;
+
+    if (sd->vsync && ioctl(sd->fd, FBIO_WAITFORVSYNC, &crtc)) {
+        LOG(LOG_DEBUG, "No vertical blank waiting on the framebuffer: %s",
+                strerror(errno));
+        sd->vsync = 0;
+    }
+
+    fb_mode.xoffset = 0;
+    fb_mode.yoffset = sd->page * sd->height;
+
+    return ioctl(sd->fd, FBIOPAN_DISPLAY, &fb_mode);
+}
+
+static const struct fb_ops fb_dev_ops = {
+    .name = "framebuffer",
+    .open = fb_dev_open,
+    .close = fb_dev_close,
+    .pan = fb_dev_pan,
+};
+
+/*
+ * A surface of the given geometry in anonymous memory, or in 'file' so
+ * that what is drawn can be looked at by other programs. The file is
+ * created or grown to hold the surface, its contents are kept.
+ */
+static int fb_surface_open(struct screen_info *sd, const char *file,
+        const struct fb_surface *surface, int keep_format)
+{
+    const int bytes = pixel_bytes(&surface->format);
+    struct stat st;
+
+    (void)keep_format;
+    sd->format = surface->format;
+    sd->width = surface->width;
+    sd->height = surface->height;
+    sd->bpp = surface->format.bpp;
+    sd->stride = (surface->stride) ? surface->stride
+            : surface->width * bytes;
+    if (sd->stride < sd->width * bytes) {
+        LOG(LOG_ERR, "Surface line of %d bytes is shorter than %d pixels",
+                sd->stride, sd->width);
+        return -1;
+    }
+    sd->fb_size = sd->stride * sd->height;
+    sd->map_size = sd->fb_size;
+    sd->pages = 1;
+    sd->vsync = 0;
+    sd->refresh_us = FB_DEFAULT_REFRESH_US;
+
+    if (!file) {
+        sd->fd = -1;
+        sd->map = mmap(NULL, sd->map_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (sd->map == MAP_FAILED) {
+            sd->map = NULL;
+            ERR_RET(-1, "could not allocate memory");
+        }
+        return 0;
+    }
+
+    sd->fd = open(file, O_RDWR | O_CREAT, 0644);
+    if (sd->fd < 0)
+        ERR_RET(-1, "Unable to open %s", file);
+
+    sd->map = MAP_FAILED;
+    if (fstat(sd->fd, &st))
+        ERR("Unable to stat %s", file);
+    else if ((size_t)st.st_size < sd->map_size
+            && ftruncate(sd->fd, sd->map_size))
+        ERR("Unable to resize %s", file);
+    else {
+        sd->map = mmap(NULL, sd->map_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, sd->fd, 0);
+        if (sd->map == MAP_FAILED)
+            ERR("Unable to map %s into memory", file);
+    }
+
+    if (sd->map == MAP_FAILED) {
+        close(sd->fd);
+        sd->fd = -1;
+        sd->map = NULL;
+        return -1;
+    }
+
+    return 0;
+}
+
+/* A surface has a single page, there is no other one to flip to */
+static const struct fb_ops fb_surface_ops = {
+    .name = "surface",
+    .open = fb_surface_open,
+};
+
+/**
+ * Parse "<width>x<height>[:<format>[:<stride>]]" of a surface. The format
+ * is one of pixel_format_by_name(), ARGB32 if it is empty or not given,
+ * and the stride is in bytes, the width of the surface if not given.
+ */
+int fb_parse_surface(const char *s, struct fb_surface *surface)
+{
+    const struct pixel_format *format = &pixel_format_argb32;
+    char name[16];
+    const char *colon;
+    char *end;
+    long w, h, stride = 0;
+
+    w = strtol(s, &end, 10);
+    if (*end != 'x')
+        return -1;
+    h = strtol(end + 1, &end, 10);
+    if (w < 1 || h < 1 || w > 0xFFFF || h > 0xFFFF)
         return -1;
+
+    if (*end == ':') {
+        s = end + 1;
+        colon = strchr(s, ':');
+        if (!colon)
+            colon = s + strlen(s);
+        if (colon != s) {
+            if ((size_t)(colon - s) >= sizeof(name))
+                return -1;
+            memcpy(name, s, colon - s);
+            name[colon - s] = '\0';
+            format = pixel_format_by_name(name);
+            if (!format)
+                return -1;
+        }
+        end = (char *)colon;
+        if (*end == ':') {
+            stride = strtol(end + 1, &end, 10);
+            if (stride < 1 || stride > 0x7FFFFFFF / h)
+                return -1;
+        }
     }
+    if (*end)
+        return -1;
+
+    surface->width = (int)w;
+    surface->height = (int)h;
+    surface->stride = (int)stride;
+    surface->format = *format;
+    return 0;
+}
+
+/*
+ * Open the framebuffer 'device' (FB_DEFAULT_DEVICE if NULL) or, if
+ * 'surface' is given, a surface of its geometry in memory or in the file
+ * 'device'. The device is switched to ARGB32 mode unless 'keep_format' is
+ * set and its current pixel format is one bannerd can render to. The
+ * pages are cleared, keep what is on screen or are left as they are
+ * depending on 'contents', one of FB_CONTENTS_*.
+ */
+int fb_init(struct screen_info *sd, const char *device,
+        const struct fb_surface *surface, int keep_format, int contents)
+{
+    int i;
 
-    fb = (uint32_t *)sd->fb;
+    sd->ops = (surface) ? &fb_surface_ops : &fb_dev_ops;
+    sd->map = NULL;
+    sd->fb = NULL;
+    if (sd->ops->open(sd, device, surface, keep_format))
+        return -1;
 
-    for (i = 0; i < sd->fb_size / 4; ++i, ++fb)
-        *fb = 0xFF000000; /* Reset the background to black, set alpha to 1 */
+    /* Frames are drawn into the second page while the first one is shown */
+    sd->page = (sd->pages > 1) ? 1 : 0;
+    sd->fb = (unsigned char *)sd->map + sd->page * sd->fb_size;
+
+    if (contents == FB_CONTENTS_KEEP) {
+        /* Frames are drawn over what is on screen, on either page */
+        for (i = 1; i < sd->pages; ++i)
+            memcpy((unsigned char *)sd->map + i * sd->fb_size, sd->map,
+                    sd->fb_size);
+    } else if (contents == FB_CONTENTS_CLEAR) {
+        for (i = 0; i < sd->pages; ++i)
+            fb_clear(sd, i, NULL);
+    }
 
 #if 0
     if (fb_omap_update_screen(sd, 0, 0, sd->width, sd->height))
         return -1;
 #endif /* 0 */
 
-    LOG(LOG_DEBUG, "Frame buffer open: screen size %dx%d, line %d bytes, "
-            "%d bpp, buffer size %d bytes", sd->width, sd->height,
-            sd->stride, sd->bpp, sd->fb_size);
-    LOG(LOG_DEBUG, "Offsets: r %d, g %d, b %d, a %d", var_info.red.offset,
-    		var_info.green.offset, var_info.blue.offset,
-    		var_info.transp.offset);
+    LOG(LOG_DEBUG, "%s open: screen size %dx%d, line %d bytes, "
+            "%d bpp, buffer size %d bytes, %d page(s), refresh %u us",
+            sd->ops->name, sd->width, sd->height, sd->stride, sd->bpp,
+            sd->fb_size, sd->pages, sd->refresh_us);
+    LOG(LOG_DEBUG, "Offsets: r %d, g %d, b %d, a %d",
+            sd->format.red.offset, sd->format.green.offset,
+            sd->format.blue.offset, sd->format.transp.offset);
 
     return 0;
 }
 
 void fb_close(struct screen_info *sd, int restore_mode)
 {
-    int r;
+    if (sd->map != NULL)
+        munmap(sd->map, sd->map_size);
 
-    if (sd->fb != NULL)
-        munmap(sd->fb, sd->fb_size);
+    if (sd->ops->close)
+        sd->ops->close(sd, restore_mode);
 
-    /* Try to restore the old mode */
-    if (restore_mode) {
-    	errno = 0;
-    	r = ioctl(sd->fd, FBIOPUT_VSCREENINFO, &old_fb_mode);
-    	LOG(LOG_DEBUG, "restore ioctl() returned %d, "
-    			"errno = %d (%s)", r, errno, strerror(errno));
+    if (sd->fd >= 0)
+        close(sd->fd);
+}
+
+/**
+ * Show the page frames have been drawn into at the next vertical blank, and
+ * draw into the other one from now on. Without a second page, frames are
+ * drawn on screen and there is nothing to do.
+ */
+int fb_flip(struct screen_info *sd)
+{
+    if (sd->pages < 2)
+        return 0;
+
+    if (sd->ops->pan(sd)) {
+        /* Copy the frame on screen and keep drawing there */
+        LOG(LOG_WARNING, "Unable to flip framebuffer pages, drawing on"
+                " screen: %s", strerror(errno));
+        sd->page = fb_front(sd);
+        memcpy((unsigned char *)sd->map + sd->page * sd->fb_size, sd->fb,
+                sd->fb_size);
+        sd->fb = (unsigned char *)sd->map + sd->page * sd->fb_size;
+        sd->pages = 1;
+        return 0;
     }
 
-    close(sd->fd);
+    sd->page = !sd->page;
+    sd->fb = (unsigned char *)sd->map + sd->page * sd->fb_size;
+
+    return 0;
 }
 
 int fb_omap_update_screen(struct screen_info *sd, int x, int y, int w, int h)
@@ -161,7 +496,8 @@ int fb_omap_update_screen(struct screen_info *sd, int x, int y, int w, int h)
     fb_win.y = y;
     fb_win.width = w;
     fb_win.height = h;
-    fb_win.format = OMAPFB_COLOR_ARGB32;
+    fb_win.format = (sd->bpp == 16) ? OMAPFB_COLOR_RGB565
+            : (sd->bpp == 24) ? OMAPFB_COLOR_RGB24P : OMAPFB_COLOR_ARGB32;
 
     if (ioctl(sd->fd, OMAPFB_UPDATE_WINDOW, &fb_win))
         ERR_RET(-1, "Failed to update frame buffer window");
@@ -169,15 +505,191 @@ int fb_omap_update_screen(struct screen_info *sd, int x, int y, int w, int h)
     return 0;
 }
 
-int fb_write_bitmap(struct screen_info *sd, int x, int y, struct image_info *bitmap)
+/*
+ * Blits larger than a cache would only push out what is in it, be it the
+ * framebuffer or its shadow in system memory, so they go around the cache
+ * with streaming stores where the CPU has them. fb_copy_done() orders those
+ * before the page is shown.
+ */
+#define FB_STREAM_MIN (512 * 1024)
+
+static void fb_copy(void *dst, const void *src, size_t n, int stream)
 {
-    unsigned char *line;
-    uint32_t *in = bitmap->pixel_buffer;
-    uint32_t *out;
-    int i;
-    int w = bitmap->width, clip_l = 0, clip_r = 0;
+#if defined(__SSE2__)
+    unsigned char *d = dst;
+    const unsigned char *s = src;
+    size_t head = -(uintptr_t)d & 15;
+
+    if (!stream || n < 64) {
+        memcpy(dst, src, n);
+        return;
+    }
+
+    memcpy(d, s, head);
+    d += head;
+    s += head;
+    n -= head;
+
+    for (; n >= 64; n -= 64, d += 64, s += 64) {
+        __m128i a = _mm_loadu_si128((const __m128i *)s);
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(s + 32));
+        __m128i e = _mm_loadu_si128((const __m128i *)(s + 48));
+
+        _mm_stream_si128((__m128i *)d, a);
+        _mm_stream_si128((__m128i *)(d + 16), b);
+        _mm_stream_si128((__m128i *)(d + 32), c);
+        _mm_stream_si128((__m128i *)(d + 48), e);
+    }
+
+    for (; n >= 16; n -= 16, d += 16, s += 16)
+        _mm_stream_si128((__m128i *)d,
+                _mm_loadu_si128((const __m128i *)s));
+
+    memcpy(d, s, n);
+#else
+    (void)stream;
+    memcpy(dst, src, n);
+#endif
+}
+
+static inline void fb_copy_done(void)
+{
+#if defined(__SSE2__)
+    _mm_sfence();
+#endif
+}
+
+/* Fill 'count' pixels with a packed value, around the cache if 'stream' */
+static void fb_fill(const struct pixel_format *f, void *dst, uint32_t value,
+        int count, int stream)
+{
+#if defined(__SSE2__)
+    const int bytes = pixel_bytes(f);
+    unsigned char *d = dst;
+    size_t n = (size_t)count * bytes;
+    int head = (-(uintptr_t)d & 15) / bytes;
+    __m128i v;
+
+    if (!stream || bytes == 3 || n < 64) {
+        pixel_fill(f, dst, value, count);
+        return;
+    }
+
+    if (bytes == 2)
+        value = (value & 0xFFFF) | value << 16;
+    v = _mm_set1_epi32((int)value);
+
+    pixel_fill(f, d, value, head);
+    d += head * bytes;
+    n -= head * bytes;
+
+    for (; n >= 64; n -= 64, d += 64) {
+        _mm_stream_si128((__m128i *)d, v);
+        _mm_stream_si128((__m128i *)(d + 16), v);
+        _mm_stream_si128((__m128i *)(d + 32), v);
+        _mm_stream_si128((__m128i *)(d + 48), v);
+    }
+
+    for (; n >= 16; n -= 16, d += 16)
+        _mm_stream_si128((__m128i *)d, v);
+
+    pixel_fill(f, d, value, n / bytes);
+#else
+    (void)stream;
+    pixel_fill(f, dst, value, count);
+#endif
+}
+
+/**
+ * Reset a page to opaque black, except the area of 'except' if it is not
+ * NULL, which a bitmap is about to be written to
+ */
+void fb_clear(struct screen_info *sd, int page, const struct fb_blit *except)
+{
+    const int bytes = pixel_bytes(&sd->format);
+    const uint32_t black = pixel_pack(&sd->format, 0xFF000000);
+    const int stream = sd->fb_size >= FB_STREAM_MIN;
+    unsigned char *line = (unsigned char *)sd->map + page * sd->fb_size;
+    int i, top = 0, left = 0, right = 0;
+
+    if (except) { /* Where the bitmap is on screen */
+        top = except->offset / sd->stride;
+        left = except->offset % sd->stride / bytes;
+        right = left + except->width;
+    } else if (sd->width * bytes == sd->stride) {
+        fb_fill(&sd->format, line, black, sd->width * sd->height, stream);
+        fb_copy_done();
+        return;
+    }
+
+    for (i = 0; i < sd->height; ++i, line += sd->stride) {
+        if (!except || i < top || i >= top + except->height) {
+            fb_fill(&sd->format, line, black, sd->width, stream);
+            continue;
+        }
+
+        fb_fill(&sd->format, line, black, left, stream);
+        fb_fill(&sd->format, line + right * bytes, black, sd->width - right,
+                stream);
+    }
+    fb_copy_done();
+}
+
+static inline void fb_write_row(struct image_info *bitmap, int row, int from,
+        int width, const struct pixel_format *format, unsigned char *out)
+{
+    const int bytes = pixel_bytes(format);
+    const unsigned char *pixels = (unsigned char *)bitmap->pixel_buffer
+            + row * fb_bitmap_pitch(bitmap);
+
+    if (bitmap->rle)
+        rle_blit_row(bitmap->rle, row, from, width, format, out,
+                (bitmap->under) ? (unsigned char *)bitmap->under->pixel_buffer
+                    + (row * bitmap->width + from) * bytes : NULL);
+    else if (bitmap->palette)
+        pixel_lookup_line(format, out, pixels + from, bitmap->palette, width);
+    else
+        memcpy(out, pixels + from * bytes, width * bytes);
+}
+
+/* Count a blit started at 'start' in the histogram of blit times */
+static void fb_blit_done(struct screen_info *sd, const struct timespec *start)
+{
+    struct timespec now;
+    unsigned long us;
+    unsigned int bucket = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    us = (now.tv_sec - start->tv_sec) * 1000000
+            + (now.tv_nsec - start->tv_nsec) / 1000;
+
+    while (us && bucket < FB_BLIT_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+
+    sd->blit_us[bucket]++;
+    sd->blits++;
+}
+
+/**
+ * Clip the bitmap placed at (x, y) to the screen once, for fb_blit() to
+ * write it there any number of times
+ */
+int fb_plan_bitmap(struct screen_info *sd, int x, int y,
+        const struct image_info *bitmap, struct fb_blit *plan)
+{
+    const int bytes = pixel_bytes(&sd->format);
+    int w = bitmap->width, from = 0, row = 0;
     int h = bitmap->height;
 
+    if (bitmap->bpp != sd->bpp && !bitmap->palette) {
+        LOG(LOG_ERR, "Bitmap is %d bpp but the screen is %d bpp",
+                bitmap->bpp, sd->bpp);
+        return -1;
+    }
+
     if (x + w <= 0 || x >= sd->width
             || y + h <= 0 || y >= sd->height) {
         LOG(LOG_ERR, "Unable to write a bitmap outside the screen "
@@ -186,34 +698,175 @@ int fb_write_bitmap(struct screen_info *sd, int x, int y, struct image_info *bit
     }
 
     if (x < 0) {
-        clip_l = -x;
-        in += clip_l; /* Take out from the first line */
+        from = -x; /* Take out from the first line */
         w += x;
         x = 0;
     }
 
     if (y < 0) {
-        in += (-y) * bitmap->width; /* Take out (-y) lines */
+        row = -y; /* Take out (-y) lines */
         h += y;
         y = 0;
     }
 
-    if (x + w > sd->width) {
+    if (x + w > sd->width)
         w = sd->width - x;
-        clip_r = bitmap->width - w;
+
+    if (y + h > sd->height)
+        h = sd->height - y;
+
+    plan->from = from;
+    plan->row = row;
+    plan->width = w;
+    plan->height = h;
+    plan->offset = y * sd->stride + x * bytes;
+    plan->contiguous = w == bitmap->width && w * bytes == sd->stride
+            && fb_bitmap_pitch(bitmap) == (size_t)w * bytes;
+    plan->stream = (size_t)w * h * bytes >= FB_STREAM_MIN;
+
+    return 0;
+}
+
+/**
+ * Write a bitmap where it has been planned to be. A screen-wide bitmap of
+ * plain pixels is copied in one go, encoded and indexed bitmaps are expanded
+ * row by row.
+ */
+int fb_blit(struct screen_info *sd, const struct fb_blit *plan,
+        struct image_info *bitmap)
+{
+    struct timespec start;
+    unsigned char *line = (unsigned char *)sd->fb + plan->offset;
+    const int bytes = pixel_bytes(&sd->format);
+    const size_t pitch = fb_bitmap_pitch(bitmap);
+    const unsigned char *pixels = (unsigned char *)bitmap->pixel_buffer
+            + plan->row * pitch + plan->from * bytes;
+    int i;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    if (bitmap->rle || bitmap->palette)
+        for (i = 0; i < plan->height; ++i, line += sd->stride)
+            fb_write_row(bitmap, plan->row + i, plan->from, plan->width,
+                    &sd->format, line);
+    else if (plan->contiguous)
+        fb_copy(line, pixels, plan->height * pitch, plan->stream);
+    else
+        for (i = 0; i < plan->height; ++i, line += sd->stride,
+                pixels += pitch)
+            fb_copy(line, pixels, plan->width * bytes, plan->stream);
+    fb_copy_done();
+
+    sd->bytes_written += (unsigned long long)plan->height * plan->width
+            * bytes;
+    fb_blit_done(sd, &start);
+
+    return 0;
+}
+
+int fb_write_bitmap(struct screen_info *sd, int x, int y, struct image_info *bitmap)
+{
+    struct fb_blit plan;
+
+    if (fb_plan_bitmap(sd, x, y, bitmap, &plan))
+        return -1;
+
+    return fb_blit(sd, &plan, bitmap);
+}
+
+/*
+ * Copy what is on screen under the bitmap placed at (x, y) into its pixel
+ * buffer. Parts of the bitmap outside the screen are left as they are.
+ */
+int fb_read_bitmap(struct screen_info *sd, int x, int y,
+        struct image_info *bitmap)
+{
+    const int bytes = pixel_bytes(&sd->format);
+    const size_t pitch = fb_bitmap_pitch(bitmap);
+    const unsigned char *line;
+    unsigned char *out = bitmap->pixel_buffer;
+    int w = bitmap->width, h = bitmap->height;
+    int i;
+
+    if (bitmap->bpp != sd->bpp || bitmap->rle || bitmap->palette) {
+        LOG(LOG_ERR, "Bitmap does not hold the pixels of the screen");
+        return -1;
+    }
+
+    if (x < 0) {
+        out -= x * bytes;
+        w += x;
+        x = 0;
     }
 
+    if (y < 0) {
+        out -= y * pitch;
+        h += y;
+        y = 0;
+    }
+
+    if (x + w > sd->width)
+        w = sd->width - x;
+
     if (y + h > sd->height)
         h = sd->height - y;
 
-    line = (unsigned char *)sd->fb + y * sd->stride;
-    out = ((uint32_t *)line) + x;
+    if (w <= 0 || h <= 0)
+        return 0;
+
+    line = (unsigned char *)sd->map + fb_front(sd) * sd->fb_size
+            + y * sd->stride + x * bytes;
 
     for (i = 0; i < h; ++i, line += sd->stride,
-            out = ((uint32_t *)line) + x) {
-        memcpy(out, in, w * 4);
-        in += w + clip_r + clip_l;
+            out += pitch)
+        memcpy(out, line, w * bytes);
+
+    return 0;
+}
+
+/*
+ * Write only the given spans of the bitmap placed at (x, y). Spans that fall
+ * outside the screen are clipped or skipped.
+ */
+int fb_write_spans(struct screen_info *sd, int x, int y,
+        struct image_info *bitmap, const struct fb_span *spans, int count)
+{
+    const int bytes = pixel_bytes(&sd->format);
+    unsigned long long written = 0;
+    struct timespec start;
+    int i;
+
+    if (bitmap->bpp != sd->bpp && !bitmap->palette) {
+        LOG(LOG_ERR, "Bitmap is %d bpp but the screen is %d bpp",
+                bitmap->bpp, sd->bpp);
+        return -1;
     }
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (i = 0; i < count; ++i) {
+        const struct fb_span *s = &spans[i];
+        int sx = x + s->x, sy = y + s->y, w = s->width;
+        int from = s->x;
+
+        if (sy < 0 || sy >= sd->height || sx >= sd->width || sx + w <= 0)
+            continue;
+
+        if (sx < 0) {
+            from -= sx;
+            w += sx;
+            sx = 0;
+        }
+
+        if (sx + w > sd->width)
+            w = sd->width - sx;
+
+        fb_write_row(bitmap, s->y, from, w, &sd->format,
+                (unsigned char *)sd->fb + sy * sd->stride + sx * bytes);
+        written += w * bytes;
+    }
+
+    sd->bytes_written += written;
+    fb_blit_done(sd, &start);
+
     return 0;
 }
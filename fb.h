@@ -13,31 +13,163 @@
 #ifndef FB_H
 #define FB_H
 
+#include <stddef.h>
 #include <stdint.h>
+#include <stdlib.h>
+
+#include "pixel.h"
+
+/* Blit times are counted by powers of two of microseconds */
+#define FB_BLIT_BUCKETS 16
+
+#define FB_DEFAULT_DEVICE "/dev/fb0"
+
+/* What fb_init() does to the pages */
+#define FB_CONTENTS_CLEAR 0 /* Reset to opaque black */
+#define FB_CONTENTS_KEEP 1 /* What is on screen is copied to all the pages */
+#define FB_CONTENTS_LATER 2 /* Left for the caller to fb_clear() */
+
+struct fb_ops;
+
+/* Geometry of a screen kept in memory or in a file instead of a device */
+struct fb_surface {
+    int width;
+    int height;
+    int stride; /* Bytes from a line to the next, 0 if they are packed */
+    struct pixel_format format;
+};
 
 struct screen_info {
-    int fd;
+    const struct fb_ops *ops; /* What the screen is drawn to */
+    int fd; /* -1 for a surface in memory */
     int width;
     int height;
     int bpp; /* bit per pixel */
-    void *fb;
+    struct pixel_format format;
+    void *fb; /* Page frames are drawn into */
     int stride;
-    int fb_size;
+    int fb_size; /* Size of a page */
+    unsigned long long bytes_written; /* total bytes written to fb */
+    void *map; /* All the pages */
+    size_t map_size;
+    int pages; /* With 2, frames are drawn off screen and flipped to */
+    int page; /* Page fb points to; the other one is on screen */
+    int vsync; /* FBIO_WAITFORVSYNC works */
+    unsigned int refresh_us; /* Time between vertical blanks */
+    unsigned long long blits; /* Calls to fb_write_bitmap/fb_write_spans */
+    unsigned int blit_us[FB_BLIT_BUCKETS]; /* Blits under 1, 2, 4... us */
+};
+
+/*
+ * A backend fb_init() opens. Whatever it is, the pages are mapped into
+ * memory and bitmaps are written straight there.
+ */
+struct fb_ops {
+    const char *name;
+    /* Set the geometry, format and pages of sd and map them */
+    int (*open)(struct screen_info *sd, const char *device,
+            const struct fb_surface *surface, int keep_format);
+    /* Undo what open did to the device, before it is unmapped and closed */
+    void (*close)(struct screen_info *sd, int restore_mode);
+    /* Show sd->page at the next vertical blank, needed with 2 pages */
+    int (*pan)(struct screen_info *sd);
 };
 
+#define FB_MAX_PAGES 2
+
+/* Page that is on screen */
+static inline int fb_front(const struct screen_info *sd)
+{
+    return (sd->pages > 1) ? !sd->page : sd->page;
+}
+
+struct rle_image;
+
+#define FB_PALETTE_SIZE 256
+
 struct image_info {
     int width;
     int height;
     int is_bmp;
-    uint32_t *pixel_buffer;
+    int bpp; /* bits per pixel in pixel_buffer */
+    void *pixel_buffer; /* rows of width * bpp / 8 bytes, top to bottom */
+    int stride; /* Bytes from a row to the next if pixel_buffer is a view
+                   into a larger image, 0 if rows follow each other */
+    uint32_t *palette; /* If set, pixel_buffer holds 8-bit indices of these
+                          FB_PALETTE_SIZE pixels in the format of the screen */
+    struct rle_image *rle; /* If set, pixel_buffer is NULL */
+    struct image_info *under; /* Translucent runs of rle are blended over */
+};
+
+/* Bytes from a row of the pixel buffer of a bitmap to the next */
+static inline size_t fb_bitmap_pitch(const struct image_info *bitmap)
+{
+    return (bitmap->stride) ? (size_t)bitmap->stride
+            : (size_t)bitmap->width * (bitmap->bpp / 8);
+}
+
+/*
+ * Memory a decoder puts the pixels of an image into instead of allocating
+ * them, if they fit there
+ */
+struct pixel_room {
+    void *buffer;
+    size_t size;
+};
+
+/* Room for 'size' bytes of pixels, in 'room' if it is not NULL and large
+ * enough */
+static inline void *pixel_room_alloc(const struct pixel_room *room,
+        size_t size)
+{
+    return (room && room->buffer && size <= room->size) ? room->buffer
+            : malloc(size);
+}
+
+static inline void pixel_room_free(const struct pixel_room *room,
+        void *pixels)
+{
+    if (!room || pixels != room->buffer)
+        free(pixels);
+}
+
+/* A horizontal run of pixels inside a bitmap, in bitmap coordinates */
+struct fb_span {
+    int x;
+    int y;
+    int width;
+};
+
+/* Where a bitmap is written on screen, clipped, planned once for all blits */
+struct fb_blit {
+    int from; /* First column of the bitmap on screen */
+    int row; /* First row of the bitmap on screen */
+    int width; /* Columns on screen, 0 if not planned yet */
+    int height;
+    int offset; /* Of the first pixel from the start of a page */
+    int contiguous; /* Rows follow each other on screen as in the bitmap */
+    int stream; /* Large enough to be written around the cache */
 };
 
 
 
-int fb_init(struct screen_info *sd);
+int fb_parse_surface(const char *s, struct fb_surface *surface);
+int fb_init(struct screen_info *sd, const char *device,
+		const struct fb_surface *surface, int keep_format,
+		int contents);
 void fb_close(struct screen_info *sd, int restore_mode);
+void fb_clear(struct screen_info *sd, int page, const struct fb_blit *except);
+int fb_plan_bitmap(struct screen_info *sd, int x, int y,
+		const struct image_info *bitmap, struct fb_blit *plan);
+int fb_blit(struct screen_info *sd, const struct fb_blit *plan,
+		struct image_info *bitmap);
 int fb_write_bitmap(struct screen_info *sd, int x, int y,
 		struct image_info *bitmap);
+int fb_read_bitmap(struct screen_info *sd, int x, int y,
+		struct image_info *bitmap);
+int fb_write_spans(struct screen_info *sd, int x, int y,
+		struct image_info *bitmap, const struct fb_span *spans, int count);
+int fb_flip(struct screen_info *sd);
 int fb_omap_update_screen(struct screen_info * sd, int x, int y, int w, int h);
 
 #endif /* FB_H */
@@ -0,0 +1,225 @@
+/*
+ *  Parallel loading of frames
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "arena.h"
+#include "bmp.h"
+#include "fb.h"
+#include "loader.h"
+#include "log.h"
+#include "pixel.h"
+#include "scale.h"
+
+#define LOADER_MAX_WORKERS	16
+
+#define FRAME_PENDING		0
+#define FRAME_LOADED		1
+#define FRAME_FAILED		-1
+
+/*
+ * Workers take frames in order and decode each into its own slot of the
+ * frames array. Before decoding a frame, a worker asks the kernel to read
+ * ahead the file that will be taken after all the workers are through with
+ * their current ones, so that reading of files overlaps with decoding.
+ */
+struct frame_loader {
+	const char **filenames;
+	int count;
+	struct image_info *frames;
+	const struct pixel_format *format;
+	const struct scale_target *scale; /* NULL if frames keep their size */
+	int indexed; /* Palettised frames are kept as indices */
+	struct frame_arena *arena; /* Frames are decoded into, if not NULL */
+	int next; /* Next frame to be taken by a worker */
+	int ahead; /* How far ahead of the frame being taken to read */
+	int workers;
+	pthread_t threads[LOADER_MAX_WORKERS];
+	signed char *status; /* FRAME_* of each frame */
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+};
+
+static void loader_readahead(const char *filename)
+{
+	int fd = open(filename, O_RDONLY);
+
+	if (fd < 0)
+		return; /* The error is reported when the file is read */
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	close(fd);
+}
+
+/**
+ * Read a bitmap in the given format, resampled to the target if 'scale' is
+ * not NULL. A palettised bitmap that is not resampled is kept as indices
+ * into its palette if 'indexed'. The pixels go to 'room' if it is not NULL
+ * and they fit there.
+ */
+int loader_read(const char *filename, struct image_info *frame,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed,
+		const struct pixel_room *room)
+{
+	if (!scale)
+		return bmp_read_into(filename, frame, format, indexed, room);
+
+	if (bmp_read(filename, frame, &pixel_format_argb32))
+		return -1;
+
+	return scale_image(frame, scale, format, room);
+}
+
+static void *loader_worker(void *arg)
+{
+	struct frame_loader *l = arg;
+
+	while (1) {
+		int i = __atomic_fetch_add(&l->next, 1, __ATOMIC_RELAXED);
+		struct pixel_room room = { NULL, 0 };
+		int status;
+
+		if (i >= l->count)
+			break;
+
+		if (i + l->ahead < l->count)
+			loader_readahead(l->filenames[i + l->ahead]);
+
+		if (l->arena)
+			arena_room(l->arena, i, &room);
+		status = (loader_read(l->filenames[i], &l->frames[i], l->format,
+				l->scale, l->indexed, &room)) ? FRAME_FAILED
+				: FRAME_LOADED;
+
+		pthread_mutex_lock(&l->lock);
+		l->status[i] = status;
+		pthread_cond_broadcast(&l->done);
+		pthread_mutex_unlock(&l->lock);
+	}
+
+	return NULL;
+}
+
+static int loader_worker_count(int frames)
+{
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (cpus < 1)
+		cpus = 1;
+	if (cpus > LOADER_MAX_WORKERS)
+		cpus = LOADER_MAX_WORKERS;
+
+	return (cpus < frames) ? cpus : frames;
+}
+
+/**
+ * Start loading frames from 'first' to 'count' - 1 on all the CPUs, into
+ * 'arena' if it is not NULL
+ */
+struct frame_loader *loader_start(const char **filenames, int count,
+		int first, struct image_info *frames,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed,
+		struct frame_arena *arena)
+{
+	struct frame_loader *l = calloc(1, sizeof(*l));
+	int i;
+
+	if (!l)
+		ERR_RET(NULL, "could not allocate memory");
+
+	l->status = calloc(count, sizeof(*l->status));
+	if (!l->status) {
+		free(l);
+		ERR_RET(NULL, "could not allocate memory");
+	}
+
+	l->filenames = filenames;
+	l->count = count;
+	l->frames = frames;
+	l->format = format;
+	l->scale = scale;
+	l->indexed = indexed;
+	l->arena = arena;
+	l->next = first;
+	for (i = 0; i < first; ++i)
+		l->status[i] = FRAME_LOADED;
+	pthread_mutex_init(&l->lock, NULL);
+	pthread_cond_init(&l->done, NULL);
+
+	/* Start reading the first files before the workers get to them */
+	l->ahead = loader_worker_count(count - first);
+	for (i = first; i < first + l->ahead; ++i)
+		loader_readahead(filenames[i]);
+
+	for (i = 0; i < l->ahead; ++i)
+		if (pthread_create(&l->threads[i], NULL, loader_worker, l)) {
+			ERR("could not start a loader thread");
+			break;
+		}
+
+	if (!i) {
+		loader_finish(l);
+		return NULL;
+	}
+	l->workers = i;
+
+	LOG(LOG_DEBUG, "Loading %d frames with %d threads", count - first,
+			l->workers);
+
+	return l;
+}
+
+/**
+ * Wait until a frame is loaded. Returns -1 if it could not be.
+ */
+int loader_wait(struct frame_loader *l, int frame)
+{
+	int status;
+
+	pthread_mutex_lock(&l->lock);
+	while ((status = l->status[frame]) == FRAME_PENDING)
+		pthread_cond_wait(&l->done, &l->lock);
+	pthread_mutex_unlock(&l->lock);
+
+	return (status == FRAME_LOADED) ? 0 : -1;
+}
+
+/**
+ * Wait for all the frames and free the loader. Returns the number of frames
+ * that could not be loaded.
+ */
+int loader_finish(struct frame_loader *l)
+{
+	int i, failed = 0;
+
+	for (i = 0; i < l->workers; ++i)
+		pthread_join(l->threads[i], NULL);
+
+	for (i = 0; i < l->count; ++i)
+		if (l->status[i] != FRAME_LOADED) {
+			LOG(LOG_ERR, "Frame %d (%s) could not be loaded", i,
+					l->filenames[i]);
+			failed++;
+		}
+
+	pthread_mutex_destroy(&l->lock);
+	pthread_cond_destroy(&l->done);
+	free(l->status);
+	free(l);
+
+	return failed;
+}
@@ -0,0 +1,35 @@
+/*
+ *  Parallel loading of frames
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _LOADER_H
+#define _LOADER_H
+
+struct image_info;
+struct pixel_format;
+struct pixel_room;
+struct scale_target;
+struct frame_loader;
+struct frame_arena;
+
+int loader_read(const char *filename, struct image_info *frame,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed,
+		const struct pixel_room *room);
+struct frame_loader *loader_start(const char **filenames, int count,
+		int first, struct image_info *frames,
+		const struct pixel_format *format,
+		const struct scale_target *scale, int indexed,
+		struct frame_arena *arena);
+int loader_wait(struct frame_loader *l, int frame);
+int loader_finish(struct frame_loader *l);
+
+#endif /* _LOADER_H */
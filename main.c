@@ -13,6 +13,7 @@
 #include <errno.h>
 #include <getopt.h>
 #include <libgen.h>
+#include <limits.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -29,16 +30,39 @@
 #endif
 
 #include "animation.h"
+#include "arena.h"
 #include "commands.h"
 #include "fb.h"
 #include "log.h"
+#include "pack.h"
+#include "pixel.h"
+#include "scale.h"
+#include "stats.h"
 #include "string_list.h"
 
 int Interactive = 0; /* Not daemon */
 int LogDebug = 0; /* Do not suppress debug messages when logging */
 int RunCount = -1; /* Repeat a given number of times, then exit */
 int PreserveMode = 0; /* Do not restore previous framebuffer mode */
+int NativeFormat = 0; /* Keep the pixel format the framebuffer has */
+int RleFrames = 0; /* Keep frames run-length encoded in memory */
+int BackgroundLoad = 0; /* Show the first frame while loading the rest */
+int DropFrames = 0; /* Skip frames when behind the schedule */
+int BlendFrames = 0; /* Put frames over the screen contents by alpha */
+int FastStart = 0; /* Show the first frame before setting up the rest */
+int ArenaFlags = 0; /* ARENA_* for the memory frames are kept in */
+int ColorKey = -1; /* RGB colour of frames to be transparent */
 char *PipePath = NULL; /* A command pipe to control animation */
+char *PackPath = NULL; /* Write frames into an animation pack and exit */
+char *BackgroundPath = NULL; /* An image drawn once under the animation */
+const struct pixel_format *PackFormat = &pixel_format_argb32;
+struct scale_target ScaleTarget; /* Frames are resampled on load if set */
+struct frame_sheet *Sheet = NULL; /* Frames are cut out of sprite sheets */
+char *DevicePath = NULL; /* Framebuffer device, or the file of a surface */
+struct fb_surface *Surface = NULL; /* Draw into memory instead of a device */
+
+static struct fb_surface _Surface;
+static struct frame_sheet _Sheet;
 
 static struct screen_info _Fb;
 
@@ -52,7 +76,8 @@ static int usage(char *cmd, char *msg)
 
 	if (msg)
 		printf("%s\n", msg);
-	printf("Usage: %s [options] [interval[fps]] frame.bmp ...\n\n",
+	printf("Usage: %s [options] [@x,y] [interval[fps]] frame.bmp ...\n"
+	       "       [@x,y [interval[fps]] frame.bmp ...] ...\n\n",
 			command);
 	printf("-D, --no-daemon       Do not fork into the background, log\n"
 	       "                      to stdout\n");
@@ -67,21 +92,156 @@ static int usage(char *cmd, char *msg)
 	printf("-p, --preserve-mode   Do not restore framebuffer mode on exit\n"
 	       "                      which usually means leaving last frame"
 		                    " displayed\n");
+	printf("-n, --native-format   Keep the pixel format of the framebuffer\n"
+	       "                      (16, 24 or 32 bpp) instead of switching\n"
+	       "                      it to ARGB32\n");
+	printf("-r, --rle             Keep frames run-length encoded in\n"
+	       "                      memory (saves memory and time on flat\n"
+	       "                      colored frames)\n");
+	printf("-l, --lock-frames     Lock the memory frames are kept in, so\n"
+	       "                      that it is never paged out\n");
+	printf("-H, --huge-pages      Keep frames in transparent huge pages\n"
+	       "                      to save TLB misses while playing\n");
+	printf("-b, --background-load Show the first frame as soon as it is\n"
+	       "                      loaded and load the rest while it is\n"
+	       "                      displayed\n");
+	printf("-s, --fast-start      Show the first frame before the rest\n"
+	       "                      is set up, clearing only the screen\n"
+	       "                      around it until then. Implies -b\n");
+	printf("-d, --drop-frames     Skip frames when behind the schedule\n"
+	       "                      instead of showing them late, so the\n"
+	       "                      animation keeps to the wall clock\n");
+	printf("-a, --alpha           Blend frames over what is on screen by\n"
+	       "                      their alpha channel instead of\n"
+	       "                      clearing the screen (best with -n)\n");
+	printf("-k <rrggbb>,\n"
+	       "--color-key=<rrggbb>  Blend frames, with pixels of the given\n"
+	       "                      colour transparent. Implies -a\n");
+	printf("-S <mode>[:<w>x<h>],\n"
+	       "--scale=<mode>[:<w>x<h>] Resample frames once when they are\n"
+	       "                      loaded to <w>x<h> (the screen size by\n"
+	       "                      default), keeping their proportions.\n"
+	       "                      <mode> is 'fit' to show them whole or\n"
+	       "                      'fill' to cover the area, cropped\n");
+	printf("-T <layout>,\n"
+	       "--sheet=<layout>      Each file is a sprite sheet holding\n"
+	       "                      frames row by row, read once: <n> in\n"
+	       "                      a row, <cols>x<rows> in a grid or\n"
+	       "                      <w>x<h>px in cells of that size\n");
+	printf("-f <device>,\n"
+	       "--framebuffer=<device> Framebuffer device to draw to (%s\n"
+	       "                      by default), or the file to keep a\n"
+	       "                      surface given by -g in\n",
+	       FB_DEFAULT_DEVICE);
+	printf("-g <w>x<h>[:<format>[:<stride>]],\n"
+	       "--surface=<w>x<h>[:<format>[:<stride>]] Draw into a surface\n"
+	       "                      of <w>x<h> pixels in memory instead of\n"
+	       "                      a framebuffer, with lines <stride>\n"
+	       "                      bytes apart. <format> is one of -F,\n"
+	       "                      argb32 by default\n");
+	printf("-B <file>,\n"
+	       "--background=<file>   Draw the image once in the middle of\n"
+	       "                      the screen, under the frames\n");
 	printf("-i <fifo>,\n"
 	       "--command-pipe=<fifo> Open a named pipe <fifo> and wait for\n"
 	       "                      commands. The pipe should exist. If -c\n"
 	       "                      is specified, it is ignored. See %s(1)\n"
 	       "                      man page for command syntax.\n",
 	       command);
+	printf("-P <file>,\n"
+	       "--pack=<file>         Do not display anything but convert\n"
+	       "                      the frames and write them into an\n"
+	       "                      animation pack <file>, which can be\n"
+	       "                      given instead of frame.bmp list later\n");
+	printf("-F <format>,\n"
+	       "--pack-format=<format> Pixel format of the pack: argb32\n"
+	       "                      (default), xrgb32, rgb888, rgb565,\n"
+	       "                      argb1555 or xrgb1555. It must match\n"
+	       "                      the one of the screen\n");
 	printf("interval              Interval in milliseconds between frames.\n"
 	       "                      If \'fps\' suffix is present then it is in\n"
-	       "                      frames per second. Default:  41 (24fps)\n");
-	printf("frame.bmp ...         list of filenames of frames in BMP"
-			                    " format\n");
+	       "                      frames per second. Decimals (29.97fps)\n"
+	       "                      and fractions (30000/1001fps) are\n"
+	       "                      accepted. Default: 24fps\n");
+	printf("frame.bmp ...         list of filenames of frames in BMP or"
+			                    " PNG\n"
+	       "                      format, or a single animation pack\n");
+	printf("@x,y                  Center the following frames at x, y\n"
+	       "                      instead of the middle of the screen.\n"
+	       "                      After the first frames, starts a\n"
+	       "                      sprite layer with its own interval\n"
+	       "                      and frames, drawn over them\n");
 
 	return 1;
 }
 
+/* "fit" or "fill", optionally followed by ":<width>x<height>" */
+static int parse_scale(const char *s, struct scale_target *t)
+{
+	const char *size = strchr(s, ':');
+	size_t len = (size) ? (size_t)(size - s) : strlen(s);
+	char *end;
+	long w, h;
+
+	if (len == 3 && !strncmp(s, "fit", len))
+		t->mode = SCALE_FIT;
+	else if (len == 4 && !strncmp(s, "fill", len))
+		t->mode = SCALE_FILL;
+	else
+		return -1;
+
+	if (!size)
+		return 0;
+
+	w = strtol(size + 1, &end, 10);
+	if (*end != 'x')
+		return -1;
+	h = strtol(end + 1, &end, 10);
+	if (*end || w < 1 || h < 1 || w > 0xFFFF || h > 0xFFFF)
+		return -1;
+
+	t->width = (int)w;
+	t->height = (int)h;
+	return 0;
+}
+
+/*
+ * Frames of a sprite sheet as '<n>' in a row, '<cols>x<rows>' in a grid or
+ * '<w>x<h>px' in cells of that size
+ */
+static int parse_sheet(const char *s, struct frame_sheet *sheet)
+{
+	char *end;
+	long a, b = 1;
+
+	a = strtol(s, &end, 10);
+	if (*end == 'x')
+		b = strtol(end + 1, &end, 10);
+	if (a < 1 || b < 1 || a > 0xFFFF || b > 0xFFFF)
+		return -1;
+
+	memset(sheet, 0, sizeof(*sheet));
+	if (!*end) {
+		sheet->columns = (int)a;
+		sheet->rows = (int)b;
+	} else if (!strcmp(end, "px") && strchr(s, 'x') < end) {
+		sheet->cell_width = (int)a;
+		sheet->cell_height = (int)b;
+	} else
+		return -1;
+
+	return 0;
+}
+
+/* Colour as 'rrggbb' in hex, -1 if it is not one */
+static int parse_color(const char *s)
+{
+	char *end;
+	unsigned long v = strtoul(s, &end, 16);
+
+	return (*s && !*end && v <= 0xFFFFFF) ? (int)v : -1;
+}
+
 static int get_options(int argc, char **argv)
 {
 	static struct option _longopts[] = {
@@ -90,13 +250,30 @@ static int get_options(int argc, char **argv)
 			{"run-count",	optional_argument,0, 'c'},    /* -c */
 			{"command-pipe",required_argument,0, 'i'},    /* -i */
 			{"preserve-mode",no_argument,&PreserveMode,1},/* -p */
+			{"native-format",no_argument,&NativeFormat,1},/* -n */
+			{"rle",		no_argument,&RleFrames, 1},   /* -r */
+			{"background-load",no_argument,&BackgroundLoad,1},/* -b */
+			{"lock-frames",	no_argument,0, 'l'},          /* -l */
+			{"huge-pages",	no_argument,0, 'H'},          /* -H */
+			{"fast-start",	no_argument,&FastStart, 1},   /* -s */
+			{"drop-frames",	no_argument,&DropFrames, 1},  /* -d */
+			{"alpha",	no_argument,&BlendFrames, 1}, /* -a */
+			{"color-key",	required_argument,0, 'k'},    /* -k */
+			{"pack",	required_argument,0, 'P'},    /* -P */
+			{"pack-format",	required_argument,0, 'F'},    /* -F */
+			{"background",	required_argument,0, 'B'},    /* -B */
+			{"scale",	required_argument,0, 'S'},    /* -S */
+			{"framebuffer",	required_argument,0, 'f'},    /* -f */
+			{"surface",	required_argument,0, 'g'},    /* -g */
+			{"sheet",	required_argument,0, 'T'},    /* -T */
 			{0, 0, 0, 0}
 	};
 
 	while (1) {
 		int option_index = 0;
-		int c = getopt_long(argc, argv, "Dvc::i:p", _longopts,
-				&option_index);
+		int c = getopt_long(argc, argv,
+				"Dvc::i:pnrlHbsdak:P:F:B:S:f:g:T:",
+				_longopts, &option_index);
 
 		if (c == -1)
 			break;
@@ -116,6 +293,48 @@ static int get_options(int argc, char **argv)
 			PreserveMode = 1;
 			break;
 
+		case 'n':
+			NativeFormat = 1;
+			break;
+
+		case 'r':
+			RleFrames = 1;
+			break;
+
+		case 'l':
+			ArenaFlags |= ARENA_LOCK;
+			break;
+
+		case 'H':
+			ArenaFlags |= ARENA_HUGE;
+			break;
+
+		case 'b':
+			BackgroundLoad = 1;
+			break;
+
+		case 's':
+			FastStart = 1;
+			break;
+
+		case 'd':
+			DropFrames = 1;
+			break;
+
+		case 'a':
+			BlendFrames = 1;
+			break;
+
+		case 'k':
+			ColorKey = parse_color(optarg);
+			if (ColorKey < 0) {
+				fprintf(stderr, "Incorrect colour %s\n",
+						optarg);
+				return -1;
+			}
+			BlendFrames = 1;
+			break;
+
 		case 'c':
 			if (!optarg)
 				RunCount = 1;
@@ -131,6 +350,53 @@ static int get_options(int argc, char **argv)
 			PipePath = optarg;
 			break;
 
+		case 'P':
+			PackPath = optarg;
+			break;
+
+		case 'B':
+			BackgroundPath = optarg;
+			break;
+
+		case 'S':
+			if (parse_scale(optarg, &ScaleTarget)) {
+				fprintf(stderr, "Incorrect scaling %s\n",
+						optarg);
+				return -1;
+			}
+			break;
+
+		case 'f':
+			DevicePath = optarg;
+			break;
+
+		case 'g':
+			if (fb_parse_surface(optarg, &_Surface)) {
+				fprintf(stderr, "Incorrect surface %s\n",
+						optarg);
+				return -1;
+			}
+			Surface = &_Surface;
+			break;
+
+		case 'T':
+			if (parse_sheet(optarg, &_Sheet)) {
+				fprintf(stderr, "Incorrect sprite sheet %s\n",
+						optarg);
+				return -1;
+			}
+			Sheet = &_Sheet;
+			break;
+
+		case 'F':
+			PackFormat = pixel_format_by_name(optarg);
+			if (!PackFormat) {
+				fprintf(stderr, "Unknown pixel format %s\n",
+						optarg);
+				return -1;
+			}
+			break;
+
 		case '?':
 			/* The error message has already been printed
 			 * by getopts_long() */
@@ -191,47 +457,220 @@ static void sig_handler(int num)
 	exit(0);
 }
 
+static void stats_handler(int num)
+{
+	(void)num;
+	stats_request();
+}
+
 static inline int init_proper_exit(void)
 {
 	struct sigaction action = { .sa_handler = sig_handler, };
+	/* No SA_RESTART, to get the statistics while waiting for commands */
+	struct sigaction stats = { .sa_handler = stats_handler, };
 
 	sigemptyset(&action.sa_mask);
+	sigemptyset(&stats.sa_mask);
 
 	atexit(free_resources);
 	if (sigaction(SIGINT, &action, NULL)
-			|| sigaction(SIGTERM, &action, NULL))
+			|| sigaction(SIGTERM, &action, NULL)
+			|| sigaction(SIGUSR1, &stats, NULL))
 		ERR_RET(-1, "could not install signal handlers");
 
 	return 0;
 }
 
-static inline int parse_interval(char *param, unsigned int *interval)
+/* Longest frame period accepted, in nanoseconds */
+#define MAX_PERIOD	(3600ULL * 1000000000)
+
+static unsigned long long gcd(unsigned long long a, unsigned long long b)
+{
+	while (b) {
+		unsigned long long t = a % b;
+
+		a = b;
+		b = t;
+	}
+
+	return a;
+}
+
+/*
+ * Parse a number with up to 3 decimals or a fraction n/d into a rational
+ * number v / *den
+ */
+static int parse_rational(const char *param, char **end,
+		unsigned long long *v, unsigned long long *den)
+{
+	const char *p = param;
+	unsigned long long d = 1;
+
+	if (*p < '0' || *p > '9')
+		return -1;
+
+	*v = strtoull(p, (char **)&p, 10);
+	if (*p == '.') {
+		for (++p; *p >= '0' && *p <= '9'; ++p) {
+			if (d == 1000)
+				return -1;
+			*v = *v * 10 + (*p - '0');
+			d *= 10;
+		}
+	} else if (*p == '/') {
+		d = strtoull(++p, (char **)&p, 10);
+		if (!d || d > 1000000)
+			return -1;
+	}
+
+	if (*v > 1000000000)
+		return -1;
+
+	*den = d;
+	*end = (char *)p;
+	return 0;
+}
+
+/*
+ * The interval between frames is given in milliseconds or in frames per
+ * second, either with decimals or as a fraction, e.g. 41.667, 24fps,
+ * 29.97fps or 30000/1001fps. It is kept as period / den nanoseconds.
+ */
+static inline int parse_interval(char *param, unsigned long long *period,
+		unsigned long long *den)
 {
 	char *p;
-	unsigned int v = (unsigned int)strtoul(param, &p, 0);
-	int is_fps = (p != param) && *p && !strcmp(p, "fps");
-
-	if (!*p || is_fps) {
-		if (is_fps) {
-			if (!v) { /* 0fps */
-				LOG(LOG_WARNING, "0fps argument in cmdline,"
-						" changed to 1fps");
-				v = 1;
-			}
-			v = 1000 / v;
+	unsigned long long v, d, n, g;
+	int is_fps;
+
+	if (parse_rational(param, &p, &v, &d))
+		return -1;
+
+	is_fps = !strcmp(p, "fps");
+	if (*p && !is_fps)
+		return -1;
+
+	if (is_fps) {
+		if (!v) { /* 0fps */
+			LOG(LOG_WARNING, "0fps argument in cmdline,"
+					" changed to 1fps");
+			v = d;
 		}
-		*interval = v;
-		return 0;
+		n = 1000000000ULL * d;
+		d = v;
+	} else
+		n = v * 1000000;
+
+	g = gcd(n, d);
+	n /= g;
+	d /= g;
+
+	/* The schedule multiplies the period by numbers below d */
+	if (n / d > MAX_PERIOD || n > ULLONG_MAX / 2 / d)
+		return -1;
+
+	*period = n;
+	*den = d;
+	return 0;
+}
+
+static int make_pack(struct string_list *filenames, int filenames_count)
+{
+	struct animation pack = { .frame_count = 0, };
+
+	if (ScaleTarget.mode) {
+		if (!ScaleTarget.width) {
+			LOG(LOG_ERR, "Frames of a pack are scaled only to a "
+					"given size");
+			return 1;
+		}
+		pack.scale = &ScaleTarget;
+	}
+	pack.sheet = Sheet;
+
+	if (animation_load(filenames, filenames_count, PackFormat, &pack))
+		return 1;
+
+	return (pack_write(PackPath, &pack, PackFormat)) ? 1 : 0;
+}
+
+/* Frames of the animation or of one of its sprite layers */
+struct layer_args {
+	struct animation *a;
+	struct string_list *filenames;
+	struct string_list *filenames_tail;
+	int filenames_count;
+};
+
+/* Center "x,y" of frames on the screen, in pixels */
+static int parse_position(const char *param, struct animation *a)
+{
+	char *end;
+	long x, y;
+
+	x = strtol(param, &end, 10);
+	if (end == param || *end != ',')
+		return -1;
+
+	param = end + 1;
+	y = strtol(param, &end, 10);
+	if (end == param || *end || labs(x) > 0xFFFF || labs(y) > 0xFFFF)
+		return -1;
+
+	a->x = (int)x;
+	a->y = (int)y;
+	a->placed = 1;
+	return 0;
+}
+
+static int init_layer(struct layer_args *layer, struct animation *banner)
+{
+	struct animation *a = layer->a;
+
+	a->start = banner->start;
+	a->rle = RleFrames;
+	a->background = BackgroundLoad || FastStart;
+	a->arena_flags = ArenaFlags;
+	a->blend = BlendFrames;
+	a->keyed = ColorKey >= 0;
+	a->color_key = (uint32_t)ColorKey;
+	a->sheet = Sheet;
+	if (animation_init(layer->filenames, layer->filenames_count, &_Fb, a))
+		return -1;
+	string_list_destroy(layer->filenames);
+
+	if (!a->period_den) {
+		a->period = 1000000000; /* 24fps */
+		a->period_den = 24;
 	}
+	a->drop_frames = DropFrames;
+
+	return 0;
+}
+
+/* Microseconds since '*lap', which is moved on to now */
+static long lap_us(struct timespec *lap)
+{
+	struct timespec now;
+	long us;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	us = (now.tv_sec - lap->tv_sec) * 1000000L
+			+ (now.tv_nsec - lap->tv_nsec) / 1000;
+	*lap = now;
 
-	return -1;
+	return us;
 }
 
 static int init(int argc, char **argv, struct animation *banner)
 {
 	int i;
-	struct string_list *filenames = NULL, *filenames_tail = NULL;
-	int filenames_count = 0;
+	struct layer_args *layers, *layer;
+	struct animation *a;
+	int layer_count = 1;
+	struct timespec lap = banner->start;
+	long fb_us, clear_us, first_us = 0, frames_us;
+	int defer_clear;
 
 	init_log();
 
@@ -239,47 +678,136 @@ static int init(int argc, char **argv, struct animation *banner)
 	if (i < 0)
 		return usage(argv[0], NULL);
 
+	if (PackPath)
+		Interactive = 1; /* An offline tool, log to stderr */
+
+	/* There cannot be more layers than arguments */
+	layers = calloc(argc, sizeof(*layers));
+	if (!layers)
+		ERR_RET(1, "could not allocate memory");
+	layer = layers;
+	layer->a = banner;
+
 	for ( ; i < argc; ++i) {
-		if (banner->interval == (unsigned int)-1)
-			if (!parse_interval(argv[i], &banner->interval))
+		if (argv[i][0] == '@') {
+			/* A position after frames starts a sprite layer */
+			if (layer->filenames_count) {
+				a = calloc(1, sizeof(*a));
+				if (!a)
+					ERR_RET(1, "could not allocate memory");
+				layer->a->next_layer = a;
+				layer = &layers[layer_count++];
+				layer->a = a;
+			}
+
+			if (parse_position(argv[i] + 1, layer->a))
+				return usage(argv[0], "Incorrect position");
+			continue;
+		}
+
+		if (!layer->a->period_den)
+			if (!parse_interval(argv[i], &layer->a->period,
+						&layer->a->period_den))
 				continue;
 
-		filenames_tail = string_list_add(&filenames, filenames_tail,
-				argv[i]);
-		if (!filenames_tail)
+		layer->filenames_tail = string_list_add(&layer->filenames,
+				layer->filenames_tail, argv[i]);
+		if (!layer->filenames_tail)
 			return 1;
 		else
-			filenames_count++;
+			layer->filenames_count++;
 	}
 
-	if (!filenames_count)
+	if (!layer->filenames_count)
 		return usage(argv[0], "No filenames specified");
 
-	if (fb_init(&_Fb))
+	if (PackPath) {
+		if (layer_count > 1) {
+			LOG(LOG_ERR, "Sprite layers cannot be packed");
+			return 1;
+		}
+		i = make_pack(layers->filenames, layers->filenames_count);
+		string_list_destroy(layers->filenames);
+		return i;
+	}
+
+	if (fb_init(&_Fb, DevicePath, Surface, NativeFormat, (BlendFrames)
+			? FB_CONTENTS_KEEP : FB_CONTENTS_LATER))
 		return 1;
+	fb_us = lap_us(&lap);
 	if (init_proper_exit())
 		return 1;
-	if (animation_init(filenames, filenames_count, &_Fb, banner))
+	if (ScaleTarget.mode) {
+		if (!ScaleTarget.width) {
+			ScaleTarget.width = _Fb.width;
+			ScaleTarget.height = _Fb.height;
+		}
+		banner->scale = &ScaleTarget;
+	}
+
+	/* A fast start clears around the first frame until it is shown */
+	defer_clear = FastStart && !BlendFrames && !BackgroundPath;
+	if (!BlendFrames && !defer_clear)
+		for (i = 0; i < _Fb.pages; ++i)
+			fb_clear(&_Fb, i, NULL);
+	clear_us = lap_us(&lap);
+
+	if (BackgroundPath && animation_draw_background(&_Fb, BackgroundPath,
+			banner->scale))
 		return 1;
-	string_list_destroy(filenames);
+	i = 0;
+	if (FastStart) {
+		if (init_layer(&layers[i++], banner)
+				|| animation_show_first(banner, defer_clear))
+			return 1;
+		first_us = lap_us(&lap);
 
-	if (banner->frame_count == 1 && RunCount == 1)
-		banner->interval = 0; /* Single frame, exit after showing it */
-	else if (banner->interval == (unsigned int)-1)
-		banner->interval = 1000 / 24; /* 24fps */
+		/* The page on screen is done, clear the one drawn next */
+		if (defer_clear && _Fb.pages > 1)
+			fb_clear(&_Fb, _Fb.page, NULL);
+		clear_us += lap_us(&lap);
+	}
+	for (; i < layer_count; ++i)
+		if (init_layer(&layers[i], banner))
+			return 1;
+	free(layers);
+	frames_us = lap_us(&lap);
+
+	if (banner->frame_count == 1 && RunCount == 1) {
+		/* Single frame, exit after showing it */
+		banner->period = 0;
+		banner->period_den = 1;
+	}
 
 	if (!Interactive && daemonify())
 		ERR_RET(1, "could not create a daemon");
 
+	/* Neither threads nor memory locks survive fork(), so start loading
+	 * and lock the frames only now */
+	for (a = banner; a; a = a->next_layer) {
+		if (a->arena)
+			arena_lock(a->arena);
+		if (animation_start_loader(a))
+			return 1;
+	}
+
+	LOG(LOG_INFO, "Started, us: framebuffer %ld, clear %ld, first frame %ld,"
+			" frames %ld, rest %ld", fb_us, clear_us, first_us,
+			frames_us, lap_us(&lap));
+
 	return 0;
 }
 
 int main(int argc, char **argv) {
-	struct animation banner = { .interval = (unsigned int)-1, };
+	struct animation banner = { .period_den = 0, };
 	int rc = 0;
 
+	clock_gettime(CLOCK_MONOTONIC, &banner.start);
+
 	if (init(argc, argv, &banner))
 		return 1;
+	if (PackPath)
+		return 0;
 	LOG(LOG_INFO, "started");
 
 	if (PipePath)
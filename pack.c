@@ -0,0 +1,382 @@
+/*
+ *  Precompiled animation packs
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "animation.h"
+#include "fb.h"
+#include "log.h"
+#include "pack.h"
+#include "pixel.h"
+
+/*
+ * A pack is a header, an index of frames, the spans in which each frame
+ * differs from the preceding one, and the frames themselves converted to
+ * the pixel format of the screen, each starting on a page boundary. All the
+ * values are in host byte order of the machine that has written the pack.
+ */
+
+#define PACK_MAGIC		"BPK1"
+#define PACK_VERSION		1
+#define PACK_MIN_ALIGN		4096
+#define PACK_NO_DELTA		0xFFFFFFFF /* The frame is written fully */
+
+struct pack_header {
+	char magic[4];
+	uint32_t version;
+	uint32_t frame_count;
+	uint32_t align;		/* Frames start at multiples of this */
+	uint8_t bpp;
+	uint8_t channels[8];	/* Offset and length of r, g, b, transp */
+	uint8_t reserved[7];
+};
+
+struct pack_frame {
+	uint32_t width;
+	uint32_t height;
+	uint64_t offset;	/* Rows of width * bpp / 8 bytes */
+	uint64_t spans_offset;	/* Array of struct fb_span */
+	uint32_t span_count;	/* Or PACK_NO_DELTA */
+	uint32_t reserved;
+};
+
+static void pack_set_format(struct pack_header *h,
+		const struct pixel_format *f)
+{
+	const struct pixel_channel *c[] = {
+		&f->red, &f->green, &f->blue, &f->transp,
+	};
+	int i;
+
+	h->bpp = f->bpp;
+	for (i = 0; i < 4; ++i) {
+		h->channels[i * 2] = c[i]->offset;
+		h->channels[i * 2 + 1] = c[i]->length;
+	}
+}
+
+static void pack_get_format(const struct pack_header *h,
+		struct pixel_format *f)
+{
+	struct pixel_channel *c[] = {
+		&f->red, &f->green, &f->blue, &f->transp,
+	};
+	int i;
+
+	f->bpp = h->bpp;
+	for (i = 0; i < 4; ++i) {
+		c[i]->offset = h->channels[i * 2];
+		c[i]->length = h->channels[i * 2 + 1];
+	}
+}
+
+/**
+ * Tell if the file is an animation pack
+ */
+int pack_probe(const char *filename)
+{
+	char magic[sizeof(PACK_MAGIC) - 1];
+	int fd = open(filename, O_RDONLY);
+	int r;
+
+	if (fd < 0)
+		return 0;
+
+	r = read(fd, magic, sizeof(magic)) == sizeof(magic)
+			&& !memcmp(magic, PACK_MAGIC, sizeof(magic));
+	close(fd);
+
+	return r;
+}
+
+static int pack_pwrite(int fd, const void *buf, size_t size, uint64_t offset)
+{
+	while (size) {
+		ssize_t r = pwrite(fd, buf, size, offset);
+
+		if (r < 0)
+			return -1;
+		buf = (const unsigned char *)buf + r;
+		size -= r;
+		offset += r;
+	}
+
+	return 0;
+}
+
+/*
+ * Pixels of a frame, looked up in its palette if it is indexed, a row at a
+ * time if it is a view into a sprite sheet
+ */
+static int pack_write_pixels(int fd, const struct image_info *frame,
+		const struct pixel_format *format, uint64_t offset)
+{
+	const size_t line = (size_t)frame->width * pixel_bytes(format);
+	const size_t pitch = fb_bitmap_pitch(frame);
+	const unsigned char *in = frame->pixel_buffer;
+	unsigned char *row = NULL;
+	int y, rc = 0;
+
+	if (!frame->palette && pitch == line)
+		return pack_pwrite(fd, in, line * frame->height, offset);
+
+	if (frame->palette) {
+		row = malloc(line);
+		if (!row)
+			return -1;
+	}
+
+	for (y = 0; !rc && y < frame->height; ++y, offset += line,
+			in += pitch) {
+		if (row)
+			pixel_lookup_line(format, row, in, frame->palette,
+					frame->width);
+		rc = pack_pwrite(fd, (row) ? row : in, line, offset);
+	}
+	free(row);
+
+	return rc;
+}
+
+/**
+ * Write the loaded frames of the animation and their deltas into a pack
+ */
+int pack_write(const char *filename, struct animation *a,
+		const struct pixel_format *format)
+{
+	struct pack_header header;
+	struct pack_frame *index;
+	const size_t index_size = a->frame_count * sizeof(*index);
+	long page_size = sysconf(_SC_PAGESIZE);
+	uint64_t offset;
+	int i, fd;
+	int rc = -1;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, PACK_MAGIC, sizeof(header.magic));
+	header.version = PACK_VERSION;
+	header.frame_count = a->frame_count;
+	header.align = (page_size > PACK_MIN_ALIGN)
+			? page_size : PACK_MIN_ALIGN;
+	pack_set_format(&header, format);
+
+	index = calloc(a->frame_count, sizeof(*index));
+	if (!index)
+		ERR_RET(-1, "could not allocate memory");
+
+	/* Lay out the spans, then the frames */
+	offset = sizeof(header) + index_size;
+	for (i = 0; i < a->frame_count; ++i) {
+		struct frame_delta *d = a->deltas[i];
+
+		index[i].span_count = (d) ? (uint32_t)d->count : PACK_NO_DELTA;
+		index[i].spans_offset = (d) ? offset : 0;
+		if (d)
+			offset += d->count * sizeof(struct fb_span);
+	}
+
+	for (i = 0; i < a->frame_count; ++i) {
+		struct image_info *frame = &a->frames[i];
+
+		offset = (offset + header.align - 1) / header.align
+				* header.align;
+		index[i].width = frame->width;
+		index[i].height = frame->height;
+		index[i].offset = offset;
+		offset += (uint64_t)frame->width * frame->height
+				* pixel_bytes(format);
+	}
+
+	fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		ERR("Could not create %s", filename);
+		goto out;
+	}
+
+	if (pack_pwrite(fd, &header, sizeof(header), 0)
+			|| pack_pwrite(fd, index, index_size, sizeof(header)))
+		goto write_error;
+
+	for (i = 0; i < a->frame_count; ++i) {
+		struct frame_delta *d = a->deltas[i];
+		struct image_info *frame = &a->frames[i];
+
+		if (d && pack_pwrite(fd, d->spans,
+				d->count * sizeof(struct fb_span),
+				index[i].spans_offset))
+			goto write_error;
+
+		if (pack_write_pixels(fd, frame, format, index[i].offset))
+			goto write_error;
+	}
+
+	if (ftruncate(fd, offset))
+		goto write_error;
+
+	LOG(LOG_INFO, "Packed %d frames into %s, %llu bytes", a->frame_count,
+			filename, (unsigned long long)offset);
+	rc = 0;
+
+write_error:
+	if (rc)
+		ERR("Could not write %s", filename);
+	close(fd);
+out:
+	free(index);
+	return rc;
+}
+
+static int pack_check_spans(const struct pack_frame *f,
+		const struct fb_span *spans)
+{
+	uint32_t i;
+
+	for (i = 0; i < f->span_count; ++i) {
+		const struct fb_span *s = &spans[i];
+
+		if (s->x < 0 || s->y < 0 || s->width <= 0
+				|| (uint32_t)s->x + s->width > f->width
+				|| (uint32_t)s->y >= f->height)
+			return -1;
+	}
+
+	return 0;
+}
+
+/**
+ * Map a pack into memory and set the animation frames to point into it.
+ * The pack must have been created for the given pixel format.
+ */
+int pack_map(const char *filename, const struct pixel_format *format,
+		struct animation *a)
+{
+	const struct pack_header *header;
+	const struct pack_frame *index;
+	struct image_info *frames = NULL;
+	struct frame_delta **frame_deltas = NULL;
+	struct frame_delta *deltas = NULL;
+	struct pixel_format pack_format;
+	struct stat st;
+	unsigned char *map;
+	uint64_t size;
+	uint32_t i;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if (fd < 0)
+		ERR_RET(-1, "Could not open file %s", filename);
+
+	if (fstat(fd, &st)) {
+		ERR("Could not stat %s", filename);
+		close(fd);
+		return -1;
+	}
+
+	size = st.st_size;
+	if (size < sizeof(*header)) {
+		LOG(LOG_ERR, "Incorrect animation pack %s", filename);
+		close(fd);
+		return -1;
+	}
+
+	map = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		ERR_RET(-1, "Could not map %s", filename);
+
+	header = (const struct pack_header *)map;
+	index = (const struct pack_frame *)(header + 1);
+
+	if (memcmp(header->magic, PACK_MAGIC, sizeof(header->magic))
+			|| header->version != PACK_VERSION
+			|| !header->frame_count
+			|| (size - sizeof(*header)) / sizeof(*index)
+				< header->frame_count) {
+		LOG(LOG_ERR, "Incorrect animation pack %s", filename);
+		goto fail;
+	}
+
+	pack_get_format(header, &pack_format);
+	if (!pixel_format_equal(&pack_format, format)) {
+		LOG(LOG_ERR, "%s was packed for a %d bpp pixel format different"
+				" from the one of the screen", filename,
+				pack_format.bpp);
+		goto fail;
+	}
+
+	frames = calloc(header->frame_count, sizeof(*frames));
+	frame_deltas = calloc(header->frame_count, sizeof(*frame_deltas));
+	deltas = calloc(header->frame_count, sizeof(*deltas));
+	if (!frames || !frame_deltas || !deltas) {
+		LOG(LOG_ERR, "Unable to get memory for animation");
+		goto fail;
+	}
+
+	for (i = 0; i < header->frame_count; ++i) {
+		const struct pack_frame *f = &index[i];
+		uint64_t frame_size = (uint64_t)f->width * f->height
+				* pixel_bytes(format);
+		struct image_info *frame = &frames[i];
+
+		if (!f->width || !f->height || f->width > 0xFFFF
+				|| f->height > 0xFFFF || f->offset > size
+				|| size - f->offset < frame_size) {
+			LOG(LOG_ERR, "Frame %u is out of animation pack %s", i,
+					filename);
+			goto fail;
+		}
+
+		frame->width = f->width;
+		frame->height = f->height;
+		frame->bpp = format->bpp;
+		frame->pixel_buffer = map + f->offset;
+
+		if (f->span_count == PACK_NO_DELTA)
+			continue;
+
+		if (f->spans_offset % sizeof(int) || f->spans_offset > size
+				|| (size - f->spans_offset)
+					/ sizeof(struct fb_span) < f->span_count
+				|| pack_check_spans(f, (const struct fb_span *)
+					(map + f->spans_offset))) {
+			LOG(LOG_ERR, "Incorrect spans of frame %u in animation"
+					" pack %s", i, filename);
+			goto fail;
+		}
+
+		deltas[i].count = f->span_count;
+		deltas[i].spans = (struct fb_span *)(map + f->spans_offset);
+		frame_deltas[i] = &deltas[i];
+	}
+
+	a->frames = frames;
+	a->deltas = frame_deltas;
+	a->frame_count = header->frame_count;
+	LOG(LOG_DEBUG, "Mapped animation pack %s: %u frames, %llu bytes",
+			filename, header->frame_count,
+			(unsigned long long)size);
+
+	return 0;
+
+fail:
+	free(frames);
+	free(frame_deltas);
+	free(deltas);
+	munmap(map, size);
+	return -1;
+}
@@ -0,0 +1,25 @@
+/*
+ *  Precompiled animation packs
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _PACK_H
+#define _PACK_H
+
+struct animation;
+struct pixel_format;
+
+int pack_probe(const char *filename);
+int pack_write(const char *filename, struct animation *a,
+		const struct pixel_format *format);
+int pack_map(const char *filename, const struct pixel_format *format,
+		struct animation *a);
+
+#endif /* _PACK_H */
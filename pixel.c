@@ -0,0 +1,430 @@
+/*
+ *  Pixel format conversion
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "pixel.h"
+
+const struct pixel_format pixel_format_argb32 = {
+	.bpp = 32,
+	.red = { .offset = 16, .length = 8 },
+	.green = { .offset = 8, .length = 8 },
+	.blue = { .offset = 0, .length = 8 },
+	.transp = { .offset = 24, .length = 8 },
+};
+
+static const struct {
+	const char *name;
+	struct pixel_format format;
+} _named_formats[] = {
+	{ "argb32",	{ 32, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 24, 8 } } },
+	{ "xrgb32",	{ 32, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 0, 0 } } },
+	{ "rgb888",	{ 24, { 16, 8 }, { 8, 8 }, { 0, 8 }, { 0, 0 } } },
+	{ "rgb565",	{ 16, { 11, 5 }, { 5, 6 }, { 0, 5 }, { 0, 0 } } },
+	{ "argb1555",	{ 16, { 10, 5 }, { 5, 5 }, { 0, 5 }, { 15, 1 } } },
+	{ "xrgb1555",	{ 16, { 10, 5 }, { 5, 5 }, { 0, 5 }, { 0, 0 } } },
+};
+
+/**
+ * Find one of the common formats by its name, e.g. "rgb565"
+ */
+const struct pixel_format *pixel_format_by_name(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < sizeof(_named_formats) / sizeof(_named_formats[0]); ++i)
+		if (!strcasecmp(name, _named_formats[i].name))
+			return &_named_formats[i].format;
+
+	return NULL;
+}
+
+static int channel_supported(const struct pixel_channel *c, int bpp)
+{
+	return c->length <= 8 && c->offset + c->length <= bpp;
+}
+
+int pixel_format_supported(const struct pixel_format *f)
+{
+	if (f->bpp != 16 && f->bpp != 24 && f->bpp != 32)
+		return 0;
+
+	return f->red.length && f->green.length && f->blue.length
+			&& channel_supported(&f->red, f->bpp)
+			&& channel_supported(&f->green, f->bpp)
+			&& channel_supported(&f->blue, f->bpp)
+			&& channel_supported(&f->transp, f->bpp);
+}
+
+static inline int channel_equal(const struct pixel_channel *a,
+		const struct pixel_channel *b)
+{
+	return a->length == b->length && (!a->length || a->offset == b->offset);
+}
+
+int pixel_format_equal(const struct pixel_format *a,
+		const struct pixel_format *b)
+{
+	return a->bpp == b->bpp
+			&& channel_equal(&a->red, &b->red)
+			&& channel_equal(&a->green, &b->green)
+			&& channel_equal(&a->blue, &b->blue)
+			&& channel_equal(&a->transp, &b->transp);
+}
+
+static inline uint32_t channel_pack(const struct pixel_channel *c, uint32_t v)
+{
+	if (!c->length)
+		return 0;
+
+	return (v >> (8 - c->length)) << c->offset;
+}
+
+uint32_t pixel_pack(const struct pixel_format *f, uint32_t argb)
+{
+	return channel_pack(&f->transp, argb >> 24)
+			| channel_pack(&f->red, (argb >> 16) & 0xFF)
+			| channel_pack(&f->green, (argb >> 8) & 0xFF)
+			| channel_pack(&f->blue, argb & 0xFF);
+}
+
+static inline uint32_t channel_unpack(const struct pixel_channel *c,
+		uint32_t v)
+{
+	const uint32_t max = (1U << c->length) - 1;
+
+	if (!c->length)
+		return 0xFF;
+
+	return ((v >> c->offset) & max) * 0xFF / max;
+}
+
+/**
+ * Convert a pixel of the given format into ARGB32. Channels the format does
+ * not have are taken as fully set.
+ */
+uint32_t pixel_unpack(const struct pixel_format *f, uint32_t v)
+{
+	return channel_unpack(&f->transp, v) << 24
+			| channel_unpack(&f->red, v) << 16
+			| channel_unpack(&f->green, v) << 8
+			| channel_unpack(&f->blue, v);
+}
+
+static inline int is_rgb565(const struct pixel_format *f)
+{
+	return f->bpp == 16 && !f->transp.length
+			&& f->red.offset == 11 && f->red.length == 5
+			&& f->green.offset == 5 && f->green.length == 6
+			&& f->blue.offset == 0 && f->blue.length == 5;
+}
+
+static void pack_line_rgb565(uint16_t *out, const uint32_t *in, int width)
+{
+	int j;
+
+	for (j = 0; j < width; ++j) {
+		uint32_t w = in[j];
+
+		out[j] = ((w >> 8) & 0xF800) | ((w >> 5) & 0x07E0)
+				| ((w >> 3) & 0x001F);
+	}
+}
+
+/**
+ * Convert a line of ARGB32 pixels into the given format
+ */
+void pixel_pack_line(const struct pixel_format *f, void *out,
+		const uint32_t *argb, int width)
+{
+	int j;
+
+	if (pixel_format_equal(f, &pixel_format_argb32)) {
+		memcpy(out, argb, width * 4);
+		return;
+	}
+
+	switch (f->bpp) {
+	case 16:
+		if (is_rgb565(f)) {
+			pack_line_rgb565(out, argb, width);
+			break;
+		}
+
+		for (j = 0; j < width; ++j)
+			((uint16_t *)out)[j] = (uint16_t)pixel_pack(f, argb[j]);
+		break;
+
+	case 24:
+		for (j = 0; j < width; ++j) {
+			uint32_t w = pixel_pack(f, argb[j]);
+			unsigned char *o = (unsigned char *)out + j * 3;
+
+			o[0] = w;
+			o[1] = w >> 8;
+			o[2] = w >> 16;
+		}
+		break;
+
+	case 32:
+		for (j = 0; j < width; ++j)
+			((uint32_t *)out)[j] = pixel_pack(f, argb[j]);
+		break;
+	}
+}
+
+/**
+ * Write the pixels of a palette, already packed in the given format, that
+ * a line of 8-bit indices refers to
+ */
+void pixel_lookup_line(const struct pixel_format *f, void *out,
+		const unsigned char *in, const uint32_t *palette, int count)
+{
+	int j;
+
+	switch (f->bpp) {
+	case 16:
+		for (j = 0; j < count; ++j)
+			((uint16_t *)out)[j] = (uint16_t)palette[in[j]];
+		break;
+
+	case 24:
+		for (j = 0; j < count; ++j) {
+			const uint32_t w = palette[in[j]];
+			unsigned char *o = (unsigned char *)out + j * 3;
+
+			o[0] = w;
+			o[1] = w >> 8;
+			o[2] = w >> 16;
+		}
+		break;
+
+	case 32:
+		for (j = 0; j < count; ++j)
+			((uint32_t *)out)[j] = palette[in[j]];
+		break;
+	}
+}
+
+/* x / 255, rounded, for x up to 255 * 255 */
+static inline uint32_t div255(uint32_t x)
+{
+	x += 128;
+	return (x + (x >> 8)) >> 8;
+}
+
+/* Put a premultiplied ARGB32 pixel over another ARGB32 one */
+static inline uint32_t blend_argb32(uint32_t src, uint32_t dst)
+{
+	const uint32_t inv = 0xFF - (src >> 24);
+	uint32_t out = 0;
+	int shift;
+
+	for (shift = 0; shift < 32; shift += 8) {
+		const uint32_t d = (dst >> shift) & 0xFF;
+
+		out |= (((src >> shift) & 0xFF) + div255(d * inv)) << shift;
+	}
+
+	return out;
+}
+
+static inline int is_argb32_layout(const struct pixel_format *f)
+{
+	return f->bpp == 32 && f->red.offset == 16 && f->red.length == 8
+			&& f->green.offset == 8 && f->green.length == 8
+			&& f->blue.offset == 0 && f->blue.length == 8
+			&& (!f->transp.length || f->transp.offset == 24);
+}
+
+/*
+ * ARGB32 and XRGB32 pixels are blended as they are, four or eight at a time
+ * where the CPU has vector instructions. The padding byte of XRGB32 is
+ * blended like alpha, which does no harm.
+ */
+static void blend_line_argb32(uint32_t *out, const unsigned char *src,
+		const uint32_t *under, int count)
+{
+	uint32_t s;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i full = _mm_set1_epi16(0xFF);
+	const __m128i half = _mm_set1_epi16(0x80);
+
+	for (; count >= 4; count -= 4, out += 4, src += 16, under += 4) {
+		__m128i vs = _mm_loadu_si128((const __m128i *)src);
+		__m128i vd = _mm_loadu_si128((const __m128i *)under);
+		__m128i a = _mm_srli_epi32(vs, 24);
+		__m128i inv, lo, hi;
+
+		/* 255 - alpha in all four 16-bit lanes of each pixel */
+		inv = _mm_sub_epi16(full,
+				_mm_or_si128(a, _mm_slli_epi32(a, 16)));
+		lo = _mm_mullo_epi16(_mm_unpacklo_epi8(vd, zero),
+				_mm_unpacklo_epi32(inv, inv));
+		hi = _mm_mullo_epi16(_mm_unpackhi_epi8(vd, zero),
+				_mm_unpackhi_epi32(inv, inv));
+		lo = _mm_add_epi16(lo, half);
+		hi = _mm_add_epi16(hi, half);
+		lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+		hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+		_mm_storeu_si128((__m128i *)out,
+				_mm_adds_epu8(vs, _mm_packus_epi16(lo, hi)));
+	}
+#elif defined(__ARM_NEON)
+	for (; count >= 8; count -= 8, out += 8, src += 32, under += 8) {
+		uint8x8x4_t vs = vld4_u8(src);
+		uint8x8x4_t vd = vld4_u8((const uint8_t *)under);
+		const uint8x8_t inv = vmvn_u8(vs.val[3]);
+		int c;
+
+		for (c = 0; c < 4; ++c) {
+			uint16x8_t t = vmull_u8(vd.val[c], inv);
+
+			vd.val[c] = vqadd_u8(vs.val[c],
+					vraddhn_u16(t, vrshrq_n_u16(t, 8)));
+		}
+		vst4_u8((uint8_t *)out, vd);
+	}
+#endif
+
+	for (; count > 0; --count, src += 4) {
+		memcpy(&s, src, sizeof(s));
+		*out++ = blend_argb32(s, *under++);
+	}
+}
+
+/**
+ * Put 'count' premultiplied ARGB32 pixels (not necessarily aligned) over
+ * the pixels 'under' of the given format, writing the result into 'out'.
+ * 'under' may be 'out'.
+ */
+void pixel_blend_line(const struct pixel_format *f, void *out,
+		const void *src, const void *under, int count)
+{
+	const unsigned char *s = src;
+	const unsigned char *u = under;
+	unsigned char *o = out;
+	const int bytes = pixel_bytes(f);
+	uint32_t argb, v;
+
+	if (is_argb32_layout(f)) {
+		blend_line_argb32(out, src, under, count);
+		return;
+	}
+
+	for (; count > 0; --count, s += 4, u += bytes, o += bytes) {
+		memcpy(&argb, s, sizeof(argb));
+		v = 0;
+		/* 24 bpp pixels are stored least significant byte first */
+		memcpy(&v, u, bytes);
+		v = pixel_pack(f, blend_argb32(argb, pixel_unpack(f, v)));
+		memcpy(o, &v, bytes);
+	}
+}
+
+/**
+ * Fill 'count' 32-bit pixels with the value, four or eight at a time where
+ * the CPU has vector stores
+ */
+void pixel_fill32(void *out, uint32_t value, int count)
+{
+	uint32_t *o = out;
+
+#if defined(__SSE2__)
+	const __m128i v = _mm_set1_epi32((int)value);
+
+	for (; count >= 8; count -= 8, o += 8) {
+		_mm_storeu_si128((__m128i *)o, v);
+		_mm_storeu_si128((__m128i *)(o + 4), v);
+	}
+#elif defined(__ARM_NEON)
+	const uint32x4_t v = vdupq_n_u32(value);
+
+	for (; count >= 8; count -= 8, o += 8) {
+		vst1q_u32(o, v);
+		vst1q_u32(o + 4, v);
+	}
+#endif
+
+	while (count-- > 0)
+		*o++ = value;
+}
+
+void pixel_fill16(void *out, uint32_t value, int count)
+{
+	uint16_t *o = out;
+
+	if (count > 0 && ((uintptr_t)o & 2)) {
+		*o++ = (uint16_t)value;
+		count--;
+	}
+
+	/* Two pixels per 32-bit word */
+	value &= 0xFFFF;
+	pixel_fill32(o, value | (value << 16), count / 2);
+
+	if (count & 1)
+		o[count - 1] = (uint16_t)value;
+}
+
+void pixel_fill24(void *out, uint32_t value, int count)
+{
+	unsigned char *o = out;
+	size_t done = 3, total = (size_t)count * 3;
+
+	if (count <= 0)
+		return;
+
+	o[0] = value;
+	o[1] = value >> 8;
+	o[2] = value >> 16;
+
+	/* Double the filled part until it covers everything */
+	while (done < total) {
+		size_t n = (done < total - done) ? done : total - done;
+
+		memcpy(o + done, o, n);
+		done += n;
+	}
+}
+
+/**
+ * Fill 'count' pixels with a value already packed into the given format
+ */
+void pixel_fill(const struct pixel_format *f, void *out, uint32_t value,
+		int count)
+{
+	switch (f->bpp) {
+	case 16:
+		pixel_fill16(out, value, count);
+		break;
+
+	case 24:
+		pixel_fill24(out, value, count);
+		break;
+
+	case 32:
+		pixel_fill32(out, value, count);
+		break;
+	}
+}
@@ -0,0 +1,62 @@
+/*
+ *  Pixel format conversion
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _PIXEL_H
+#define _PIXEL_H
+
+#include <stdint.h>
+
+struct pixel_channel {
+	unsigned char offset;
+	unsigned char length; /* 0 if the channel is absent */
+};
+
+/*
+ * Layout of a pixel in memory, the same as in struct fb_var_screeninfo.
+ * Pixels of 16 and 32 bpp are stored in host byte order, 24 bpp pixels are
+ * stored as three bytes, least significant first.
+ */
+struct pixel_format {
+	int bpp; /* bits per pixel: 16, 24 or 32 */
+	struct pixel_channel red;
+	struct pixel_channel green;
+	struct pixel_channel blue;
+	struct pixel_channel transp;
+};
+
+/* The format bitmaps are parsed into, and the one bannerd sets by default */
+extern const struct pixel_format pixel_format_argb32;
+
+static inline int pixel_bytes(const struct pixel_format *f)
+{
+	return f->bpp / 8;
+}
+
+const struct pixel_format *pixel_format_by_name(const char *name);
+int pixel_format_supported(const struct pixel_format *f);
+int pixel_format_equal(const struct pixel_format *a,
+		const struct pixel_format *b);
+uint32_t pixel_pack(const struct pixel_format *f, uint32_t argb);
+uint32_t pixel_unpack(const struct pixel_format *f, uint32_t v);
+void pixel_pack_line(const struct pixel_format *f, void *out,
+		const uint32_t *argb, int width);
+void pixel_lookup_line(const struct pixel_format *f, void *out,
+		const unsigned char *in, const uint32_t *palette, int count);
+void pixel_blend_line(const struct pixel_format *f, void *out,
+		const void *src, const void *under, int count);
+void pixel_fill(const struct pixel_format *f, void *out, uint32_t value,
+		int count);
+void pixel_fill16(void *out, uint32_t value, int count);
+void pixel_fill24(void *out, uint32_t value, int count);
+void pixel_fill32(void *out, uint32_t value, int count);
+
+#endif /* _PIXEL_H */
@@ -0,0 +1,987 @@
+/*
+ *  PNG decoding
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#ifndef _BSD_SOURCE
+#define _BSD_SOURCE
+#endif /* _BSD_SOURCE */
+#include <endian.h>
+
+#include "fb.h"
+#include "log.h"
+#include "pixel.h"
+#include "png.h"
+
+/* Colour types */
+#define PNG_GRAY	0
+#define PNG_RGB		2
+#define PNG_PALETTE	3
+#define PNG_GRAY_ALPHA	4
+#define PNG_RGBA	6
+
+/* Larger images are taken for corrupt ones */
+#define PNG_MAX_DATA	(1UL << 30)
+#define PNG_MAX_SIZE	0xFFFF /* Largest width and height, as in a pack */
+
+/* Back references are copied 8 bytes at a time and may write past the end */
+#define INFLATE_SLACK	8
+
+/* Codes up to this long are decoded by a single lookup */
+#define INFLATE_FAST_BITS	10
+
+static const unsigned char png_signature[8] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n',
+};
+
+struct png_image {
+	int width;
+	int height;
+	int depth; /* Bits per sample */
+	int color; /* PNG_* */
+	int interlace;
+	size_t row_bytes; /* Of a row, without its filter type byte */
+	int pixel_bytes; /* Distance to the pixel on the left, at least 1 */
+	uint32_t palette[256]; /* ARGB32 */
+	int keyed; /* Pixels of 'key' are transparent */
+	unsigned int key[3]; /* Gray, or red, green and blue */
+	const unsigned char *data; /* zlib stream, from all the IDAT chunks */
+	size_t data_size;
+	unsigned char *joined; /* Allocated for 'data' if there are several */
+};
+
+struct huffman {
+	uint16_t fast[1 << INFLATE_FAST_BITS]; /* length << 9 | symbol */
+	uint16_t first_code[16];
+	uint16_t first_symbol[16];
+	uint32_t max_code[17]; /* Past the last code of a length, in 16 bits */
+	uint16_t symbols[288];
+	uint8_t lengths[288]; /* Of the code of each symbol, 0 if unused */
+};
+
+struct inflate {
+	const unsigned char *in;
+	const unsigned char *end;
+	uint64_t bits; /* Bits read ahead, the next one lowest */
+	int count; /* Bits in 'bits' */
+	size_t padding; /* Zero bytes put into 'bits' past the end */
+	unsigned char *start;
+	unsigned char *out;
+	unsigned char *out_end;
+	struct huffman lit;
+	struct huffman dist;
+};
+
+static const uint16_t length_base[29] = {
+	3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+	59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+};
+
+static const uint8_t length_extra[29] = {
+	0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,
+	4, 5, 5, 5, 5, 0,
+};
+
+static const uint16_t dist_base[30] = {
+	1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+	513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385,
+	24577,
+};
+
+static const uint8_t dist_extra[30] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10,
+	10, 11, 11, 12, 12, 13, 13,
+};
+
+static inline uint32_t get_be32(const unsigned char *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static inline unsigned int bit_reverse16(unsigned int v)
+{
+	v = (v & 0xAAAA) >> 1 | (v & 0x5555) << 1;
+	v = (v & 0xCCCC) >> 2 | (v & 0x3333) << 2;
+	v = (v & 0xF0F0) >> 4 | (v & 0x0F0F) << 4;
+	return (v >> 8 | v << 8) & 0xFFFF;
+}
+
+/*
+ * Fill the bit buffer to at least 56 bits. Bytes are read 8 at a time
+ * while there are as many, and the bits above 'count' are then those of
+ * the bytes that follow, so reading them again changes nothing.
+ */
+static inline void inflate_refill(struct inflate *z)
+{
+	if (z->end - z->in >= 8) {
+		uint64_t v;
+
+		memcpy(&v, z->in, sizeof(v));
+		z->bits |= le64toh(v) << z->count;
+		z->in += (63 - z->count) >> 3;
+		z->count |= 56;
+		return;
+	}
+
+	while (z->count <= 56) {
+		if (z->in < z->end)
+			z->bits |= (uint64_t)*z->in++ << z->count;
+		else
+			z->padding++;
+		z->count += 8;
+	}
+}
+
+static inline unsigned int inflate_bits(struct inflate *z, int n)
+{
+	unsigned int v;
+
+	if (z->count < n)
+		inflate_refill(z);
+	v = (unsigned int)(z->bits & ((1U << n) - 1));
+	z->bits >>= n;
+	z->count -= n;
+
+	return v;
+}
+
+/* Canonical Huffman code of the given code lengths, as in RFC 1951 */
+static int huffman_build(struct huffman *h, const uint8_t *lengths, int n)
+{
+	int sizes[16] = { 0 }, next[16];
+	int i, code = 0, k = 0;
+
+	memset(h->fast, 0, sizeof(h->fast));
+	memset(h->lengths, 0, sizeof(h->lengths));
+	for (i = 0; i < n; ++i)
+		sizes[lengths[i]]++;
+	sizes[0] = 0;
+
+	for (i = 1; i < 16; ++i) {
+		next[i] = code;
+		h->first_code[i] = (uint16_t)code;
+		h->first_symbol[i] = (uint16_t)k;
+		code += sizes[i];
+		if (code > (1 << i))
+			return -1; /* Oversubscribed */
+		h->max_code[i] = (uint32_t)code << (16 - i);
+		code <<= 1;
+		k += sizes[i];
+	}
+	h->max_code[16] = 0x10000;
+
+	for (i = 0; i < n; ++i) {
+		const int s = lengths[i];
+		unsigned int j;
+		int at;
+
+		if (!s)
+			continue;
+
+		at = h->first_symbol[s] + next[s] - h->first_code[s];
+		h->symbols[at] = (uint16_t)i;
+		h->lengths[at] = (uint8_t)s;
+		if (s <= INFLATE_FAST_BITS)
+			for (j = bit_reverse16(next[s]) >> (16 - s);
+					j < (1U << INFLATE_FAST_BITS);
+					j += 1U << s)
+				h->fast[j] = (uint16_t)(s << 9 | i);
+		next[s]++;
+	}
+
+	return 0;
+}
+
+static inline int huffman_decode(struct inflate *z, const struct huffman *h)
+{
+	unsigned int v, k;
+	int s;
+
+	if (z->count < 16)
+		inflate_refill(z);
+
+	v = h->fast[z->bits & ((1U << INFLATE_FAST_BITS) - 1)];
+	if (v) {
+		s = v >> 9;
+		z->bits >>= s;
+		z->count -= s;
+		return v & 511;
+	}
+
+	/* Longer codes are compared bit reversed, most significant first */
+	k = bit_reverse16((unsigned int)(z->bits & 0xFFFF));
+	for (s = INFLATE_FAST_BITS + 1; s < 16; ++s)
+		if (k < h->max_code[s])
+			break;
+	if (s == 16)
+		return -1;
+
+	/* Codes an incomplete table leaves out have no symbol */
+	k = (k >> (16 - s)) - h->first_code[s] + h->first_symbol[s];
+	if (k >= 288 || h->lengths[k] != s)
+		return -1;
+	z->bits >>= s;
+	z->count -= s;
+
+	return h->symbols[k];
+}
+
+static int inflate_stored(struct inflate *z)
+{
+	unsigned int len, nlen;
+
+	inflate_bits(z, z->count & 7);
+	len = inflate_bits(z, 16);
+	nlen = inflate_bits(z, 16);
+	if (len != (~nlen & 0xFFFF) || len > (size_t)(z->out_end - z->out))
+		return -1;
+
+	/* What has been read ahead comes first */
+	for (; len && z->count >= 8; --len) {
+		*z->out++ = (unsigned char)z->bits;
+		z->bits >>= 8;
+		z->count -= 8;
+	}
+	if (!len)
+		return 0;
+
+	/* The zeros put in past the end are not data */
+	if (z->padding)
+		return -1;
+	z->bits = 0;
+	if (len > (size_t)(z->end - z->in))
+		return -1;
+	memcpy(z->out, z->in, len);
+	z->out += len;
+	z->in += len;
+
+	return 0;
+}
+
+static int inflate_fixed(struct inflate *z)
+{
+	uint8_t lengths[288];
+
+	memset(lengths, 8, 144);
+	memset(lengths + 144, 9, 112);
+	memset(lengths + 256, 7, 24);
+	memset(lengths + 280, 8, 8);
+	if (huffman_build(&z->lit, lengths, 288))
+		return -1;
+
+	memset(lengths, 5, 30);
+	return huffman_build(&z->dist, lengths, 30);
+}
+
+static int inflate_dynamic(struct inflate *z)
+{
+	static const uint8_t order[19] = {
+		16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1,
+		15,
+	};
+	const int hlit = inflate_bits(z, 5) + 257;
+	const int hdist = inflate_bits(z, 5) + 1;
+	const int hclen = inflate_bits(z, 4) + 4;
+	uint8_t lengths[286 + 32], clens[19] = { 0 };
+	struct huffman h;
+	int i, n = 0;
+
+	for (i = 0; i < hclen; ++i)
+		clens[order[i]] = (uint8_t)inflate_bits(z, 3);
+	if (hlit > 286 || huffman_build(&h, clens, 19))
+		return -1;
+
+	while (n < hlit + hdist) {
+		const int sym = huffman_decode(z, &h);
+		int rep;
+		uint8_t v = 0;
+
+		if (sym < 0)
+			return -1;
+		if (sym < 16) {
+			lengths[n++] = (uint8_t)sym;
+			continue;
+		}
+
+		if (sym == 16) {
+			if (!n)
+				return -1;
+			v = lengths[n - 1];
+			rep = 3 + inflate_bits(z, 2);
+		} else if (sym == 17)
+			rep = 3 + inflate_bits(z, 3);
+		else
+			rep = 11 + inflate_bits(z, 7);
+
+		if (n + rep > hlit + hdist)
+			return -1;
+		memset(lengths + n, v, rep);
+		n += rep;
+	}
+
+	if (!lengths[256])
+		return -1;
+
+	if (huffman_build(&z->lit, lengths, hlit))
+		return -1;
+	return huffman_build(&z->dist, lengths + hlit, hdist);
+}
+
+static int inflate_codes(struct inflate *z)
+{
+	unsigned char *out = z->out;
+
+	while (1) {
+		int sym = huffman_decode(z, &z->lit);
+		unsigned int len, dist;
+		const unsigned char *from;
+
+		if (sym < 256) {
+			if (sym < 0 || out == z->out_end)
+				return -1;
+			*out++ = (unsigned char)sym;
+			continue;
+		}
+		if (sym == 256)
+			break;
+
+		sym -= 257;
+		if (sym >= 29)
+			return -1;
+		len = length_base[sym] + inflate_bits(z, length_extra[sym]);
+
+		sym = huffman_decode(z, &z->dist);
+		if (sym < 0 || sym >= 30)
+			return -1;
+		dist = dist_base[sym] + inflate_bits(z, dist_extra[sym]);
+
+		if (dist > (size_t)(out - z->start)
+				|| len > (size_t)(z->out_end - out))
+			return -1;
+		from = out - dist;
+
+		if (dist >= 8) {
+			/* Whole chunks do not overlap what they copy */
+			unsigned char *end = out + len;
+
+			do {
+				memcpy(out, from, 8);
+				out += 8;
+				from += 8;
+			} while (out < end);
+			out = end;
+		} else if (dist == 1) {
+			memset(out, out[-1], len);
+			out += len;
+		} else
+			while (len--)
+				*out++ = *from++;
+	}
+
+	z->out = out;
+	return 0;
+}
+
+/*
+ * Inflate a zlib stream into 'out', which must have INFLATE_SLACK bytes
+ * past 'size'. It must come out exactly 'size' bytes long.
+ */
+static int inflate_zlib(const unsigned char *in, size_t in_size,
+		unsigned char *out, size_t size)
+{
+	struct inflate *z = malloc(sizeof(*z));
+	int final = 0, rc = 0;
+
+	if (!z)
+		ERR_RET(-1, "could not allocate memory");
+
+	if (in_size < 2 || (in[0] & 0x0F) != 8 || (in[0] >> 4) > 7
+			|| (in[0] << 8 | in[1]) % 31 || (in[1] & 0x20)) {
+		free(z);
+		return -1;
+	}
+
+	z->in = in + 2;
+	z->end = in + in_size;
+	z->bits = 0;
+	z->count = 0;
+	z->padding = 0;
+	z->start = z->out = out;
+	z->out_end = out + size;
+
+	while (!rc && !final) {
+		final = inflate_bits(z, 1);
+		switch (inflate_bits(z, 2)) {
+		case 0:
+			rc = inflate_stored(z);
+			break;
+		case 1:
+			rc = inflate_fixed(z) || inflate_codes(z);
+			break;
+		case 2:
+			rc = inflate_dynamic(z) || inflate_codes(z);
+			break;
+		default:
+			rc = -1;
+		}
+	}
+
+	/* Running past the end of the stream reads zeros, which is corrupt */
+	if (z->padding * 8 > (size_t)z->count || z->out != z->out_end)
+		rc = -1;
+	free(z);
+
+	return (rc) ? -1 : 0;
+}
+
+static inline int paeth(int a, int b, int c)
+{
+	const int pa = abs(b - c), pb = abs(a - c), pc = abs(a + b - 2 * c);
+
+	return (pa <= pb && pa <= pc) ? a : (pb <= pc) ? b : c;
+}
+
+#if defined(__SSE2__)
+/*
+ * Filters of 3 and 4 byte pixels, a pixel at a time in 16-bit lanes. They
+ * are inlined with 'bytes' constant so that pixels are moved in one go.
+ */
+
+static inline __m128i load_pixel(const unsigned char *p, int bytes)
+{
+	uint32_t v;
+
+	/* Bytes are put together in registers, not through the stack */
+	if (bytes == 4)
+		memcpy(&v, p, sizeof(v));
+	else
+		v = p[0] | p[1] << 8 | p[2] << 16;
+	return _mm_unpacklo_epi8(_mm_cvtsi32_si128((int)v),
+			_mm_setzero_si128());
+}
+
+static inline void store_pixel(unsigned char *p, __m128i v, int bytes)
+{
+	const uint32_t x = (uint32_t)_mm_cvtsi128_si32(_mm_packus_epi16(v, v));
+
+	if (bytes == 4)
+		memcpy(p, &x, sizeof(x));
+	else {
+		p[0] = (unsigned char)x;
+		p[1] = (unsigned char)(x >> 8);
+		p[2] = (unsigned char)(x >> 16);
+	}
+}
+
+static inline __m128i abs16(__m128i v)
+{
+	return _mm_max_epi16(v, _mm_sub_epi16(_mm_setzero_si128(), v));
+}
+
+static inline __m128i select16(__m128i mask, __m128i a, __m128i b)
+{
+	return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+static inline void unfilter_sub_sse2(unsigned char *row, size_t n, int bytes)
+{
+	const __m128i low = _mm_set1_epi16(0xFF);
+	__m128i a = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i < n; i += bytes) {
+		a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i, bytes), a),
+				low);
+		store_pixel(row + i, a, bytes);
+	}
+}
+
+static inline void unfilter_avg_sse2(unsigned char *row,
+		const unsigned char *prior, size_t n, int bytes)
+{
+	const __m128i low = _mm_set1_epi16(0xFF);
+	__m128i a = _mm_setzero_si128();
+	size_t i;
+
+	for (i = 0; i < n; i += bytes) {
+		__m128i b = load_pixel(prior + i, bytes);
+		__m128i avg = _mm_srli_epi16(_mm_add_epi16(a, b), 1);
+
+		a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i, bytes),
+				avg), low);
+		store_pixel(row + i, a, bytes);
+	}
+}
+
+static inline void unfilter_paeth_sse2(unsigned char *row,
+		const unsigned char *prior, size_t n, int bytes)
+{
+	const __m128i low = _mm_set1_epi16(0xFF);
+	__m128i a = _mm_setzero_si128(), c = a;
+	size_t i;
+
+	for (i = 0; i < n; i += bytes) {
+		__m128i b = load_pixel(prior + i, bytes);
+		__m128i pa = abs16(_mm_sub_epi16(b, c));
+		__m128i pb = abs16(_mm_sub_epi16(a, c));
+		__m128i pc = abs16(_mm_sub_epi16(_mm_add_epi16(a, b),
+				_mm_add_epi16(c, c)));
+		__m128i min = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+		__m128i near = select16(_mm_cmpeq_epi16(min, pa), a,
+				select16(_mm_cmpeq_epi16(min, pb), b, c));
+
+		a = _mm_and_si128(_mm_add_epi16(load_pixel(row + i, bytes),
+				near), low);
+		store_pixel(row + i, a, bytes);
+		c = b;
+	}
+}
+#endif /* __SSE2__ */
+
+/*
+ * Undo the filter of a row given the row above it, which is all zeros for
+ * the first one. 'bytes' is the distance to the pixel on the left.
+ */
+static int png_unfilter(int filter, unsigned char *row,
+		const unsigned char *prior, size_t n, int bytes)
+{
+	size_t i;
+
+	switch (filter) {
+	case 0:
+		break;
+
+	case 1: /* Sub */
+#if defined(__SSE2__)
+		if (bytes == 4) {
+			unfilter_sub_sse2(row, n, 4);
+			break;
+		}
+		if (bytes == 3) {
+			unfilter_sub_sse2(row, n, 3);
+			break;
+		}
+#endif
+		for (i = bytes; i < n; ++i)
+			row[i] += row[i - bytes];
+		break;
+
+	case 2: /* Up */
+		for (i = 0; i < n; ++i)
+			row[i] += prior[i];
+		break;
+
+	case 3: /* Average */
+#if defined(__SSE2__)
+		if (bytes == 4) {
+			unfilter_avg_sse2(row, prior, n, 4);
+			break;
+		}
+		if (bytes == 3) {
+			unfilter_avg_sse2(row, prior, n, 3);
+			break;
+		}
+#endif
+		for (i = 0; i < (size_t)bytes; ++i)
+			row[i] += prior[i] >> 1;
+		for (; i < n; ++i)
+			row[i] += (row[i - bytes] + prior[i]) >> 1;
+		break;
+
+	case 4: /* Paeth */
+#if defined(__SSE2__)
+		if (bytes == 4) {
+			unfilter_paeth_sse2(row, prior, n, 4);
+			break;
+		}
+		if (bytes == 3) {
+			unfilter_paeth_sse2(row, prior, n, 3);
+			break;
+		}
+#endif
+		for (i = 0; i < (size_t)bytes; ++i)
+			row[i] += prior[i];
+		for (; i < n; ++i)
+			row[i] += paeth(row[i - bytes], prior[i],
+					prior[i - bytes]);
+		break;
+
+	default:
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Sample 'x' of a row of 1, 2 or 4 bit samples */
+static inline unsigned int png_sample(const unsigned char *row, int x,
+		int depth)
+{
+	const int bit = x * depth;
+
+	return row[bit >> 3] >> (8 - depth - (bit & 7)) & ((1 << depth) - 1);
+}
+
+/* Sample of 1 or 2 bytes, as tRNS gives the transparent colour */
+static inline unsigned int png_value(const unsigned char *p, int bytes)
+{
+	return (bytes == 1) ? p[0] : (unsigned int)p[0] << 8 | p[1];
+}
+
+/* A row of the image as ARGB32 */
+static void png_row(const struct png_image *p, uint32_t *out,
+		const unsigned char *row)
+{
+	/* 16-bit samples are taken by their high bytes */
+	const int step = (p->depth == 16) ? 2 : 1;
+	const unsigned int *key = p->key;
+	int x;
+
+	switch (p->color) {
+	case PNG_RGBA:
+		if (step == 1)
+			for (x = 0; x < p->width; ++x, row += 4) {
+				uint32_t v;
+
+				memcpy(&v, row, sizeof(v));
+				v = le32toh(v);
+				out[x] = (v & 0xFF00FF00) | (v >> 16 & 0xFF)
+						| (v & 0xFF) << 16;
+			}
+		else
+			for (x = 0; x < p->width; ++x, row += 8)
+				out[x] = (uint32_t)row[6] << 24 | row[0] << 16
+						| row[2] << 8 | row[4];
+		break;
+
+	case PNG_RGB:
+		for (x = 0; x < p->width; ++x, row += 3 * step) {
+			out[x] = 0xFF000000 | row[0] << 16 | row[step] << 8
+					| row[2 * step];
+			if (p->keyed && png_value(row, step) == key[0]
+					&& png_value(row + step, step) == key[1]
+					&& png_value(row + 2 * step, step)
+						== key[2])
+				out[x] &= 0x00FFFFFF;
+		}
+		break;
+
+	case PNG_GRAY_ALPHA:
+		for (x = 0; x < p->width; ++x, row += 2 * step)
+			out[x] = (uint32_t)row[step] << 24 | row[0] * 0x010101U;
+		break;
+
+	case PNG_GRAY:
+		for (x = 0; x < p->width; ++x) {
+			unsigned int v, g;
+
+			if (p->depth >= 8) {
+				v = png_value(row + x * step, step);
+				g = row[x * step];
+			} else {
+				v = png_sample(row, x, p->depth);
+				g = v * (255 / ((1 << p->depth) - 1));
+			}
+			out[x] = ((p->keyed && v == key[0]) ? 0 : 0xFF000000)
+					| g * 0x010101U;
+		}
+		break;
+
+	case PNG_PALETTE:
+		if (p->depth == 8)
+			for (x = 0; x < p->width; ++x)
+				out[x] = p->palette[row[x]];
+		else
+			for (x = 0; x < p->width; ++x)
+				out[x] = p->palette[png_sample(row, x,
+						p->depth)];
+		break;
+	}
+}
+
+static int png_header(const char *filename, const unsigned char *file,
+		size_t size, struct png_image *p)
+{
+	const unsigned char *ihdr = file + 8;
+	uint32_t w, h;
+	int channels, ok;
+
+	if (size < 8 + 8 + 13 + 4 || get_be32(ihdr) != 13
+			|| memcmp(ihdr + 4, "IHDR", 4)) {
+		LOG(LOG_ERR, "Incorrect PNG format in %s", filename);
+		return -1;
+	}
+
+	ihdr += 8;
+	w = get_be32(ihdr);
+	h = get_be32(ihdr + 4);
+	p->depth = ihdr[8];
+	p->color = ihdr[9];
+	p->interlace = ihdr[12];
+
+	switch (p->color) {
+	case PNG_GRAY:
+		channels = 1;
+		ok = p->depth == 1 || p->depth == 2 || p->depth == 4
+				|| p->depth == 8 || p->depth == 16;
+		break;
+	case PNG_PALETTE:
+		channels = 1;
+		ok = p->depth == 1 || p->depth == 2 || p->depth == 4
+				|| p->depth == 8;
+		break;
+	case PNG_RGB:
+	case PNG_GRAY_ALPHA:
+	case PNG_RGBA:
+		channels = (p->color == PNG_RGB) ? 3
+				: (p->color == PNG_RGBA) ? 4 : 2;
+		ok = p->depth == 8 || p->depth == 16;
+		break;
+	default:
+		ok = 0;
+	}
+
+	if (!ok || ihdr[10] || ihdr[11] || p->interlace > 1 || !w || !h) {
+		LOG(LOG_ERR, "Unsupported PNG format in %s", filename);
+		return -1;
+	}
+
+	if (w > PNG_MAX_SIZE || h > PNG_MAX_SIZE) {
+		LOG(LOG_ERR, "PNG image %s is too large: %ux%u", filename,
+				(unsigned int)w, (unsigned int)h);
+		return -1;
+	}
+
+	p->width = (int)w;
+	p->height = (int)h;
+	p->row_bytes = ((uint64_t)w * channels * p->depth + 7) / 8;
+	p->pixel_bytes = (channels * p->depth + 7) / 8;
+	if ((uint64_t)h * (p->row_bytes + 1) > PNG_MAX_DATA) {
+		LOG(LOG_ERR, "PNG image %s is too large", filename);
+		return -1;
+	}
+
+	return 0;
+}
+
+/* Find the palette, the transparency and the image data */
+static int png_chunks(const char *filename, const unsigned char *file,
+		size_t size, struct png_image *p)
+{
+	size_t at = 8, data_size = 0, joined = 0;
+	const unsigned char *first = NULL;
+	int i;
+
+	for (i = 0; i < 256; ++i)
+		p->palette[i] = 0xFF000000;
+	p->keyed = 0;
+	p->joined = NULL;
+
+	while (1) {
+		const unsigned char *c = file + at;
+		uint32_t len;
+
+		if (size - at < 12 || (len = get_be32(c)) > size - at - 12) {
+			LOG(LOG_ERR, "Corrupt PNG, chunks run past the end of"
+					" %s", filename);
+			return -1;
+		}
+
+		if (!memcmp(c + 4, "IEND", 4))
+			break;
+
+		if (!memcmp(c + 4, "PLTE", 4)) {
+			for (i = 0; i < (int)(len / 3) && i < 256; ++i)
+				p->palette[i] = 0xFF000000 | c[8 + 3 * i] << 16
+						| c[9 + 3 * i] << 8
+						| c[10 + 3 * i];
+		} else if (!memcmp(c + 4, "tRNS", 4)) {
+			if (p->color == PNG_PALETTE)
+				for (i = 0; i < (int)len && i < 256; ++i)
+					p->palette[i] = (p->palette[i]
+							& 0x00FFFFFF)
+						| (uint32_t)c[8 + i] << 24;
+			else if (p->color == PNG_GRAY && len >= 2) {
+				p->key[0] = c[8] << 8 | c[9];
+				p->keyed = 1;
+			} else if (p->color == PNG_RGB && len >= 6) {
+				for (i = 0; i < 3; ++i)
+					p->key[i] = c[8 + 2 * i] << 8
+							| c[9 + 2 * i];
+				p->keyed = 1;
+			}
+		} else if (!memcmp(c + 4, "IDAT", 4)) {
+			if (!first)
+				first = c;
+			data_size += len;
+		}
+
+		at += 12 + len;
+	}
+
+	if (!first) {
+		LOG(LOG_ERR, "No image data in %s", filename);
+		return -1;
+	}
+
+	/* The stream is split into IDAT chunks, which are usually small */
+	if (data_size == get_be32(first)) {
+		p->data = first + 8;
+		p->data_size = data_size;
+		return 0;
+	}
+
+	p->joined = malloc(data_size);
+	if (!p->joined)
+		ERR_RET(-1, "could not allocate memory");
+
+	for (at = first - file; joined < data_size; ) {
+		const unsigned char *c = file + at;
+		const uint32_t len = get_be32(c);
+
+		if (!memcmp(c + 4, "IDAT", 4)) {
+			memcpy(p->joined + joined, c + 8, len);
+			joined += len;
+		}
+		at += 12 + len;
+	}
+	p->data = p->joined;
+	p->data_size = data_size;
+
+	return 0;
+}
+
+/**
+ * Whether the file starts as a PNG image does
+ */
+int png_check(const unsigned char *file, size_t size)
+{
+	return size >= sizeof(png_signature)
+			&& !memcmp(file, png_signature, sizeof(png_signature));
+}
+
+/**
+ * Find out the size of a PNG image from its header, without decoding it
+ */
+int png_size(const char *filename, const unsigned char *file, size_t size,
+		int *width, int *height)
+{
+	struct png_image p;
+
+	if (png_header(filename, file, size, &p))
+		return -1;
+
+	*width = p.width;
+	*height = p.height;
+	return 0;
+}
+
+/**
+ * Decode a non-interlaced PNG image into the given format. Colours are
+ * taken as they are, without gamma correction, and 16-bit samples are cut
+ * to 8 bits. CRCs and the Adler-32 checksum are not checked, but the
+ * structure of the stream is. The pixels go to 'room' if they fit there.
+ */
+int png_decode(const char *filename, const unsigned char *file, size_t size,
+		struct image_info *image, const struct pixel_format *format,
+		const struct pixel_room *room)
+{
+	const int bytes = pixel_bytes(format);
+	const int direct = pixel_format_equal(format, &pixel_format_argb32);
+	struct png_image p;
+	unsigned char *raw = NULL, *row, *out;
+	unsigned char *zeros = NULL;
+	const unsigned char *prior;
+	uint32_t *line = NULL;
+	size_t raw_size;
+	uint64_t out_size;
+	int y, rc = -1;
+
+	if (png_header(filename, file, size, &p))
+		return -1;
+	if (p.interlace) {
+		LOG(LOG_ERR, "Interlaced PNG images are not supported: %s",
+				filename);
+		return -1;
+	}
+
+	/* Up to 16GiB at 4 bytes a pixel, which a 32-bit size_t cannot hold */
+	out_size = (uint64_t)p.width * p.height * bytes;
+	if (out_size > SIZE_MAX) {
+		LOG(LOG_ERR, "PNG image %s is too large", filename);
+		return -1;
+	}
+	if (png_chunks(filename, file, size, &p))
+		return -1;
+
+	raw_size = (size_t)p.height * (p.row_bytes + 1);
+	raw = malloc(raw_size + INFLATE_SLACK);
+	zeros = calloc(1, p.row_bytes);
+	line = (direct) ? NULL : malloc(p.width * sizeof(*line));
+	image->pixel_buffer = pixel_room_alloc(room, (size_t)out_size);
+	if (!raw || !zeros || (!direct && !line) || !image->pixel_buffer) {
+		ERR("could not allocate memory");
+		goto out;
+	}
+
+	if (inflate_zlib(p.data, p.data_size, raw, raw_size)) {
+		LOG(LOG_ERR, "Corrupt PNG, bad image data in %s", filename);
+		goto out;
+	}
+
+	/* Rows are unfiltered and converted while they are in the cache */
+	out = image->pixel_buffer;
+	prior = zeros;
+	for (y = 0, row = raw; y < p.height; ++y, row += p.row_bytes + 1) {
+		if (png_unfilter(row[0], row + 1, prior, p.row_bytes,
+				p.pixel_bytes)) {
+			LOG(LOG_ERR, "Corrupt PNG, bad filter in %s", filename);
+			goto out;
+		}
+		prior = row + 1;
+
+		if (direct)
+			png_row(&p, (uint32_t *)out, row + 1);
+		else {
+			png_row(&p, line, row + 1);
+			pixel_pack_line(format, out, line, p.width);
+		}
+		out += (size_t)p.width * bytes;
+	}
+
+	image->width = p.width;
+	image->height = p.height;
+	image->bpp = format->bpp;
+	image->stride = 0;
+	image->palette = NULL;
+	image->rle = NULL;
+	image->under = NULL;
+	rc = 0;
+
+out:
+	if (rc) {
+		pixel_room_free(room, image->pixel_buffer);
+		image->pixel_buffer = NULL;
+	}
+	free(p.joined);
+	free(raw);
+	free(zeros);
+	free(line);
+
+	return rc;
+}
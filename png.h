@@ -0,0 +1,29 @@
+/*
+ *  PNG decoding
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _PNG_H
+#define _PNG_H
+
+#include <stddef.h>
+
+struct image_info;
+struct pixel_format;
+struct pixel_room;
+
+int png_check(const unsigned char *file, size_t size);
+int png_size(const char *filename, const unsigned char *file, size_t size,
+		int *width, int *height);
+int png_decode(const char *filename, const unsigned char *file, size_t size,
+		struct image_info *image, const struct pixel_format *format,
+		const struct pixel_room *room);
+
+#endif /* _PNG_H */
@@ -0,0 +1,407 @@
+/*
+ *  Run-length encoded frames
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixel.h"
+#include "rle.h"
+
+#define RLE_KIND	0xC000
+#define RLE_LITERAL	0x0000
+#define RLE_FILL	0x8000
+#define RLE_SKIP	0x4000 /* Transparent, no pixels follow */
+#define RLE_BLEND	0xC000 /* Translucent, premultiplied ARGB32 pixels */
+#define RLE_MAX_RUN	0x3FFF
+#define RLE_MIN_FILL	4 /* Shorter runs of equal pixels are kept literal */
+
+/* Colours are matched against the key to the precision of RGB565, as 16 bpp
+ * sources do not have the low bits */
+#define RLE_KEY_MASK	0x00F8FCF8
+
+struct rle_encoder {
+	struct rle_image *r;
+	size_t allocated;
+	int bytes;
+};
+
+static int rle_reserve(struct rle_encoder *e, size_t n)
+{
+	unsigned char *data;
+	size_t allocated = e->allocated;
+
+	if (e->r->size + n <= allocated)
+		return 0;
+
+	while (allocated < e->r->size + n)
+		allocated = (allocated) ? allocated * 2 : 4096;
+
+	data = realloc(e->r->data, allocated);
+	if (!data)
+		return -1;
+
+	e->r->data = data;
+	e->allocated = allocated;
+
+	return 0;
+}
+
+/* Bytes of pixels following the header of a run */
+static inline size_t rle_run_size(int kind, int n, int bytes)
+{
+	switch (kind) {
+	case RLE_FILL:
+		return bytes;
+	case RLE_SKIP:
+		return 0;
+	case RLE_BLEND:
+		return (size_t)n * sizeof(uint32_t);
+	default:
+		return (size_t)n * bytes;
+	}
+}
+
+static int rle_put_run(struct rle_encoder *e, int kind, const void *pixels,
+		int count)
+{
+	while (count) {
+		int n = (count > RLE_MAX_RUN) ? RLE_MAX_RUN : count;
+		size_t pixels_size = rle_run_size(kind, n, e->bytes);
+		uint16_t header = n | kind;
+
+		if (rle_reserve(e, sizeof(header) + pixels_size))
+			return -1;
+
+		memcpy(e->r->data + e->r->size, &header, sizeof(header));
+		if (pixels_size)
+			memcpy(e->r->data + e->r->size + sizeof(header),
+					pixels, pixels_size);
+		e->r->size += sizeof(header) + pixels_size;
+
+		count -= n;
+		if (kind != RLE_FILL)
+			pixels = (const unsigned char *)pixels + pixels_size;
+	}
+
+	return 0;
+}
+
+/* Encode pixels as fill runs where they repeat and literal runs elsewhere */
+static int rle_put_pixels(struct rle_encoder *e, const unsigned char *in,
+		int width)
+{
+	const int bytes = e->bytes;
+	int literal = 0; /* Start of the pending literal run */
+	int x = 0;
+
+	while (x < width) {
+		int n = 1;
+
+		while (x + n < width && !memcmp(in + x * bytes,
+				in + (x + n) * bytes, bytes))
+			++n;
+
+		if (n >= RLE_MIN_FILL) {
+			if (rle_put_run(e, RLE_LITERAL, in + literal * bytes,
+					x - literal)
+					|| rle_put_run(e, RLE_FILL,
+						in + x * bytes, n))
+				return -1;
+			literal = x + n;
+		}
+		x += n;
+	}
+
+	return rle_put_run(e, RLE_LITERAL, in + literal * bytes,
+			width - literal);
+}
+
+static struct rle_image *rle_alloc(int height)
+{
+	struct rle_image *r = calloc(1, sizeof(*r));
+
+	if (!r)
+		return NULL;
+
+	r->rows = malloc(height * sizeof(*r->rows));
+	if (!r->rows) {
+		free(r);
+		return NULL;
+	}
+
+	return r;
+}
+
+static void rle_shrink(struct rle_encoder *e)
+{
+	if (e->r->size < e->allocated) {
+		unsigned char *data = realloc(e->r->data, e->r->size);
+
+		if (data)
+			e->r->data = data;
+	}
+}
+
+/**
+ * Encode a bitmap into runs. Returns NULL if it does not compress well
+ * enough to be worth the decoding, or on memory shortage.
+ */
+struct rle_image *rle_encode(const void *pixels, int width, int height,
+		int bytes)
+{
+	const unsigned char *in = pixels;
+	struct rle_encoder e = { .bytes = bytes, };
+	const size_t raw_size = (size_t)width * height * bytes;
+	int y;
+
+	e.r = rle_alloc(height);
+	if (!e.r)
+		return NULL;
+
+	for (y = 0; y < height; ++y, in += width * bytes) {
+		e.r->rows[y] = e.r->size;
+
+		if (rle_put_pixels(&e, in, width))
+			goto fail;
+
+		if (e.r->size >= raw_size / 4 * 3)
+			goto fail;
+	}
+
+	rle_shrink(&e);
+
+	return e.r;
+
+fail:
+	rle_free(e.r);
+	return NULL;
+}
+
+static inline int rle_pixel_kind(uint32_t argb, const uint32_t *key)
+{
+	if (key && !((argb ^ *key) & RLE_KEY_MASK))
+		return RLE_TRANSPARENT;
+
+	switch (argb >> 24) {
+	case 0:
+		return RLE_TRANSPARENT;
+	case 0xFF:
+		return RLE_OPAQUE;
+	default:
+		return RLE_TRANSLUCENT;
+	}
+}
+
+static void premultiply_line(uint32_t *out, const uint32_t *in, int width)
+{
+	int j;
+
+	for (j = 0; j < width; ++j) {
+		const uint32_t a = in[j] >> 24;
+		uint32_t w = a << 24;
+		int shift;
+
+		for (shift = 0; shift < 24; shift += 8) {
+			uint32_t c = ((in[j] >> shift) & 0xFF) * a + 128;
+
+			w |= ((c + (c >> 8)) >> 8) << shift;
+		}
+		out[j] = w;
+	}
+}
+
+/**
+ * Encode an ARGB32 bitmap to be put over the screen contents. Each row is
+ * split into transparent runs, which are skipped, opaque runs converted
+ * into the screen format 'f', and translucent runs kept premultiplied for
+ * blending. With 'key', pixels of that colour are transparent as well.
+ * Returns NULL on memory shortage.
+ */
+struct rle_image *rle_encode_alpha(const uint32_t *argb, int width,
+		int height, const struct pixel_format *f, const uint32_t *key)
+{
+	struct rle_encoder e = { .bytes = pixel_bytes(f), };
+	uint32_t *line = malloc(width * sizeof(*line));
+	int x, y;
+
+	e.r = (line) ? rle_alloc(height) : NULL;
+	if (!e.r) {
+		free(line);
+		return NULL;
+	}
+
+	for (y = 0; y < height; ++y, argb += width) {
+		e.r->rows[y] = e.r->size;
+
+		for (x = 0; x < width; ) {
+			const int kind = rle_pixel_kind(argb[x], key);
+			int n = 1, rc;
+
+			while (x + n < width && kind
+					== rle_pixel_kind(argb[x + n], key))
+				++n;
+
+			switch (kind) {
+			case RLE_TRANSPARENT:
+				rc = rle_put_run(&e, RLE_SKIP, NULL, n);
+				break;
+
+			case RLE_OPAQUE:
+				pixel_pack_line(f, line, argb + x, n);
+				rc = rle_put_pixels(&e,
+						(unsigned char *)line, n);
+				break;
+
+			default:
+				premultiply_line(line, argb + x, n);
+				rc = rle_put_run(&e, RLE_BLEND, line, n);
+				break;
+			}
+
+			if (rc)
+				goto fail;
+			x += n;
+		}
+	}
+
+	free(line);
+	rle_shrink(&e);
+
+	return e.r;
+
+fail:
+	free(line);
+	rle_free(e.r);
+	return NULL;
+}
+
+static inline void rle_fill(void *out, const unsigned char *pixel, int count,
+		int bytes)
+{
+	uint32_t value = 0;
+
+	memcpy(&value, pixel, bytes);
+	switch (bytes) {
+	case 2:
+		pixel_fill16(out, value, count);
+		break;
+
+	case 4:
+		pixel_fill32(out, value, count);
+		break;
+
+	default:
+		pixel_fill24(out, value, count);
+		break;
+	}
+}
+
+/**
+ * Decode 'width' pixels of a row starting from pixel 'from' into 'out'.
+ * Transparent pixels are left as they are in 'out', translucent ones are
+ * blended over the pixels at 'under', or over 'out' if it is NULL.
+ */
+void rle_blit_row(const struct rle_image *r, int row, int from, int width,
+		const struct pixel_format *f, void *out, const void *under)
+{
+	const int bytes = pixel_bytes(f);
+	const unsigned char *in = r->data + r->rows[row];
+	const unsigned char *u = under;
+	unsigned char *o = out;
+
+	while (width > 0) {
+		uint16_t header;
+		int n, kind;
+
+		memcpy(&header, in, sizeof(header));
+		in += sizeof(header);
+		n = header & RLE_MAX_RUN;
+		kind = header & RLE_KIND;
+
+		if (from >= n) { /* Run entirely to the left of the window */
+			from -= n;
+			in += rle_run_size(kind, n, bytes);
+			continue;
+		}
+
+		n -= from;
+		if (n > width)
+			n = width;
+
+		switch (kind) {
+		case RLE_FILL:
+			rle_fill(o, in, n, bytes);
+			in += bytes;
+			break;
+
+		case RLE_SKIP:
+			break;
+
+		case RLE_BLEND:
+			pixel_blend_line(f, o, in + from * sizeof(uint32_t),
+					(u) ? u : o, n);
+			in += (from + n) * sizeof(uint32_t);
+			break;
+
+		default:
+			memcpy(o, in + from * bytes, n * bytes);
+			in += (from + n) * bytes;
+			break;
+		}
+
+		o += n * bytes;
+		if (u)
+			u += n * bytes;
+		width -= n;
+		from = 0;
+	}
+}
+
+/**
+ * Tell for each pixel of a row whether it is RLE_TRANSPARENT, RLE_OPAQUE or
+ * RLE_TRANSLUCENT
+ */
+void rle_row_coverage(const struct rle_image *r, int row, int width,
+		int bytes, unsigned char *coverage)
+{
+	const unsigned char *in = r->data + r->rows[row];
+	int x = 0;
+
+	while (x < width) {
+		uint16_t header;
+		int n, kind;
+
+		memcpy(&header, in, sizeof(header));
+		in += sizeof(header);
+		n = header & RLE_MAX_RUN;
+		kind = header & RLE_KIND;
+
+		if (n > width - x)
+			n = width - x;
+		memset(coverage + x, (kind == RLE_SKIP) ? RLE_TRANSPARENT
+				: (kind == RLE_BLEND) ? RLE_TRANSLUCENT
+				: RLE_OPAQUE, n);
+		in += rle_run_size(kind, header & RLE_MAX_RUN, bytes);
+		x += n;
+	}
+}
+
+void rle_free(struct rle_image *r)
+{
+	if (!r)
+		return;
+
+	free(r->rows);
+	free(r->data);
+	free(r);
+}
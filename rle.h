@@ -0,0 +1,49 @@
+/*
+ *  Run-length encoded frames
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _RLE_H
+#define _RLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+struct pixel_format;
+
+/* How a frame covers a pixel */
+#define RLE_TRANSPARENT		0
+#define RLE_OPAQUE		1
+#define RLE_TRANSLUCENT		2
+
+/*
+ * Each row is a sequence of runs. A run starts with a 16-bit header holding
+ * the run length in pixels and its kind. A fill run is followed by a single
+ * pixel value, a literal run by all of its pixels. Frames blended over the
+ * screen also have transparent runs, with no pixels, and translucent ones,
+ * followed by premultiplied ARGB32 pixels.
+ */
+struct rle_image {
+	unsigned int *rows; /* Offset of each row in data */
+	unsigned char *data;
+	size_t size; /* Bytes in data */
+};
+
+struct rle_image *rle_encode(const void *pixels, int width, int height,
+		int bytes);
+struct rle_image *rle_encode_alpha(const uint32_t *argb, int width,
+		int height, const struct pixel_format *f, const uint32_t *key);
+void rle_blit_row(const struct rle_image *r, int row, int from, int width,
+		const struct pixel_format *f, void *out, const void *under);
+void rle_row_coverage(const struct rle_image *r, int row, int width,
+		int bytes, unsigned char *coverage);
+void rle_free(struct rle_image *r);
+
+#endif /* _RLE_H */
@@ -0,0 +1,343 @@
+/*
+ *  Resampling of frames to the screen size
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#include "fb.h"
+#include "log.h"
+#include "pixel.h"
+#include "scale.h"
+
+/* Weights of bilinear samples, small enough for two to add up in 16 bits */
+#define WEIGHT_BITS	7
+#define WEIGHT_ONE	(1 << WEIGHT_BITS)
+
+/* A source pixel and the weight of the one after it */
+struct scale_tap {
+	int from;
+	unsigned int weight;
+};
+
+/* ARGB32 mix of a and b with 'w' / WEIGHT_ONE of b, two channels at once */
+static inline uint32_t lerp_argb32(uint32_t a, uint32_t b, unsigned int w)
+{
+	const unsigned int v = WEIGHT_ONE - w;
+	uint32_t rb = (a & 0x00FF00FF) * v + (b & 0x00FF00FF) * w;
+	uint32_t ag = (a >> 8 & 0x00FF00FF) * v + (b >> 8 & 0x00FF00FF) * w;
+
+	rb = (rb + 0x00400040) >> WEIGHT_BITS & 0x00FF00FF;
+	ag = (ag + 0x00400040) << (8 - WEIGHT_BITS) & 0xFF00FF00;
+
+	return rb | ag;
+}
+
+/* Per-byte average rounded up, as SSE2 and NEON compute it */
+static inline uint32_t avg_argb32(uint32_t a, uint32_t b)
+{
+	return (a | b) - ((a ^ b) >> 1 & 0x7F7F7F7F);
+}
+
+static void lerp_line(uint32_t *out, const uint32_t *a, const uint32_t *b,
+		unsigned int w, int count)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	const __m128i zero = _mm_setzero_si128();
+	const __m128i wa = _mm_set1_epi16((short)(WEIGHT_ONE - w));
+	const __m128i wb = _mm_set1_epi16((short)w);
+	const __m128i round = _mm_set1_epi16(WEIGHT_ONE / 2);
+
+	for (; i + 4 <= count; i += 4) {
+		__m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+		__m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+		__m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(va, zero), wa);
+		__m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(va, zero), wa);
+
+		va = _mm_unpacklo_epi8(vb, zero);
+		vb = _mm_unpackhi_epi8(vb, zero);
+		lo = _mm_add_epi16(lo, _mm_mullo_epi16(va, wb));
+		hi = _mm_add_epi16(hi, _mm_mullo_epi16(vb, wb));
+		lo = _mm_add_epi16(lo, round);
+		hi = _mm_add_epi16(hi, round);
+		lo = _mm_srli_epi16(lo, WEIGHT_BITS);
+		hi = _mm_srli_epi16(hi, WEIGHT_BITS);
+		_mm_storeu_si128((__m128i *)(out + i),
+				_mm_packus_epi16(lo, hi));
+	}
+#elif defined(__ARM_NEON)
+	const uint8x8_t wa = vdup_n_u8(WEIGHT_ONE - w);
+	const uint8x8_t wb = vdup_n_u8(w);
+
+	for (; i + 4 <= count; i += 4) {
+		uint8x16_t va = vreinterpretq_u8_u32(vld1q_u32(a + i));
+		uint8x16_t vb = vreinterpretq_u8_u32(vld1q_u32(b + i));
+		uint16x8_t lo = vmlal_u8(vmull_u8(vget_low_u8(va), wa),
+				vget_low_u8(vb), wb);
+		uint16x8_t hi = vmlal_u8(vmull_u8(vget_high_u8(va), wa),
+				vget_high_u8(vb), wb);
+
+		vst1q_u32(out + i, vreinterpretq_u32_u8(vcombine_u8(
+				vrshrn_n_u16(lo, WEIGHT_BITS),
+				vrshrn_n_u16(hi, WEIGHT_BITS))));
+	}
+#endif
+
+	for (; i < count; ++i)
+		out[i] = lerp_argb32(a[i], b[i], w);
+}
+
+static void avg_line(uint32_t *out, const uint32_t *a, const uint32_t *b,
+		int count)
+{
+	int i = 0;
+
+#if defined(__SSE2__)
+	for (; i + 4 <= count; i += 4)
+		_mm_storeu_si128((__m128i *)(out + i), _mm_avg_epu8(
+				_mm_loadu_si128((const __m128i *)(a + i)),
+				_mm_loadu_si128((const __m128i *)(b + i))));
+#elif defined(__ARM_NEON)
+	for (; i + 4 <= count; i += 4)
+		vst1q_u32(out + i, vreinterpretq_u32_u8(vrhaddq_u8(
+				vreinterpretq_u8_u32(vld1q_u32(a + i)),
+				vreinterpretq_u8_u32(vld1q_u32(b + i)))));
+#endif
+
+	for (; i < count; ++i)
+		out[i] = avg_argb32(a[i], b[i]);
+}
+
+/*
+ * Halve the width, the height or both by averaging pairs of pixels, in
+ * place. An odd last column or row is dropped.
+ */
+static void halve(uint32_t *p, int *width, int *height, int x, int y)
+{
+	const int w = *width, h = (y) ? *height / 2 : *height;
+	const int half = (x) ? w / 2 : w;
+	int i, j;
+
+	for (j = 0; j < h; ++j) {
+		uint32_t *out = p + (size_t)j * half;
+		uint32_t *in = p + (size_t)j * ((y) ? 2 : 1) * w;
+
+		/* Pixels are written no further than they are read */
+		if (y)
+			avg_line(in, in, in + w, w);
+
+		if (x)
+			for (i = 0; i < half; ++i)
+				out[i] = avg_argb32(in[2 * i], in[2 * i + 1]);
+		else if (out != in)
+			memmove(out, in, w * sizeof(*in));
+	}
+
+	*width = half;
+	*height = h;
+}
+
+/* x * a / 255 for each colour channel of an ARGB32 pixel */
+static inline uint32_t premultiply(uint32_t p)
+{
+	const uint32_t a = p >> 24;
+	uint32_t rb = (p & 0x00FF00FF) * a + 0x00800080;
+	uint32_t g = (p & 0x0000FF00) * a + 0x00008000;
+
+	rb = (rb + (rb >> 8 & 0x00FF00FF)) >> 8 & 0x00FF00FF;
+	g = (g + (g >> 8 & 0x0000FF00)) >> 8 & 0x0000FF00;
+
+	return (p & 0xFF000000) | rb | g;
+}
+
+static inline uint32_t unpremultiply(uint32_t p)
+{
+	const uint32_t a = p >> 24;
+	uint32_t v = p & 0xFF000000;
+	int shift;
+
+	if (a == 0xFF || !a)
+		return p;
+
+	for (shift = 0; shift < 24; shift += 8) {
+		uint32_t c = ((p >> shift & 0xFF) * 255 + a / 2) / a;
+
+		v |= ((c > 255) ? 255 : c) << shift;
+	}
+
+	return v;
+}
+
+/*
+ * Source pixel and weight for each of 'count' pixels starting at 'first'
+ * of 'to' pixels the 'from' ones are stretched to, sampled at pixel centres
+ */
+static void scale_taps(struct scale_tap *taps, int count, int first, int to,
+		int from)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		long long p = ((2LL * (first + i) + 1) * from << 16)
+				/ (2LL * to) - 0x8000;
+
+		if (p < 0)
+			p = 0;
+		taps[i].from = (int)(p >> 16);
+		taps[i].weight = (p & 0xFFFF) >> (16 - WEIGHT_BITS);
+		if (taps[i].from >= from - 1) {
+			taps[i].from = from - 1;
+			taps[i].weight = 0;
+		}
+	}
+}
+
+static void scale_row(uint32_t *out, const uint32_t *in,
+		const struct scale_tap *taps, int count)
+{
+	int i;
+
+	for (i = 0; i < count; ++i) {
+		const struct scale_tap *t = &taps[i];
+
+		out[i] = lerp_argb32(in[t->from], in[t->from + !!t->weight],
+				t->weight);
+	}
+}
+
+/* Size of the image scaled to the target keeping its proportions */
+static void scale_size(const struct scale_target *t, int width, int height,
+		int *w, int *h)
+{
+	long long by_width = (long long)width * t->height;
+	long long by_height = (long long)height * t->width;
+
+	/* Fit takes the side that reaches the target first, fill the other */
+	if ((by_width <= by_height) == (t->mode == SCALE_FIT)) {
+		*h = t->height;
+		*w = (int)((by_width + height / 2) / height);
+	} else {
+		*w = t->width;
+		*h = (int)((by_height + width / 2) / width);
+	}
+
+	if (*w < 1)
+		*w = 1;
+	if (*h < 1)
+		*h = 1;
+}
+
+/**
+ * Size of an image of 'width' x 'height' pixels once it is scaled to the
+ * target
+ */
+void scale_image_size(const struct scale_target *t, int width, int height,
+		int *w, int *h)
+{
+	scale_size(t, width, height, w, h);
+	if (*w > t->width)
+		*w = t->width;
+	if (*h > t->height)
+		*h = t->height;
+}
+
+/**
+ * Resample an ARGB32 image to fit or fill the target and convert it into
+ * the given format. Halving by box filters brings the image to less than
+ * twice the size, then it is interpolated bilinearly. Channels are weighted
+ * by alpha if the format has one, so transparent pixels do not bleed. The
+ * result goes to 'room' if it fits there.
+ */
+int scale_image(struct image_info *image, const struct scale_target *t,
+		const struct pixel_format *format, const struct pixel_room *room)
+{
+	const int alpha = format->transp.length != 0;
+	const int bytes = pixel_bytes(format);
+	uint32_t *src = image->pixel_buffer;
+	int sw = image->width, sh = image->height;
+	int w, h, out_w, out_h, i, j;
+	struct scale_tap *xtaps, *ytaps;
+	uint32_t *rows, *line;
+	int cached[2] = { -1, -1 };
+	unsigned char *out;
+
+	scale_size(t, sw, sh, &w, &h);
+	out_w = (w < t->width) ? w : t->width;
+	out_h = (h < t->height) ? h : t->height;
+
+	out = pixel_room_alloc(room, (size_t)out_w * out_h * bytes);
+	xtaps = malloc(out_w * sizeof(*xtaps));
+	ytaps = malloc(out_h * sizeof(*ytaps));
+	rows = malloc(3 * (size_t)out_w * sizeof(*rows));
+	if (!out || !xtaps || !ytaps || !rows) {
+		pixel_room_free(room, out);
+		free(xtaps);
+		free(ytaps);
+		free(rows);
+		ERR_RET(-1, "could not allocate memory");
+	}
+	line = rows + 2 * (size_t)out_w;
+
+	if (alpha)
+		for (i = 0; i < sw * sh; ++i)
+			src[i] = premultiply(src[i]);
+
+	while (sw >= 2 * w || sh >= 2 * h)
+		halve(src, &sw, &sh, sw >= 2 * w, sh >= 2 * h);
+
+	/* Fill takes the middle of the scaled image */
+	scale_taps(xtaps, out_w, (w - out_w) / 2, w, sw);
+	scale_taps(ytaps, out_h, (h - out_h) / 2, h, sh);
+
+	for (j = 0; j < out_h; ++j) {
+		const int r[2] = { ytaps[j].from,
+				ytaps[j].from + !!ytaps[j].weight };
+		unsigned char *o = out + (size_t)j * out_w * bytes;
+
+		/* Rows next to each other are cached in different halves */
+		for (i = 0; i < 2; ++i)
+			if (cached[r[i] & 1] != r[i]) {
+				scale_row(rows + (r[i] & 1) * (size_t)out_w,
+						src + (size_t)r[i] * sw,
+						xtaps, out_w);
+				cached[r[i] & 1] = r[i];
+			}
+
+		lerp_line(line, rows + (r[0] & 1) * (size_t)out_w,
+				rows + (r[1] & 1) * (size_t)out_w,
+				ytaps[j].weight, out_w);
+		if (alpha)
+			for (i = 0; i < out_w; ++i)
+				line[i] = unpremultiply(line[i]);
+		pixel_pack_line(format, o, line, out_w);
+	}
+
+	free(xtaps);
+	free(ytaps);
+	free(rows);
+	free(image->pixel_buffer);
+	image->pixel_buffer = out;
+	image->width = out_w;
+	image->height = out_h;
+	image->bpp = format->bpp;
+	image->stride = 0;
+
+	return 0;
+}
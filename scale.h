@@ -0,0 +1,34 @@
+/*
+ *  Resampling of frames to the screen size
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _SCALE_H
+#define _SCALE_H
+
+struct image_info;
+struct pixel_format;
+struct pixel_room;
+
+#define SCALE_FIT	1 /* The whole frame is in the area */
+#define SCALE_FILL	2 /* The frame covers the area and is cropped to it */
+
+struct scale_target {
+	int mode; /* SCALE_* */
+	int width; /* Area frames are scaled to, in pixels */
+	int height;
+};
+
+void scale_image_size(const struct scale_target *t, int width, int height,
+		int *w, int *h);
+int scale_image(struct image_info *image, const struct scale_target *t,
+		const struct pixel_format *format, const struct pixel_room *room);
+
+#endif /* _SCALE_H */
@@ -0,0 +1,212 @@
+/*
+ *  Run-time statistics of the animation
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "animation.h"
+#include "fb.h"
+#include "log.h"
+#include "rle.h"
+#include "stats.h"
+
+/* Pages whose residency is asked for at once */
+#define STATS_MINCORE_PAGES	256
+
+static volatile sig_atomic_t _requested;
+
+/**
+ * Ask for the statistics to be logged as soon as the animation gets to it.
+ * Safe to call from a signal handler.
+ */
+void stats_request(void)
+{
+	_requested = 1;
+}
+
+/**
+ * Log the statistics if they have been asked for by stats_request()
+ */
+void stats_poll(struct animation *a)
+{
+	if (!_requested)
+		return;
+
+	_requested = 0;
+	stats_dump(a);
+}
+
+static int compare_int(const void *a, const void *b)
+{
+	return (*(const int *)a > *(const int *)b)
+			- (*(const int *)a < *(const int *)b);
+}
+
+/**
+ * Log how far from the schedule the recent frames have been presented
+ */
+void stats_log_timing(struct animation *a, int priority)
+{
+	int samples[ANIMATION_TIMING_SAMPLES];
+	unsigned int n = (a->presented < ANIMATION_TIMING_SAMPLES)
+			? a->presented : ANIMATION_TIMING_SAMPLES;
+
+	if (!n)
+		return;
+
+	memcpy(samples, a->lateness_us, n * sizeof(*samples));
+	qsort(samples, n, sizeof(*samples), compare_int);
+
+	LOG(priority, "Presentation against schedule over the last %u frames,"
+			" us: min %d, p50 %d, p90 %d, p99 %d, max %d;"
+			" %u frames dropped, %u times behind schedule", n,
+			samples[0], samples[n / 2], samples[n * 9 / 10],
+			samples[n * 99 / 100], samples[n - 1],
+			a->dropped, a->late);
+}
+
+/*
+ * Bytes of a buffer that are in memory, by the pages mincore() finds
+ * resident, whether the buffer is on the heap, in the arena or mapped from
+ * a pack. Pages the buffer only partly covers count in full, up to its
+ * size. If mincore() fails the whole buffer is taken as resident.
+ */
+static size_t stats_resident(const void *buffer, size_t size)
+{
+	const size_t page = sysconf(_SC_PAGESIZE);
+	uintptr_t start = (uintptr_t)buffer & ~(page - 1);
+	const uintptr_t end = (uintptr_t)buffer + size;
+	unsigned char vec[STATS_MINCORE_PAGES];
+	size_t resident = 0;
+
+	while (start < end) {
+		size_t pages = (end - start + page - 1) / page;
+		size_t i;
+
+		if (pages > STATS_MINCORE_PAGES)
+			pages = STATS_MINCORE_PAGES;
+
+		if (mincore((void *)start, pages * page, vec))
+			return size;
+
+		for (i = 0; i < pages; ++i)
+			if (vec[i] & 1)
+				resident += page;
+		start += pages * page;
+	}
+
+	return (resident < size) ? resident : size;
+}
+
+/* Bytes held by the loaded frames and how many of them are resident */
+static void stats_frame_memory(struct animation *a, size_t *size,
+		size_t *resident)
+{
+	const int ready = animation_frames_ready(a);
+	int i;
+
+	*size = *resident = 0;
+
+	for (i = 0; i < ready; ++i) {
+		const struct image_info *frame = &a->frames[i];
+
+		if (frame->rle) {
+			size_t bytes = frame->rle->size
+					+ frame->height * sizeof(*frame->rle->rows);
+
+			*size += bytes;
+			*resident += bytes;
+		} else {
+			size_t bytes = (size_t)frame->width * frame->height
+					* (frame->bpp / 8);
+			size_t palette = (frame->palette) ? FB_PALETTE_SIZE
+					* sizeof(*frame->palette) : 0;
+
+			*size += bytes + palette;
+			*resident += stats_resident(frame->pixel_buffer, bytes)
+					+ palette;
+		}
+	}
+}
+
+/* Frames per second, over the last second if frames are being shown */
+static double stats_fps(struct animation *a)
+{
+	struct timespec now;
+	double elapsed;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	elapsed = (now.tv_sec - a->fps_since.tv_sec)
+			+ (now.tv_nsec - a->fps_since.tv_nsec) / 1e9;
+
+	/* Not measured yet, or the animation is paused and the rate stale */
+	if ((!a->fps || elapsed > 2.0) && elapsed > 0)
+		return a->fps_frames / elapsed;
+
+	return a->fps;
+}
+
+/**
+ * Log the frame timing, frame buffer and memory statistics, the latter for
+ * each sprite layer as well
+ */
+void stats_dump(struct animation *a)
+{
+	const struct screen_info *fb = a->fb;
+	struct animation *l;
+	char histogram[FB_BLIT_BUCKETS * 24];
+	size_t size, resident;
+	int len = 0;
+	unsigned int i;
+
+	LOG(LOG_INFO, "Frames: %u shown, %u dropped, %u times behind schedule,"
+			" %.1f fps", a->frames_shown, a->dropped, a->late,
+			stats_fps(a));
+
+	stats_log_timing(a, LOG_INFO);
+
+	if (a->command_latency_max_us)
+		LOG(LOG_INFO, "Commands shown in %u us, at most %u us",
+				a->command_latency_us,
+				a->command_latency_max_us);
+
+	for (i = 0; i < FB_BLIT_BUCKETS; ++i)
+		if (fb->blit_us[i])
+			len += snprintf(histogram + len, sizeof(histogram) - len,
+					" %s%uus:%u",
+					(i == FB_BLIT_BUCKETS - 1) ? ">=" : "<",
+					1U << ((i == FB_BLIT_BUCKETS - 1) ? i - 1 : i),
+					fb->blit_us[i]);
+	histogram[len] = '\0';
+
+	LOG(LOG_INFO, "Frame buffer: %llu bytes written in %llu blits;"
+			" blit times%s", fb->bytes_written, fb->blits,
+			(len) ? histogram : " none");
+
+	stats_frame_memory(a, &size, &resident);
+	LOG(LOG_INFO, "Memory: %d of %d frames loaded, %zu bytes, %zu resident",
+			animation_frames_ready(a), animation_frame_count(a),
+			size, resident);
+
+	for (l = a->next_layer, i = 1; l; l = l->next_layer, ++i) {
+		stats_frame_memory(l, &size, &resident);
+		LOG(LOG_INFO, "Layer %u at %d,%d: %d of %d frames loaded,"
+				" %zu bytes, %zu resident", i, l->x, l->y,
+				animation_frames_ready(l),
+				animation_frame_count(l), size, resident);
+	}
+}
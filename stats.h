@@ -0,0 +1,23 @@
+/*
+ *  Run-time statistics of the animation
+ *
+ *  Copyright (C) 2012 Alexander Lukichev
+ *
+ *  Alexander Lukichev <alexander.lukichev@gmail.com>
+ *
+ *  This program is free software; you can redistribute it and/or
+ *  modify it under the terms of the GNU General Public License
+ *  version 2 as published by the Free Software Foundation.
+ */
+
+#ifndef _STATS_H
+#define _STATS_H
+
+struct animation;
+
+void stats_request(void);
+void stats_poll(struct animation *a);
+void stats_dump(struct animation *a);
+void stats_log_timing(struct animation *a, int priority);
+
+#endif /* _STATS_H */